@@ -2,9 +2,16 @@
  * client.c
  * 改进后的文件传输客户端，支持断点续传（与 server.c 协议匹配）
  *
- * Usage: client upload|download <server_ip> <server_port> <filename>
+ * Usage: client [-b checkpoint_bytes] [-t checkpoint_secs] [-c connections] [-z lz4|zstd|auto[:level]] [-k] [-n] [-d|-D]
+ *               upload|download <server_ip> <server_port> <filename>...
+ *        client bulk <server_ip> <server_port> <file|dir>...
  *
  * 协议（network byte order, no terminating NULs）:
+ * 0) 握手（v2）：client -> server: uint32_t PROTO_MAGIC, uint32_t version, uint32_t caps
+ *               server -> client: uint32_t PROTO_MAGIC, uint32_t version, uint32_t caps（双方共有）
+ *    魔数远大于 mode_len 的上限，旧服务端会把它当作非法请求直接断开，
+ *    客户端随后重连并按旧格式（不握手，caps 为空）继续；旧客户端不发握手，服务端照旧处理。
+ *    协商出 CAP_LZ4 或 CAP_ZSTD 时，客户端收到回复后再发 int32_t level（0 表示该编码的默认级别）。
  * 1) client -> server: uint32_t mode_len, mode bytes (mode_len)
  * 2) client -> server: uint32_t name_len, filename bytes (name_len)
  *
@@ -12,13 +19,81 @@
  * 3) client -> server: uint64_t filesize
  * 4) server -> client: uint64_t agreed_offset
  * 5) client -> server: file bytes starting from agreed_offset to EOF
+ * 5b) client -> server（协商出 CAP_REPAIR）: 若干 uint64_t start, uint64_t len, len 字节数据，{0, 0} 结束：
+ *    续传校验发现的服务端坏区间（都在 agreed_offset 之前），服务端写进暂存文件，与尾部一起发布
+ * 6) server -> client（协商出 CAP_ACK）: uint64_t filesize, uint32_t crc（整个文件的 CRC32C），
+ *    在文件发布并落盘之后才发；发布失败时服务端直接断开，客户端收不到确认即视为未完成
  *
  * download:
  * 3) client -> server: uint64_t client_offset
  * 4) server -> client: uint64_t filesize, uint64_t server_offset
  * 5) server -> client: file bytes starting from server_offset to EOF
  *
- * 本地会生成 <filename>.progress 用于记录已发送/已接收字节数（写入是原子性的）
+ * 分帧（握手协商出 CAP_CHECKSUM、CAP_LZ4 或 CAP_ZSTD）：upload/download 第 5 步的数据改为分帧发送，
+ *    每帧 uint32_t codec, uint32_t raw_len, uint32_t wire_len, uint32_t crc, wire_len 字节，
+ *    codec 0 为原始数据（压不小的块直接旁路），1 为 LZ4，2 为 Zstandard；raw_len 不超过 128KB。
+ *    crc 为该帧原始数据的 CRC32C（未协商 CAP_CHECKSUM 时为 0），接收端校验不符即断开，该帧不落盘。
+ *    CAP_LZ4 与 CAP_ZSTD 都协商出时（-z auto）发送端逐块自选编码，接收端只看帧头。
+ *    分段与批量传输不分帧。
+ *
+ * upload_range（-c N 时把文件拆成 N 段，每段一条连接）:
+ * 3) client -> server: uint64_t filesize, uint64_t range_start, uint64_t range_end
+ * 4) server -> client: uint64_t range_start（就绪）
+ * 5) client -> server: bytes [range_start, range_end)
+ *    server -> client: 每写入 8MB 回一个 uint64_t 已写入位置，fsync 后回 range_end
+ *    协商出 CAP_RANGE_STAGE 时各段写进服务端的 <filename>.range.part，目标文件不变；所有段都确认后
+ *    客户端再发一个 range_start == range_end == filesize 的 upload_range 提交，服务端改名发布后回两个 filesize。
+ *
+ * download_range:
+ * 3) client -> server: uint64_t range_start, uint64_t range_end（相等时只查询大小）
+ * 4) server -> client: uint64_t filesize
+ * 5) server -> client: bytes [range_start, min(range_end, filesize))
+ *
+ * upload_bulk（bulk 模式，filename 字段为服务端目标目录 "."）:
+ * 3) client -> server: 若干记录 uint32_t name_len, name, uint64_t size, size 字节数据；
+ *                      name_len 为 0 表示结束
+ *    服务端把每个文件写进同目录的临时文件，每 64 个一批按服务端 -S 逐个 fsync 后改名发布
+ * 4) server -> client: uint64_t 写入的文件数（剩下的文件及涉及的目录按服务端 -S 落盘之后）
+ *
+ * upload_delta（-d，协商出 CAP_DELTA）:
+ * 3) client -> server: uint64_t filesize
+ * 4) server -> client: uint64_t old_size, uint32_t block, uint32_t nblocks,
+ *                      nblocks 个 {uint32_t weak, uint32_t crc}（旧文件每个完整块的滚动弱校验与 CRC32C）
+ * 5) client -> server: 指令流，每条 uint32_t type 开头：
+ *      1 复制：uint32_t count, uint64_t index（旧文件第 index 块起连续 count 块）
+ *      2 字面：uint32_t len（不超过 128KB）, len 字节
+ *      0 结束：uint32_t crc（整个新文件的 CRC32C）
+ * 6) server -> client: uint64_t 新文件大小（重建到临时文件、校验通过、fsync 并改名之后），
+ *                      大小或 CRC 不符时为 REPLY_ERROR，旧文件保持不变
+ *
+ * upload_dedup（-D，服务端以 -D 启用去重存储时协商出 CAP_DEDUP）:
+ * 3) client -> server: uint64_t filesize, uint64_t nchunks，随后 nchunks 条 {uint8_t sha256[32], uint32_t len}
+ *    （FastCDC 切块，块长 16KB~256KB）
+ * 4) server -> client: uint64_t nneed, nneed 个 uint32_t 块序号（升序，存储里没有的块）
+ * 5) client -> server: 这些块的数据，按序首尾相接
+ * 6) server -> client: uint64_t filesize（块已入库、清单已落盘），失败为 REPLY_ERROR
+ *
+ * hash_tree（协商出 CAP_VERIFY，续传前比对已有前缀）:
+ * 3) client -> server: uint64_t length（客户端已有的长度）
+ * 4) server -> client: uint64_t filesize（文件不存在为 0）, uint64_t root
+ *    双方对 [0, L = min(length, filesize)) 建哈希树：每 1MB 一个叶子（CRC32C），每 16 个子节点
+ *    哈希按网络字节序拼接后的 CRC32C 为父节点。L 为 0 时请求到此结束。
+ * 5) client -> server: uint32_t level, uint32_t count, count 个 uint64_t 节点序号（第 level 层）
+ *    server -> client: 这些节点的全部子节点哈希（uint32_t，按序）
+ *    从根开始逐层只展开哈希不同的节点，count 为 0 时结束。坏叶子对应的区间
+ *    上传时在尾部之后按 5b) 补发（服务端需支持 CAP_REPAIR，否则上传不做校验），下载时在续传前用 download_range 取回。
+ *
+ * 会话模式（握手协商出 CAP_PIPELINE）：一个请求结束后连接不关闭，客户端接着发下一个请求，
+ * 下载请求可以在上一个回复收完之前提前发出，服务端按序回复。文件无法打开时服务端按该请求
+ * 回复的字数回 REPLY_ERROR（全 1），连接继续可用。命令行给出多个文件时使用会话模式。
+ *
+ * 本地会生成 <filename>.progress 用于记录已发送/已接收字节数（写入是原子性的）。
+ * 进度按检查点策略落盘：每传输 checkpoint_bytes 字节或每隔 checkpoint_secs 秒一次
+ * （任一为 0 表示不按该条件），下载时先 fsync 数据再写进度，续传从进度记录处开始。
+ * 分段传输时进度文件记录每一段的完成情况：
+ *   ranges <filesize> <n>
+ *   <start> <end> <done>     （共 n 行）
+ * 存在这样的进度文件时，无论 -c 取多少都按其中的分段续传。
  */
 
 #define _GNU_SOURCE
@@ -34,10 +109,104 @@
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <endian.h>
 #include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define CHUNK 8192
+#define DEFAULT_CHECKPOINT_BYTES (64ULL * 1024 * 1024)
+#define DEFAULT_CHECKPOINT_SECS 1.0
+
+/* 进度检查点策略：满足任一条件就落盘一次，避免每个 CHUNK 都 fsync + rename */
+struct checkpoint {
+    uint64_t every_bytes;  /* 0 表示不按字节数 */
+    double every_secs;     /* 0 表示不按时间 */
+    uint64_t last_pos;
+    double last_time;
+};
+
+static uint64_t g_checkpoint_bytes = DEFAULT_CHECKPOINT_BYTES;
+static double g_checkpoint_secs = DEFAULT_CHECKPOINT_SECS;
+
+#define RANGE_MIN_SIZE (4ULL * 1024 * 1024)  /* 每段至少 4MB，再小拆分不划算 */
+#define RANGE_BUF (64 * 1024)
+#define MAX_CONNECTIONS 64
+#define PIPELINE_DEPTH 16  /* 会话模式下最多提前发出的下载请求数 */
+#define BULK_BUF (256 * 1024)  /* 批量模式的发送缓冲：小文件的记录攒满再发 */
+
+static int g_connections = 1;
+
+/* 版本握手，与 server.c 一致 */
+#define PROTO_MAGIC 0x46547632u  /* "FTv2" */
+#define PROTO_VERSION 2
+#define CAP_RANGES   (1u << 0)   /* upload_range / download_range */
+#define CAP_PIPELINE (1u << 1)   /* 一条连接上连续多个请求 */
+#define CAP_LZ4      (1u << 2)   /* upload/download 数据阶段分帧，LZ4 压缩 */
+#define CAP_CHECKSUM (1u << 3)   /* upload/download 数据阶段分帧，每帧带 CRC32C */
+#define CAP_BULK     (1u << 4)   /* upload_bulk：一个请求打包多个小文件 */
+#define CAP_ZSTD     (1u << 5)   /* 同 CAP_LZ4，Zstandard 压缩 */
+#define CAP_VERIFY   (1u << 6)   /* hash_tree：续传前按哈希树比对已有前缀 */
+#define CAP_DELTA    (1u << 7)   /* upload_delta：按服务端旧文件的块签名只发差异 */
+#define CAP_DEDUP    (1u << 8)   /* upload_dedup：按内容切块，只发服务端存储里没有的块 */
+#define CAP_ACK      (1u << 9)   /* upload 结束时服务端在落盘之后回 {大小, 整个文件的 CRC32C} */
+#define CAP_REPAIR   (1u << 10)  /* upload 数据之后、服务端发布之前补发续传校验发现的坏区间 */
+#define CAP_RANGE_STAGE (1u << 11)  /* upload_range 写服务端暂存文件，各段完成后发提交才发布 */
+#define CLIENT_CAPS (CAP_RANGES | CAP_PIPELINE | CAP_BULK | CAP_VERIFY | CAP_ACK | CAP_REPAIR | CAP_RANGE_STAGE)
+#define REPLY_ERROR UINT64_MAX   /* 会话模式下服务端无法执行请求时的回复值 */
+
+static int g_legacy_server;     /* 对端不认握手，之后的连接直接用旧格式 */
+
+/* 数据阶段分帧，与 server.c 一致 */
+#define FRAME_BLOCK (128 * 1024)
+enum frame_codec { FRAME_RAW, FRAME_LZ4, FRAME_ZSTD, FRAME_CODECS };
+
+static uint32_t g_codec_cap;    /* -z 选择的压缩能力（CAP_LZ4/CAP_ZSTD，auto 时两者都有），0 表示不压缩 */
+static int g_level;             /* 压缩级别，0 表示按编码默认；auto 时为 Zstd 的上档级别 */
+static int g_checksum = 0;      /* -k 开启：请求 CAP_CHECKSUM（数据阶段分帧，逐帧校验） */
+static int g_verify = 1;        /* -n 关闭：不请求 CAP_VERIFY */
+static int g_delta;             /* -d：上传改用增量模式（请求 CAP_DELTA） */
+static int g_dedup;             /* -D：上传改用去重模式（请求 CAP_DEDUP） */
+
+/* 分段传输：文件拆成若干 [start, end)，每段一条连接并发传输 */
+struct range {
+    uint64_t start;
+    uint64_t end;
+    uint64_t done;  /* 已完成的字节：上传以服务端确认写入为准，下载以本地已写入为准 */
+};
+
+struct range_job {
+    const char *server_ip;
+    int server_port;
+    const char *filename;
+    int upload;
+    int fd;                /* 本地文件，各线程用 pread/pwrite 访问 */
+    uint64_t filesize;
+    struct range *ranges;
+    int nranges;
+    pthread_mutex_t lock;  /* 保护 ranges[].done、cp 与进度文件 */
+    struct checkpoint cp;
+    uint64_t moved;        /* 本次运行实际传输的字节 */
+};
+
+struct range_task {
+    struct range_job *job;
+    int idx;
+    int rc;
+};
 
 /* htonll/ntohll: 大小端安全实现 */
 static inline uint64_t htonll(uint64_t v) {
@@ -106,7 +275,7 @@ ssize_t recv_all(int fd, void *buf, size_t len) {
 }
 
 /* 安全写进度：写到 tmp 再 rename */
-static int write_progress_atomic(const char *fname, uint64_t val) {
+static int write_progress_text(const char *fname, const char *text) {
     char prog[4096];
     char prog_tmp[4096];
     snprintf(prog, sizeof(prog), "%s.progress", fname);
@@ -114,7 +283,7 @@ static int write_progress_atomic(const char *fname, uint64_t val) {
 
     FILE *f = fopen(prog_tmp, "w");
     if (!f) return -1;
-    if (fprintf(f, "%" PRIu64 "\n", val) < 0) {
+    if (fputs(text, f) < 0) {
         fclose(f);
         unlink(prog_tmp);
         return -1;
@@ -130,6 +299,23 @@ static int write_progress_atomic(const char *fname, uint64_t val) {
     return 0;
 }
 
+static int write_progress_atomic(const char *fname, uint64_t val) {
+    char text[32];
+    snprintf(text, sizeof(text), "%" PRIu64 "\n", val);
+    return write_progress_text(fname, text);
+}
+
+/* 读取进度文件记录的偏移，不存在或内容无效返回 -1 */
+static int read_progress(const char *fname, uint64_t *val) {
+    char prog[4096];
+    snprintf(prog, sizeof(prog), "%s.progress", fname);
+    FILE *f = fopen(prog, "r");
+    if (!f) return -1;
+    int ok = fscanf(f, "%" SCNu64, val) == 1;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
 /* 删除进度文件 */
 static void remove_progress(const char *fname) {
     char prog[4096];
@@ -144,257 +330,2550 @@ static off_t get_file_size_stat(const char *fname) {
     return st.st_size;
 }
 
-/* 客户端上传 — 注意：按你的要求 upload 不读取本地 progress 偏移，
-   仅发送文件大小，等待服务器给出 agreed_offset，然后从 agreed_offset 发送剩余数据。 */
-int client_upload(int sock, const char *filename) {
-    int rc = -1;
-    FILE *fp = NULL;
-    uint32_t mode_len_net, name_len_net;
-    const char *mode = "upload";
+/* 单调时钟秒数，用于统计传输耗时与吞吐 */
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
 
-    /* 1) send mode */
-    uint32_t mode_len = (uint32_t)strlen(mode);
-    mode_len_net = htonl(mode_len);
-    if (send_all(sock, &mode_len_net, sizeof(mode_len_net)) != sizeof(mode_len_net)) {
-        perror("send mode_len");
-        goto out;
-    }
-    if (send_all(sock, mode, mode_len) != (ssize_t)mode_len) {
-        perror("send mode");
-        goto out;
-    }
+static void checkpoint_init(struct checkpoint *cp, uint64_t pos) {
+    cp->every_bytes = g_checkpoint_bytes;
+    cp->every_secs = g_checkpoint_secs;
+    cp->last_pos = pos;
+    cp->last_time = now_sec();
+}
 
-    /* 2) send filename */
-    uint32_t name_len = (uint32_t)strlen(filename);
-    name_len_net = htonl(name_len);
-    if (send_all(sock, &name_len_net, sizeof(name_len_net)) != sizeof(name_len_net)) {
-        perror("send name_len");
-        goto out;
+/* 是否到了落盘进度的时候；到了就把基准推进到 pos */
+static int checkpoint_due(struct checkpoint *cp, uint64_t pos) {
+    int due = 0;
+    if (cp->every_bytes > 0 && pos - cp->last_pos >= cp->every_bytes) due = 1;
+    if (!due && cp->every_secs > 0) {
+        double now = now_sec();
+        if (now - cp->last_time >= cp->every_secs) due = 1;
     }
-    if (send_all(sock, filename, name_len) != (ssize_t)name_len) {
-        perror("send filename");
-        goto out;
+    if (due) {
+        cp->last_pos = pos;
+        cp->last_time = now_sec();
     }
+    return due;
+}
 
-    /* 3) send filesize */
-    off_t sz = get_file_size_stat(filename);
-    if (sz < 0) {
-        perror("stat file");
-        goto out;
-    }
-    uint64_t filesize = (uint64_t)sz;
-    uint64_t net_filesize = htonll(filesize);
-    if (send_all(sock, &net_filesize, sizeof(net_filesize)) != sizeof(net_filesize)) {
-        perror("send filesize");
-        goto out;
+/* 打印本次实际传输的字节数、耗时与吞吐，便于在不同服务端引擎间对比 */
+static void print_rate(uint64_t bytes, double start) {
+    double secs = now_sec() - start;
+    double mb = (double)bytes / (1024.0 * 1024.0);
+    printf("  transferred %.2f MB in %.3f s (%.1f MB/s)\n", mb, secs, secs > 0 ? mb / secs : 0.0);
+}
+
+static int connect_tcp(const char *server_ip, int server_port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
     }
 
-    /* 4) receive agreed_offset from server */
-    uint64_t net_agreed;
-    if (recv_all(sock, &net_agreed, sizeof(net_agreed)) != sizeof(net_agreed)) {
-        fprintf(stderr, "recv agreed_offset failed\n");
-        goto out;
+    struct sockaddr_in serv;
+    memset(&serv, 0, sizeof(serv));
+    serv.sin_family = AF_INET;
+    serv.sin_port = htons((uint16_t)server_port);
+    if (inet_pton(AF_INET, server_ip, &serv.sin_addr) <= 0) {
+        fprintf(stderr, "inet_pton failed\n");
+        close(sock);
+        return -1;
     }
-    uint64_t agreed = ntohll(net_agreed);
-    if (agreed > filesize) {
-        fprintf(stderr, "server agreed_offset (%" PRIu64 ") > filesize (%" PRIu64 ")\n", agreed, filesize);
-        goto out;
+    if (connect(sock, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
     }
+    /* 请求头已合并为一次发送，关掉 Nagle，会话模式下不必等上一个文件的确认 */
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
 
-    /* 5) open local file and seek to agreed, then send remaining data and update .progress */
-    fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("fopen file");
-        goto out;
+#define HELLO_CLOSED  1   /* client_hello：对端一个字节没回就断开（FIN 或 RST） */
+#define HELLO_TRIES   3   /* 握手失败时连同首次在内最多尝试的次数 */
+
+/* 发送握手并读取协商结果。对端没回任何字节就关连接返回 HELLO_CLOSED
+ * （旧服务端读到魔数会当作非法 mode 长度直接断开），其他失败返回 -1 */
+static int client_hello(int sock, uint32_t *caps) {
+    uint32_t wanted = (g_verify ? CLIENT_CAPS : CLIENT_CAPS & ~CAP_VERIFY) | (g_checksum ? CAP_CHECKSUM : 0) |
+                      __atomic_load_n(&g_codec_cap, __ATOMIC_RELAXED) |
+                      (__atomic_load_n(&g_delta, __ATOMIC_RELAXED) ? CAP_DELTA : 0) |
+                      (__atomic_load_n(&g_dedup, __ATOMIC_RELAXED) ? CAP_DEDUP : 0);
+    uint32_t hello[3] = { htonl(PROTO_MAGIC), htonl(PROTO_VERSION), htonl(wanted) };
+    uint32_t reply[3];
+    if (send_all(sock, hello, sizeof(hello)) != sizeof(hello)) return -1;
+    ssize_t r;
+    do {
+        r = recv(sock, reply, sizeof(reply), MSG_PEEK);
+    } while (r < 0 && errno == EINTR);
+    if (r == 0 || (r < 0 && errno == ECONNRESET)) return HELLO_CLOSED;
+    if (recv_all(sock, reply, sizeof(reply)) != sizeof(reply)) return -1;
+    if (ntohl(reply[0]) != PROTO_MAGIC || ntohl(reply[1]) < 2) return -1;
+    *caps = ntohl(reply[2]) & wanted;
+    if (*caps & (CAP_LZ4 | CAP_ZSTD)) {
+        uint32_t level_net = htonl((uint32_t)g_level);
+        if (send_all(sock, &level_net, sizeof(level_net)) != sizeof(level_net)) return -1;
+    } else if (__atomic_exchange_n(&g_codec_cap, 0, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "server does not support the requested compression, sending uncompressed\n");
     }
-    if (fseeko(fp, (off_t)agreed, SEEK_SET) != 0) {
-        perror("fseeko");
-        goto out;
+    if (!(*caps & CAP_DELTA) && __atomic_exchange_n(&g_delta, 0, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "server does not support delta uploads, sending whole files\n");
     }
+    if (!(*caps & CAP_DEDUP) && __atomic_exchange_n(&g_dedup, 0, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "server has no dedup store, sending whole files\n");
+    }
+    return 0;
+}
 
-    uint64_t total_sent = agreed;
-    char buf[CHUNK];
-    size_t nread;
-    while ((nread = fread(buf, 1, sizeof(buf), fp)) > 0) {
-        if (send_all(sock, buf, nread) != (ssize_t)nread) {
-            perror("send_all file data");
-            goto out;
+/* 连接服务端并握手，caps 返回本连接可用的能力（可为 NULL）；失败返回 -1 */
+static int connect_server(const char *server_ip, int server_port, uint32_t *caps) {
+    uint32_t negotiated = 0;
+    int sock = connect_tcp(server_ip, server_port);
+    int closed = 0;  // 连续几次对端收到魔数后一言不发就断开
+    for (int tries = 1; sock >= 0 && !__atomic_load_n(&g_legacy_server, __ATOMIC_RELAXED); tries++) {
+        negotiated = 0;
+        int rc = client_hello(sock, &negotiated);
+        if (rc == 0) break;
+        close(sock);
+        closed = rc == HELLO_CLOSED ? closed + 1 : 0;
+        if (closed >= 2) {
+            /* 新服务端不会在握手时断开，连续两次才认定是旧服务端，
+             * 避免一次偶发的重置就把整个进程降级；换新连接按旧格式重来 */
+            __atomic_store_n(&g_legacy_server, 1, __ATOMIC_RELAXED);
+            fprintf(stderr, "server does not support protocol v%d, using legacy protocol\n", PROTO_VERSION);
+            negotiated = 0;
+        } else if (tries >= HELLO_TRIES) {
+            fprintf(stderr, "handshake with server failed\n");
+            return -1;
         }
-        total_sent += (uint64_t)nread;
+        sock = connect_tcp(server_ip, server_port);
+    }
+    if (caps) *caps = negotiated;
+    return sock;
+}
 
-        /* 原子写进度 */
-        if (write_progress_atomic(filename, total_sent) != 0) {
-            fprintf(stderr, "warning: write progress failed\n");
-        }
+/* 协议第 1~3 步：mode、filename 与该 mode 的定长参数（args）拼成一次发送 */
+static int send_request(int sock, const char *mode, const char *filename, const void *args, size_t args_len) {
+    uint32_t mode_len = (uint32_t)strlen(mode);
+    uint32_t name_len = (uint32_t)strlen(filename);
+    if (mode_len >= 32 || name_len >= 512 || args_len > 32) {
+        fprintf(stderr, "request too long: %s\n", filename);
+        return -1;
     }
-    if (ferror(fp)) {
-        perror("fread");
-        goto out;
+    char req[4 + 32 + 4 + 512 + 32];
+    size_t len = 0;
+    uint32_t mode_len_net = htonl(mode_len);
+    uint32_t name_len_net = htonl(name_len);
+    memcpy(req + len, &mode_len_net, 4);
+    len += 4;
+    memcpy(req + len, mode, mode_len);
+    len += mode_len;
+    memcpy(req + len, &name_len_net, 4);
+    len += 4;
+    memcpy(req + len, filename, name_len);
+    len += name_len;
+    if (args_len > 0) memcpy(req + len, args, args_len);
+    len += args_len;
+    if (send_all(sock, req, len) != (ssize_t)len) {
+        perror("send request");
+        return -1;
     }
+    return 0;
+}
 
-    /* 上传完成，删除进度文件 */
-    remove_progress(filename);
-    printf("Upload finished: sent=%" PRIu64 "\n", total_sent);
-    rc = 0;
-
-out:
-    if (fp) fclose(fp);
-    close(sock);
-    return rc;
+/* 下载续传起点：本地文件大小，若进度文件记录的更小则以进度为准
+   （检查点之后写入的数据未必已落盘） */
+static uint64_t local_resume_offset(const char *filename) {
+    off_t sz = get_file_size_stat(filename);
+    if (sz <= 0) return 0;
+    uint64_t offset = (uint64_t)sz;
+    uint64_t recorded;
+    if (read_progress(filename, &recorded) == 0 && recorded < offset) offset = recorded;
+    return offset;
 }
 
-/* 客户端下载 — 发送本地已有偏移，接收 filesize & server_offset，然后接收数据写入并更新进度 */
-int client_download(int sock, const char *filename) {
-    int rc = -1;
-    FILE *fp = NULL;
-    uint32_t mode_len_net, name_len_net;
-    const char *mode = "download";
+/* ---------------- CRC32C 数据块校验 ---------------- */
 
-    /* 计算本地已有偏移（如果文件存在） */
-    off_t local_offset = 0;
-    fp = fopen(filename, "r+b");
-    if (!fp) {
-        /* 不存在则创建 */
-        fp = fopen(filename, "wb+");
-        if (!fp) {
-            perror("fopen local file");
-            goto out;
-        }
-    } else {
-        if (fseeko(fp, 0, SEEK_END) != 0) {
-            perror("fseeko");
-            goto out;
+/* CRC32C，与 server.c 一致：SSE4.2 + PCLMUL 三路交错，否则 slicing-by-8 查表；main 开头 crc32c_init() */
+#define CRC32C_POLY 0x82f63b78u
+#define CRC32C_LONG 8192   /* 三路交错的段长 */
+#define CRC32C_SHORT 256   /* 不足 3 * CRC32C_LONG 的部分改用短段 */
+
+static uint32_t g_crc32c_table[8][256];
+static uint32_t g_crc32c_long_k, g_crc32c_short_k;  /* x^(8 * 段长 - 33) mod P，拼接用 */
+static uint32_t (*g_crc32c)(uint32_t crc, const void *buf, size_t len);
+
+/* a * b mod P（反射表示） */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
         }
-        local_offset = ftello(fp);
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
     }
+    return p;
+}
 
-    /* 1) send mode */
-    uint32_t mode_len = (uint32_t)strlen(mode);
-    mode_len_net = htonl(mode_len);
-    if (send_all(sock, &mode_len_net, sizeof(mode_len_net)) != sizeof(mode_len_net)) {
-        perror("send mode_len");
-        goto out;
+/* x^n mod P */
+static uint32_t crc32c_xpow(uint64_t n) {
+    uint32_t r = 1u << 31, base = 1u << 30;
+    while (n) {
+        if (n & 1) r = crc32c_multmodp(r, base);
+        base = crc32c_multmodp(base, base);
+        n >>= 1;
     }
-    if (send_all(sock, mode, mode_len) != (ssize_t)mode_len) {
-        perror("send mode");
-        goto out;
+    return r;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc = g_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
     }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = g_crc32c_table[7][w & 0xff] ^ g_crc32c_table[6][(w >> 8) & 0xff] ^
+              g_crc32c_table[5][(w >> 16) & 0xff] ^ g_crc32c_table[4][(w >> 24) & 0xff] ^
+              g_crc32c_table[3][(w >> 32) & 0xff] ^ g_crc32c_table[2][(w >> 40) & 0xff] ^
+              g_crc32c_table[1][(w >> 48) & 0xff] ^ g_crc32c_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = g_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
 
-    /* 2) send filename */
-    uint32_t name_len = (uint32_t)strlen(filename);
-    name_len_net = htonl(name_len);
-    if (send_all(sock, &name_len_net, sizeof(name_len_net)) != sizeof(name_len_net)) {
-        perror("send name_len");
-        goto out;
+#if defined(__x86_64__)
+/* crc 后面再接 k 对应长度的数据时的 crc 贡献：clmul 得到 crc * k * x，crc32 指令再乘 x^32 并约简 */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc32c_shift(uint32_t crc, uint32_t k) {
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc), _mm_cvtsi32_si128((int)k), 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t c0 = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+        len--;
     }
-    if (send_all(sock, filename, name_len) != (ssize_t)name_len) {
-        perror("send filename");
-        goto out;
+    // 三段各自独立计算，隐藏 crc32 指令 3 个周期的延迟
+    for (size_t seg = CRC32C_LONG;; seg = CRC32C_SHORT) {
+        uint32_t k = seg == CRC32C_LONG ? g_crc32c_long_k : g_crc32c_short_k;
+        while (len >= 3 * seg) {
+            uint64_t c1 = 0, c2 = 0;
+            const unsigned char *end = p + seg;
+            do {
+                c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+                c1 = _mm_crc32_u64(c1, *(const uint64_t *)(p + seg));
+                c2 = _mm_crc32_u64(c2, *(const uint64_t *)(p + 2 * seg));
+                p += 8;
+            } while (p < end);
+            c0 = crc32c_shift((uint32_t)c0, k) ^ c1;
+            c0 = crc32c_shift((uint32_t)c0, k) ^ c2;
+            p += 2 * seg;
+            len -= 3 * seg;
+        }
+        if (seg == CRC32C_SHORT) break;
     }
+    while (len >= 8) {
+        c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    return ~(uint32_t)c0;
+}
+#endif
 
-    /* 3) send local_offset */
-    uint64_t net_local_offset = htonll((uint64_t)local_offset);
-    if (send_all(sock, &net_local_offset, sizeof(net_local_offset)) != sizeof(net_local_offset)) {
-        perror("send local_offset");
-        goto out;
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        g_crc32c_table[0][n] = c;
     }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int t = 1; t < 8; t++)
+            g_crc32c_table[t][n] = g_crc32c_table[0][g_crc32c_table[t - 1][n] & 0xff] ^ (g_crc32c_table[t - 1][n] >> 8);
+    g_crc32c = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        g_crc32c_long_k = crc32c_xpow(8ull * CRC32C_LONG - 33);
+        g_crc32c_short_k = crc32c_xpow(8ull * CRC32C_SHORT - 33);
+        g_crc32c = crc32c_hw;
+    }
+#endif
+}
 
-    /* 4) recv filesize and server_offset */
-    uint64_t net_filesize, net_server_offset;
-    if (recv_all(sock, &net_filesize, sizeof(net_filesize)) != sizeof(net_filesize)) {
-        fprintf(stderr, "recv filesize failed\n");
-        goto out;
+/* ---------------- 哈希树续传校验 ---------------- */
+
+/* 与 server.c 一致：前缀按 MERKLE_CHUNK 切块，叶子是块的 CRC32C，
+   每 MERKLE_FANOUT 个子节点哈希（网络字节序拼接）的 CRC32C 是父节点 */
+#define MERKLE_CHUNK (1024 * 1024)
+#define MERKLE_FANOUT 16
+#define MERKLE_MAX_LEVELS 16
+
+struct merkle {
+    int nlevels;                           /* level[0] 是叶子，level[nlevels - 1] 只有根 */
+    uint64_t count[MERKLE_MAX_LEVELS];
+    uint32_t *level[MERKLE_MAX_LEVELS];
+};
+
+static void merkle_free(struct merkle *t) {
+    for (int i = 0; i < t->nlevels; i++) free(t->level[i]);
+    t->nlevels = 0;
+}
+
+/* 第 lvl 层节点 idx 的子节点范围 [*first, 返回值) */
+static uint64_t merkle_children(const struct merkle *t, int lvl, uint64_t idx, uint64_t *first) {
+    *first = idx * MERKLE_FANOUT;
+    uint64_t end = *first + MERKLE_FANOUT;
+    return end < t->count[lvl - 1] ? end : t->count[lvl - 1];
+}
+
+/* 读 fd 的 [0, len) 建树，len 为 0 时为空树；失败返回 -1 */
+static int merkle_build(int fd, uint64_t len, struct merkle *t) {
+    memset(t, 0, sizeof(*t));
+    if (len == 0) return 0;
+    char *buf = malloc(MERKLE_CHUNK);
+    uint64_t n = (len + MERKLE_CHUNK - 1) / MERKLE_CHUNK;
+    t->level[0] = malloc(n * sizeof(uint32_t));
+    t->count[0] = n;
+    t->nlevels = 1;
+    if (!buf || !t->level[0]) goto fail;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t off = i * MERKLE_CHUNK;
+        size_t want = len - off > MERKLE_CHUNK ? MERKLE_CHUNK : (size_t)(len - off);
+        for (size_t got = 0; got < want; ) {
+            ssize_t r = pread(fd, buf + got, want - got, (off_t)(off + got));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                fprintf(stderr, "merkle: read failed or file shrank\n");
+                goto fail;
+            }
+            got += (size_t)r;
+        }
+        t->level[0][i] = g_crc32c(0, buf, want);
     }
-    if (recv_all(sock, &net_server_offset, sizeof(net_server_offset)) != sizeof(net_server_offset)) {
-        fprintf(stderr, "recv server_offset failed\n");
-        goto out;
+    while (t->count[t->nlevels - 1] > 1) {
+        int lvl = t->nlevels;
+        uint64_t cnt = (t->count[lvl - 1] + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+        t->level[lvl] = malloc(cnt * sizeof(uint32_t));
+        if (!t->level[lvl]) goto fail;
+        t->count[lvl] = cnt;
+        t->nlevels++;
+        for (uint64_t i = 0; i < cnt; i++) {
+            uint64_t first, end = merkle_children(t, lvl, i, &first);
+            uint32_t kids[MERKLE_FANOUT];
+            for (uint64_t k = first; k < end; k++) kids[k - first] = htonl(t->level[lvl - 1][k]);
+            t->level[lvl][i] = g_crc32c(0, kids, (end - first) * sizeof(uint32_t));
+        }
     }
-    uint64_t filesize = ntohll(net_filesize);
-    uint64_t server_offset = ntohll(net_server_offset);
+    free(buf);
+    return 0;
 
-    if (server_offset > filesize) {
-        fprintf(stderr, "server_offset > filesize\n");
-        goto out;
+fail:
+    free(buf);
+    merkle_free(t);
+    return -1;
+}
+
+/* 树覆盖 [0, len) 时按叶子拼出 [0, *covered) 的 CRC32C：upto 不小于 len 时是整棵树，
+   否则只取 upto 之前的整块，剩下不到一块的部分由调用方读 */
+static uint32_t merkle_prefix_crc(const struct merkle *t, uint64_t len, uint64_t upto, uint64_t *covered) {
+    if (t->nlevels == 0) {
+        *covered = 0;  // 没有树，整段都由调用方读
+        return 0;
+    }
+    uint64_t n = upto >= len ? t->count[0] : upto / MERKLE_CHUNK;
+    uint32_t shift = crc32c_xpow(8ull * MERKLE_CHUNK), crc = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t leaf = len - i * MERKLE_CHUNK < MERKLE_CHUNK ? len - i * MERKLE_CHUNK : MERKLE_CHUNK;
+        crc = crc32c_multmodp(leaf == MERKLE_CHUNK ? shift : crc32c_xpow(8 * leaf), crc) ^ t->level[0][i];
     }
+    *covered = upto >= len ? len : n * MERKLE_CHUNK;
+    return crc;
+}
 
-    /* seek to server_offset for writing */
-    if (fseeko(fp, (off_t)server_offset, SEEK_SET) != 0) {
-        perror("fseeko to server_offset");
-        goto out;
+/* 续传校验要用到的能力都协商出来了：hash_tree 之后还要在同一连接上发请求，坏块用分段请求补 */
+static int caps_verify(uint32_t caps) {
+    return (caps & (CAP_VERIFY | CAP_RANGES | CAP_PIPELINE)) == (CAP_VERIFY | CAP_RANGES | CAP_PIPELINE);
+}
+
+/* 把相邻的坏叶子合并成区间追加到 *bad，区间不超过 len */
+static int merkle_add_bad(struct range **bad, int *nbad, uint64_t leaf, uint64_t len) {
+    uint64_t start = leaf * MERKLE_CHUNK;
+    uint64_t end = len - start > MERKLE_CHUNK ? start + MERKLE_CHUNK : len;
+    if (*nbad > 0 && (*bad)[*nbad - 1].end == start) {
+        (*bad)[*nbad - 1].end = end;
+        return 0;
     }
+    struct range *p = realloc(*bad, (size_t)(*nbad + 1) * sizeof(*p));
+    if (!p) return -1;
+    p[*nbad].start = start;
+    p[*nbad].end = end;
+    p[*nbad].done = 0;
+    *bad = p;
+    (*nbad)++;
+    return 0;
+}
 
-    /* 5) receive file bytes until total_received == filesize or peer closes */
-    uint64_t total_received = server_offset;
-    char buf[CHUNK];
-    while (total_received < filesize) {
-        ssize_t want = (filesize - total_received) > CHUNK ? CHUNK : (ssize_t)(filesize - total_received);
-        ssize_t r = recv_all(sock, buf, want);
-        if (r != want) {
-            fprintf(stderr, "recv failed or connection closed prematurely\n");
-            goto out;
-        }
-        size_t w = fwrite(buf, 1, r, fp);
-        if (w != (size_t)r) {
-            perror("fwrite");
-            goto out;
-        }
-        total_received += (uint64_t)r;
-        fflush(fp);
-        fsync(fileno(fp));
+/* hash_tree 请求：把本地 fd 的前 length 字节与服务端同名文件比对。
+   *server_size 返回服务端文件大小，*bad 与 *nbad 返回 [0, min(length, server_size)) 中内容不一致的区间。
+   keep 非空时把本地这棵树交给调用方（拼前缀 CRC 用），没建树时 keep->nlevels 为 0。
+   返回 0 完成，1 服务端或本地无法校验（按未校验处理），-1 连接不可用 */
+static int verify_prefix(int sock, const char *filename, int fd, uint64_t length,
+                         uint64_t *server_size, struct range **bad, int *nbad, struct merkle *keep) {
+    *bad = NULL;
+    *nbad = 0;
+    if (keep) keep->nlevels = 0;
+    uint64_t net_length = htonll(length);
+    if (send_request(sock, "hash_tree", filename, &net_length, sizeof(net_length)) != 0) return -1;
+    uint64_t reply[2];
+    if (recv_all(sock, reply, sizeof(reply)) != sizeof(reply)) {
+        fprintf(stderr, "recv hash_tree reply failed\n");
+        return -1;
+    }
+    *server_size = ntohll(reply[0]);
+    if (*server_size == REPLY_ERROR) return 1;
+    uint64_t len = length < *server_size ? length : *server_size;
+    if (len == 0) return 0;  /* 服务端此时不再等待查询 */
 
-        /* 更新进度 */
-        if (write_progress_atomic(filename, total_received) != 0) {
-            fprintf(stderr, "warning: write progress failed\n");
+    struct merkle t;
+    uint64_t *query = NULL, *next = NULL;
+    uint32_t *kids = NULL;
+    int rc = -1;
+    int built = merkle_build(fd, len, &t);
+    if (built == 0 && (uint32_t)ntohll(reply[1]) != t.level[t.nlevels - 1][0]) {
+        /* 从根开始逐层只展开哈希不同的节点 */
+        uint64_t nq = 1;
+        int lvl = t.nlevels - 1;
+        query = malloc(sizeof(*query));
+        if (!query) goto out;
+        query[0] = 0;
+        if (lvl == 0 && merkle_add_bad(bad, nbad, 0, len) != 0) goto out;
+        for (; lvl > 0 && nq > 0; lvl--) {
+            size_t nkids = 0;
+            for (uint64_t i = 0; i < nq; i++) {
+                uint64_t first, end = merkle_children(&t, lvl, query[i], &first);
+                nkids += (size_t)(end - first);
+            }
+            uint32_t q[2] = { htonl((uint32_t)lvl), htonl((uint32_t)nq) };
+            kids = malloc(nkids * sizeof(*kids));
+            next = malloc(nkids * sizeof(*next));
+            if (!kids || !next) goto out;
+            for (uint64_t i = 0; i < nq; i++) query[i] = htonll(query[i]);
+            if (send_all(sock, q, sizeof(q)) != sizeof(q) ||
+                send_all(sock, query, nq * sizeof(*query)) != (ssize_t)(nq * sizeof(*query)) ||
+                recv_all(sock, kids, nkids * sizeof(*kids)) != (ssize_t)(nkids * sizeof(*kids))) {
+                fprintf(stderr, "hash_tree exchange failed\n");
+                goto out;
+            }
+            uint64_t nn = 0;
+            size_t k = 0;
+            for (uint64_t i = 0; i < nq; i++) {
+                uint64_t first, end = merkle_children(&t, lvl, ntohll(query[i]), &first);
+                for (uint64_t c = first; c < end; c++, k++) {
+                    if (ntohl(kids[k]) == t.level[lvl - 1][c]) continue;
+                    if (lvl - 1 == 0) {
+                        if (merkle_add_bad(bad, nbad, c, len) != 0) goto out;
+                    } else {
+                        next[nn++] = c;
+                    }
+                }
+            }
+            free(query);
+            free(kids);
+            kids = NULL;
+            query = next;
+            next = NULL;
+            nq = nn;
         }
     }
-
-    /* 下载完成，删除进度文件 */
-    remove_progress(filename);
-    printf("Download complete: %s (size=%" PRIu64 ")\n", filename, filesize);
-    rc = 0;
+    uint32_t done[2] = { 0, 0 };
+    if (send_all(sock, done, sizeof(done)) != sizeof(done)) goto out;
+    rc = built == 0 ? 0 : 1;
+    if (rc == 0 && keep) {
+        *keep = t;
+        built = -1;  // 树归调用方了
+    }
 
 out:
-    if (fp) fclose(fp);
-    close(sock);
+    free(query);
+    free(next);
+    free(kids);
+    if (built == 0) merkle_free(&t);
+    if (rc != 0) {
+        free(*bad);
+        *bad = NULL;
+        *nbad = 0;
+    }
     return rc;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s upload|download <server_ip> <server_port> <filename>\n", argv[0]);
-        return 1;
-    }
-    const char *mode = argv[1];
-    const char *server_ip = argv[2];
-    int server_port = atoi(argv[3]);
-    const char *filename = argv[4];
+static uint64_t ranges_bytes(const struct range *r, int n) {
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) total += r[i].end - r[i].start;
+    return total;
+}
 
-    if (!(strcmp(mode, "upload") == 0 || strcmp(mode, "download") == 0)) {
-        fprintf(stderr, "mode must be 'upload' or 'download'\n");
-        return 1;
-    }
+/* ---------------- SHA-256 ---------------- */
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) { perror("socket"); return 1; }
+/* 去重存储按内容寻址，CRC32C 的碰撞概率不够用，块以 SHA-256 命名。
+   支持 SHA 扩展指令的 CPU 上用 sha256rnds2 等指令，比逐轮计算快约 3 倍 */
+#define SHA256_LEN 32
 
-    struct sockaddr_in serv;
-    memset(&serv, 0, sizeof(serv));
-    serv.sin_family = AF_INET;
-    serv.sin_port = htons((uint16_t)server_port);
-    if (inet_pton(AF_INET, server_ip, &serv.sin_addr) <= 0) {
-        fprintf(stderr, "inet_pton failed\n");
-        close(sock);
-        return 1;
+static const uint32_t k_sha256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void (*g_sha256_blocks)(uint32_t h[8], const unsigned char *p, size_t nblocks);
+
+static void sha256_block(uint32_t h[8], const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
     }
-    if (connect(sock, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
-        perror("connect");
-        close(sock);
-        return 1;
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+                      k_sha256[i] + w[i];
+        uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
     }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
 
-    if (strcmp(mode, "upload") == 0) {
-        return client_upload(sock, filename);
-    } else {
-        return client_download(sock, filename);
+static void sha256_blocks_sw(uint32_t h[8], const unsigned char *p, size_t nblocks) {
+    for (; nblocks > 0; nblocks--, p += 64) sha256_block(h, p);
+}
+
+#if defined(__x86_64__)
+/* SHA 扩展指令：每条 sha256rnds2 做两轮，消息扩展用 sha256msg1/msg2，状态按 ABEF/CDGH 排列 */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_ni(uint32_t h[8], const unsigned char *p, size_t nblocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);  /* CDAB */
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);  /* EFGH */
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);       /* CDGH */
+    for (; nblocks > 0; nblocks--, p += 64) {
+        __m128i abef = state0, cdgh = state1, m[4];
+        for (int i = 0; i < 4; i++) m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+        for (int g = 0; g < 16; g++) {
+            __m128i msg = _mm_add_epi32(m[g & 3], _mm_loadu_si128((const __m128i *)&k_sha256[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+            if (g < 12) {  // 算出第 g + 4 组的 4 个消息字，占用第 g 组的位置
+                __m128i w = _mm_add_epi32(_mm_sha256msg1_epu32(m[g & 3], m[(g + 1) & 3]),
+                                          _mm_alignr_epi8(m[(g + 3) & 3], m[(g + 2) & 3], 4));
+                m[g & 3] = _mm_sha256msg2_epu32(w, m[(g + 3) & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1b);       /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xb1);    /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0); /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);    /* HGFE */
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+#endif
+
+/* 按 CPU 选定实现，main 开头调用一次 */
+static void sha256_init(void) {
+    g_sha256_blocks = sha256_blocks_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) g_sha256_blocks = sha256_blocks_ni;
+#endif
+}
+
+/* 一次算完整段数据的 SHA-256 */
+static void sha256(const void *data, size_t len, unsigned char out[SHA256_LEN]) {
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    const unsigned char *p = data;
+    size_t left = len;
+    g_sha256_blocks(h, p, left / 64);
+    p += left / 64 * 64;
+    left %= 64;
+    unsigned char tail[128] = { 0 };
+    memcpy(tail, p, left);
+    tail[left] = 0x80;
+    size_t tail_len = left < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) tail[tail_len - 1 - i] = (unsigned char)(bits >> (8 * i));
+    g_sha256_blocks(h, tail, tail_len / 64);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char)(h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)h[i];
+    }
+}
+
+/* ---------------- 数据阶段压缩 ---------------- */
+
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *g_zcctx;
+static ZSTD_DCtx *g_zdctx;
+#endif
+
+/* 本连接的数据阶段编码：-1 表示不压缩 */
+static int caps_codec(uint32_t caps) {
+    if (caps & CAP_ZSTD) return FRAME_ZSTD;
+    if (caps & CAP_LZ4) return FRAME_LZ4;
+    return -1;
+}
+
+/* upload/download 的数据阶段是否分帧 */
+static int caps_framed(uint32_t caps) {
+    return (caps & (CAP_LZ4 | CAP_ZSTD | CAP_CHECKSUM)) != 0;
+}
+
+/* 压缩一块到 dst（容量 cap）；压不进 cap 或出错返回 0，调用方改发原始数据 */
+static size_t codec_compress(int codec, int level, const char *src, size_t len, char *dst, size_t cap) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case FRAME_LZ4: {
+        int n = level >= LZ4HC_CLEVEL_MIN ? LZ4_compress_HC(src, dst, (int)len, (int)cap, level)
+                                          : LZ4_compress_default(src, dst, (int)len, (int)cap);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case FRAME_ZSTD: {
+        if (!g_zcctx && !(g_zcctx = ZSTD_createCCtx())) return 0;
+        size_t n = ZSTD_compressCCtx(g_zcctx, dst, cap, src, len, level ? level : ZSTD_CLEVEL_DEFAULT);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        (void)level; (void)src; (void)len; (void)dst; (void)cap;
+        return 0;
+    }
+}
+
+/* 解压一块，结果必须正好 raw_len 字节 */
+static int codec_decompress(int codec, const char *src, size_t len, char *dst, size_t raw_len) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case FRAME_LZ4:
+        return LZ4_decompress_safe(src, dst, (int)len, (int)raw_len) == (int)raw_len ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+    case FRAME_ZSTD: {
+        if (!g_zdctx && !(g_zdctx = ZSTD_createDCtx())) return -1;
+        size_t n = ZSTD_decompressDCtx(g_zdctx, dst, raw_len, src, len);
+        return !ZSTD_isError(n) && n == raw_len ? 0 : -1;
+    }
+#endif
+    default:
+        (void)src; (void)len; (void)dst; (void)raw_len;
+        return -1;
+    }
+}
+
+/* 自适应选码（-z auto），与 server.c 一致：候选按压缩程度排成 不压缩 -> LZ4 -> Zstd 1 -> Zstd 上档，
+   每 PICK_WINDOW 块评估一次：发送队列仍积压时按实测链路速率估计各候选的原始字节吞吐
+   min(压缩速度, 链路速率 / 压缩比) 取最大者，队列见底说明压缩成了瓶颈则降一档；
+   每 PICK_PROBE 块用相邻档位压一块，保持各档的估计是新的 */
+#define PICK_WINDOW 8
+#define PICK_PROBE 16
+#define PICK_MIN_GAIN 0.9          /* 线上字节 / 原始字节超过它就不值得压缩 */
+#define PICK_QUEUE_MIN (64 * 1024) /* 发送队列积压不少于此值视为链路占满 */
+#define PICK_ZSTD_LEVEL 6          /* 自适应时 Zstd 上档的默认级别 */
+#define PICK_EWMA 0.25
+
+enum { PICK_RAW, PICK_LZ4, PICK_ZSTD_FAST, PICK_ZSTD, PICK_CANDIDATES };
+
+struct codec_picker {
+    int fixed;                          /* >= 0：固定编码，-1：自适应 */
+    int zstd_level;
+    int cur;                            /* 当前档位 */
+    unsigned blocks;
+    unsigned win_blocks;
+    uint64_t win_start_ns, win_wire;
+    int win_outq;                       /* 窗口开始时的发送队列积压 */
+    int seen[PICK_CANDIDATES];
+    double ratio[PICK_CANDIDATES];      /* 线上字节 / 原始字节 */
+    double cpu_ns[PICK_CANDIDATES];     /* 每原始字节的压缩耗时 */
+};
+
+/* 每次传输按编码分别计数：发送按尝试的编码计，压不小而原样发出的块计入 bypassed */
+struct frame_stats {
+    uint64_t frames;
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;  /* 含帧头 */
+    uint64_t bypassed;
+    uint64_t nsecs;       /* 压缩/解压耗时 */
+};
+
+static const char *const k_codec_names[FRAME_CODECS] = { "raw", "lz4", "zstd" };
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void picker_init(struct codec_picker *pk, uint32_t caps) {
+    memset(pk, 0, sizeof(*pk));
+    pk->fixed = (caps & CAP_LZ4) && (caps & CAP_ZSTD) ? -1 : caps_codec(caps) >= 0 ? caps_codec(caps) : FRAME_RAW;
+    pk->zstd_level = g_level > 1 ? g_level : PICK_ZSTD_LEVEL;
+    pk->cur = PICK_LZ4;
+}
+
+static int picker_choose(struct codec_picker *pk) {
+    if (++pk->blocks % PICK_PROBE != 0) return pk->cur;
+    // 抽样：交替试上一档和下一档（不压缩没有要测的）
+    int probe = (pk->blocks / PICK_PROBE) % 2 ? pk->cur + 1 : pk->cur - 1;
+    if (probe < PICK_LZ4 || probe >= PICK_CANDIDATES) probe = pk->cur + 1 < PICK_CANDIDATES ? pk->cur + 1 : pk->cur - 1;
+    return probe;
+}
+
+/* 发送队列中还没被对端确认的字节数 */
+static int send_queue_bytes(int sock) {
+    int outq = 0;
+    if (ioctl(sock, SIOCOUTQ, &outq) != 0) outq = 0;
+    return outq;
+}
+
+static void picker_update(struct codec_picker *pk, int sock, int cand, size_t raw, size_t wire, uint64_t cpu_ns) {
+    if (cand != PICK_RAW) {
+        double r = (double)wire / (double)raw, c = (double)cpu_ns / (double)raw;
+        pk->ratio[cand] = pk->seen[cand] ? pk->ratio[cand] + PICK_EWMA * (r - pk->ratio[cand]) : r;
+        pk->cpu_ns[cand] = pk->seen[cand] ? pk->cpu_ns[cand] + PICK_EWMA * (c - pk->cpu_ns[cand]) : c;
+        pk->seen[cand] = 1;
+    }
+    pk->win_wire += wire;
+    if (++pk->win_blocks < PICK_WINDOW) return;
+
+    uint64_t now = mono_ns();
+    int outq = send_queue_bytes(sock);
+    if (pk->win_start_ns == 0 || (outq >= PICK_QUEUE_MIN && pk->win_outq < PICK_QUEUE_MIN)) {
+        // 第一个窗口只建立起点；开始时队列没积压的窗口量不准链路速率，也不动
+    } else if (outq < PICK_QUEUE_MIN) {
+        if (pk->cur != PICK_RAW) pk->cur--;
+    } else if (pk->cur + 1 < PICK_CANDIDATES && !pk->seen[pk->cur + 1]) {
+        pk->cur++;
+    } else {
+        double drained = (double)pk->win_wire + pk->win_outq - outq;
+        double link = drained / (double)(now - pk->win_start_ns);  // 线上字节 / ns
+        int best = PICK_RAW;
+        double best_rate = link;
+        for (int i = PICK_LZ4; i < PICK_CANDIDATES; i++) {
+            if (!pk->seen[i] || pk->ratio[i] > PICK_MIN_GAIN) continue;
+            double rate = link / pk->ratio[i];
+            if (pk->cpu_ns[i] > 0 && 1.0 / pk->cpu_ns[i] < rate) rate = 1.0 / pk->cpu_ns[i];
+            if (rate > best_rate) {
+                best = i;
+                best_rate = rate;
+            }
+        }
+        pk->cur = best;
+    }
+    pk->win_blocks = 0;
+    pk->win_wire = 0;
+    pk->win_start_ns = now;
+    pk->win_outq = outq;
+}
+
+/* 发送一帧：按 picker 选编码压缩到 wire（FRAME_BLOCK 字节），压不小就原样发；checksum 时帧头带原始数据的 CRC32C */
+static int send_frame(int sock, struct codec_picker *pk, const char *raw, size_t n, char *wire, int checksum,
+                      struct frame_stats stats[FRAME_CODECS]) {
+    int cand = pk->fixed >= 0 ? -1 : picker_choose(pk);
+    int codec = cand < 0 ? pk->fixed : cand == PICK_RAW ? FRAME_RAW : cand == PICK_LZ4 ? FRAME_LZ4 : FRAME_ZSTD;
+    int level = cand < 0 ? g_level : cand == PICK_ZSTD_FAST ? 1 : cand == PICK_ZSTD ? pk->zstd_level : 0;
+    uint64_t t0 = mono_ns();
+    size_t wire_len = codec == FRAME_RAW ? 0 : codec_compress(codec, level, raw, n, wire, n - 1);
+    uint64_t t1 = mono_ns();
+    int used = wire_len ? codec : FRAME_RAW;
+    if (!wire_len) wire_len = n;
+    uint32_t crc = checksum ? g_crc32c(0, raw, n) : 0;
+    uint32_t hdr[4] = { htonl((uint32_t)used), htonl((uint32_t)n), htonl((uint32_t)wire_len), htonl(crc) };
+    if (send_all(sock, hdr, sizeof(hdr)) != sizeof(hdr) ||
+        send_all(sock, used == FRAME_RAW ? raw : wire, wire_len) != (ssize_t)wire_len) return -1;
+    if (cand >= 0) picker_update(pk, sock, cand, n, wire_len, t1 - t0);
+    struct frame_stats *st = &stats[codec];
+    st->frames++;
+    st->raw_bytes += n;
+    st->wire_bytes += sizeof(hdr) + wire_len;
+    st->bypassed += used != codec;
+    st->nsecs += t1 - t0;
+    return 0;
+}
+
+/* 接收文件 pos 处的一帧并解出原始数据到 raw（FRAME_BLOCK 字节），原始长度不得超过 remaining；
+   checksum 时校验 CRC32C。返回原始长度，出错 -1 */
+static ssize_t recv_frame(int sock, char *raw, char *wire, uint64_t pos, uint64_t remaining, int checksum,
+                          struct frame_stats stats[FRAME_CODECS]) {
+    uint32_t hdr[4];
+    if (recv_all(sock, hdr, sizeof(hdr)) != sizeof(hdr)) return -1;
+    uint32_t codec = ntohl(hdr[0]), raw_len = ntohl(hdr[1]), wire_len = ntohl(hdr[2]);
+    if (raw_len == 0 || raw_len > FRAME_BLOCK || wire_len > FRAME_BLOCK || raw_len > remaining) {
+        fprintf(stderr, "bad frame header\n");
+        return -1;
+    }
+    uint64_t t0 = 0;
+    if (codec == FRAME_RAW) {
+        if (wire_len != raw_len || recv_all(sock, raw, raw_len) != (ssize_t)raw_len) return -1;
+    } else if (recv_all(sock, wire, wire_len) != (ssize_t)wire_len ||
+               (t0 = mono_ns(), codec_decompress((int)codec, wire, wire_len, raw, raw_len)) != 0) {
+        fprintf(stderr, "frame decode failed (codec %u)\n", codec);
+        return -1;
+    }
+    if (checksum && g_crc32c(0, raw, raw_len) != ntohl(hdr[3])) {
+        fprintf(stderr, "crc mismatch in chunk at offset %" PRIu64 "\n", pos);
+        return -1;
+    }
+    struct frame_stats *st = &stats[codec];
+    st->frames++;
+    st->raw_bytes += raw_len;
+    st->wire_bytes += sizeof(hdr) + wire_len;
+    if (t0) st->nsecs += mono_ns() - t0;
+    return (ssize_t)raw_len;
+}
+
+/* 打印线上字节与各编码的计数 */
+static void print_frames(const struct frame_stats stats[FRAME_CODECS]) {
+    uint64_t raw = 0, wire = 0;
+    for (int c = 0; c < FRAME_CODECS; c++) {
+        raw += stats[c].raw_bytes;
+        wire += stats[c].wire_bytes;
+    }
+    if (raw == 0) return;
+    printf("  on the wire %.2f MB (%.1f%% of %.2f MB)\n", (double)wire / (1024.0 * 1024.0),
+           100.0 * (double)wire / (double)raw, (double)raw / (1024.0 * 1024.0));
+    for (int c = 0; c < FRAME_CODECS; c++) {
+        const struct frame_stats *st = &stats[c];
+        if (st->frames == 0) continue;
+        printf("    %-4s %" PRIu64 " frames, %.1f%% of raw, %" PRIu64 " bypassed, %.3f s\n", k_codec_names[c],
+               st->frames, 100.0 * (double)st->wire_bytes / (double)st->raw_bytes, st->bypassed,
+               (double)st->nsecs / 1e9);
+    }
+}
+
+/* 5b) 续传校验发现的服务端坏区间在尾部数据之后、服务端发布之前补发（CAP_REPAIR）：
+   每段 uint64_t start, uint64_t len 后跟数据，最后发 {0, 0}，服务端写进暂存文件与尾部一起发布。
+   返回 0 成功，-1 连接不可用 */
+static int send_repairs(int sock, int fd, const struct range *bad, int nbad) {
+    char *buf = malloc(RANGE_BUF);
+    if (!buf) return -1;
+    int rc = -1;
+    for (int i = 0; i < nbad; i++) {
+        uint64_t pos = bad[i].start, end = bad[i].end;
+        uint64_t hdr[2] = { htonll(pos), htonll(end - pos) };
+        if (send_all(sock, hdr, sizeof(hdr)) != sizeof(hdr)) goto out;
+        while (pos < end) {
+            size_t want = end - pos > RANGE_BUF ? RANGE_BUF : (size_t)(end - pos);
+            ssize_t n = pread(fd, buf, want, (off_t)pos);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                fprintf(stderr, "read local file failed or file shrank\n");
+                goto out;
+            }
+            if (send_all(sock, buf, (size_t)n) != n) {
+                perror("send_all file data");
+                goto out;
+            }
+            pos += (uint64_t)n;
+        }
+    }
+    uint64_t done[2] = { 0, 0 };
+    if (send_all(sock, done, sizeof(done)) != sizeof(done)) goto out;
+    rc = 0;
+
+out:
+    free(buf);
+    return rc;
+}
+
+/* 用 download_range 取回坏区间写进本地文件并落盘。返回 0 成功，-1 连接不可用 */
+static int download_repair(int sock, const char *filename, int fd, uint64_t filesize,
+                           const struct range *bad, int nbad) {
+    char *buf = malloc(RANGE_BUF);
+    if (!buf) return -1;
+    int rc = -1;
+    for (int i = 0; i < nbad; i++) {
+        uint64_t pos = bad[i].start, end = bad[i].end;
+        uint64_t hdr[2] = { htonll(pos), htonll(end) };
+        uint64_t net_filesize;
+        if (send_request(sock, "download_range", filename, hdr, sizeof(hdr)) != 0) goto out;
+        if (recv_all(sock, &net_filesize, sizeof(net_filesize)) != sizeof(net_filesize) ||
+            ntohll(net_filesize) != filesize) {
+            /* 文件在服务端变了，后面跟着的数据长度无法确定，只能放弃这条连接 */
+            fprintf(stderr, "file changed on server during verification\n");
+            goto out;
+        }
+        while (pos < end) {
+            size_t want = end - pos > RANGE_BUF ? RANGE_BUF : (size_t)(end - pos);
+            ssize_t n = recv_all(sock, buf, want);
+            if (n != (ssize_t)want) {
+                fprintf(stderr, "recv failed or connection closed prematurely\n");
+                goto out;
+            }
+            for (size_t off = 0; off < want; ) {
+                ssize_t w = pwrite(fd, buf + off, want - off, (off_t)(pos + off));
+                if (w < 0) {
+                    if (errno == EINTR) continue;
+                    perror("pwrite");
+                    goto out;
+                }
+                off += (size_t)w;
+            }
+            pos += want;
+        }
+    }
+    if (fdatasync(fd) != 0) {
+        perror("fdatasync");
+        goto out;
+    }
+    rc = 0;
+
+out:
+    free(buf);
+    return rc;
+}
+
+/* 下载续传前先校验本地已有的前缀，坏块按区间重新下载，之后照常从原偏移续传。
+   moved 累加补传的字节。返回 0（含无法校验、按原样续传的情况），-1 连接不可用 */
+static int download_verify(int sock, const char *filename, uint32_t caps, uint64_t *moved) {
+    if (!caps_verify(caps)) return 0;
+    uint64_t offset = local_resume_offset(filename);
+    if (offset == 0) return 0;
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) return 0;
+    uint64_t server_size;
+    struct range *bad;
+    int nbad;
+    int rc = verify_prefix(sock, filename, fd, offset, &server_size, &bad, &nbad, NULL);
+    if (rc == 0 && nbad > 0) {
+        uint64_t bytes = ranges_bytes(bad, nbad);
+        printf("%s: %d corrupt range(s) in local prefix, re-fetching %" PRIu64 " bytes\n", filename, nbad, bytes);
+        rc = download_repair(sock, filename, fd, server_size, bad, nbad);
+        if (rc == 0) *moved += bytes;
+    }
+    free(bad);
+    close(fd);
+    return rc < 0 ? -1 : 0;
+}
+
+/* 发送缓冲：小记录攒满 BULK_BUF 才发一次（批量模式与增量上传共用） */
+struct bulk_stream {
+    int sock;
+    char *buf;   /* BULK_BUF */
+    size_t len;
+};
+
+static int bulk_flush(struct bulk_stream *b) {
+    if (b->len > 0 && send_all(b->sock, b->buf, b->len) != (ssize_t)b->len) {
+        perror("send bulk");
+        return -1;
+    }
+    b->len = 0;
+    return 0;
+}
+
+static int bulk_append(struct bulk_stream *b, const void *data, size_t n) {
+    if (b->len + n > BULK_BUF && bulk_flush(b) != 0) return -1;
+    memcpy(b->buf + b->len, data, n);
+    b->len += n;
+    return 0;
+}
+
+/* ---------------- 增量上传 ---------------- */
+
+/* 与 server.c 一致：服务端旧文件每 block 字节一个签名 {弱校验, CRC32C}，
+   客户端滚动弱校验找出能复用的块，其余作为字面数据发送 */
+#define DELTA_END     0   /* uint32_t crc：整个新文件的 CRC32C */
+#define DELTA_COPY    1   /* uint32_t count, uint64_t index：复制旧文件第 index 块起连续 count 块 */
+#define DELTA_LITERAL 2   /* uint32_t len, len 字节字面数据 */
+#define DELTA_LITERAL_MAX FRAME_BLOCK
+#define DELTA_WINDOW (4 * 1024 * 1024)  /* 读文件的滑动缓冲，需容纳未发出的字面数据加一块 */
+
+struct delta_sig {
+    uint32_t weak;
+    uint32_t strong;
+};
+
+/* rsync 式弱校验：a 为字节和，b 为按位置加权和，各取低 16 位 */
+static uint32_t delta_weak(const unsigned char *p, size_t len, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++) {
+        s1 += p[i];
+        s2 += s1;
+    }
+    *a = s1;
+    *b = s2;
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+struct delta_out {
+    struct bulk_stream b;
+    uint64_t copy_index;  /* 尚未发出的复制指令，count 为 0 表示没有 */
+    uint32_t copy_count;
+    uint32_t crc;         /* 已输出部分的 CRC32C */
+    uint64_t literal;
+    uint64_t matched;
+};
+
+static int delta_emit_copy(struct delta_out *o) {
+    if (o->copy_count == 0) return 0;
+    uint32_t hdr[2] = { htonl(DELTA_COPY), htonl(o->copy_count) };
+    uint64_t idx = htonll(o->copy_index);
+    o->copy_count = 0;
+    return bulk_append(&o->b, hdr, sizeof(hdr)) != 0 || bulk_append(&o->b, &idx, sizeof(idx)) != 0 ? -1 : 0;
+}
+
+/* 匹配到旧文件第 idx 块；与上一条复制指令相邻时合并 */
+static int delta_copy(struct delta_out *o, uint64_t idx, const unsigned char *p, size_t block) {
+    if (o->copy_count > 0 && (o->copy_index + o->copy_count != idx || o->copy_count == UINT32_MAX) &&
+        delta_emit_copy(o) != 0) return -1;
+    if (o->copy_count == 0) o->copy_index = idx;
+    o->copy_count++;
+    o->crc = g_crc32c(o->crc, p, block);
+    o->matched += block;
+    return 0;
+}
+
+static int delta_literal(struct delta_out *o, const unsigned char *p, size_t len) {
+    if (delta_emit_copy(o) != 0) return -1;
+    while (len > 0) {
+        size_t n = len > DELTA_LITERAL_MAX ? DELTA_LITERAL_MAX : len;
+        uint32_t hdr[2] = { htonl(DELTA_LITERAL), htonl((uint32_t)n) };
+        if (bulk_append(&o->b, hdr, sizeof(hdr)) != 0 || bulk_append(&o->b, p, n) != 0) return -1;
+        o->crc = g_crc32c(o->crc, p, n);
+        o->literal += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* 增量上传（-d，协商出 CAP_DELTA）：
+   收服务端旧文件的块签名，滚动比对本地文件，输出复制/字面指令，最后等服务端重建并校验后的回复。
+   不做断点续传；返回值同 upload_file() */
+static int upload_delta(int sock, const char *filename, uint64_t *moved) {
+    int rc = -1;
+    int fd = -1;
+    struct delta_sig *sigs = NULL;
+    uint32_t *head = NULL, *next = NULL;
+    unsigned char *buf = NULL;
+    struct delta_out o;
+    memset(&o, 0, sizeof(o));
+    o.b.sock = sock;
+
+    fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("open file");
+        rc = 1;
+        goto out;
+    }
+    uint64_t filesize = (uint64_t)st.st_size;
+
+    /* 1) 2) 3) send mode, filename and filesize；4) 收 old_size, block, nblocks 与签名 */
+    uint64_t net_filesize = htonll(filesize);
+    if (send_request(sock, "upload_delta", filename, &net_filesize, sizeof(net_filesize)) != 0) goto out;
+    uint64_t hdr[2];
+    if (recv_all(sock, hdr, sizeof(hdr)) != sizeof(hdr)) {
+        fprintf(stderr, "recv delta header failed\n");
+        goto out;
+    }
+    if (hdr[0] == REPLY_ERROR) {
+        fprintf(stderr, "%s: server cannot store file\n", filename);
+        rc = 1;
+        goto out;
+    }
+    uint32_t shape[2];  /* block, nblocks */
+    memcpy(shape, &hdr[1], sizeof(shape));
+    size_t block = ntohl(shape[0]);
+    uint32_t nblocks = ntohl(shape[1]);
+    if (block == 0 || block > DELTA_LITERAL_MAX) {
+        fprintf(stderr, "bad delta block size %zu\n", block);
+        goto out;
+    }
+    sigs = malloc((size_t)nblocks * sizeof(*sigs) + 1);
+    size_t nbuckets = 1024;
+    while (nbuckets < 2 * (size_t)nblocks) nbuckets <<= 1;
+    head = malloc(nbuckets * sizeof(*head));
+    next = malloc((size_t)nblocks * sizeof(*next) + 1);
+    o.b.buf = malloc(BULK_BUF);
+    buf = malloc(DELTA_WINDOW);
+    if (!sigs || !head || !next || !o.b.buf || !buf) goto out;
+    if (recv_all(sock, sigs, (size_t)nblocks * sizeof(*sigs)) != (ssize_t)((size_t)nblocks * sizeof(*sigs))) {
+        fprintf(stderr, "recv delta signatures failed\n");
+        goto out;
+    }
+    memset(head, 0xff, nbuckets * sizeof(*head));
+    for (uint32_t i = nblocks; i-- > 0; ) {  /* 倒序插入，链表里小序号在前 */
+        sigs[i].weak = ntohl(sigs[i].weak);
+        sigs[i].strong = ntohl(sigs[i].strong);
+        size_t h = (sigs[i].weak * 2654435761u) & (nbuckets - 1);
+        next[i] = head[h];
+        head[h] = i;
+    }
+
+    /* 5) 滑动窗口 [p, p + block) 找匹配，[lit, p) 是尚未发出的字面数据 */
+    size_t have = 0, p = 0, lit = 0;
+    uint64_t consumed = 0;  /* 已读入缓冲的文件字节 */
+    uint32_t a = 0, b = 0, weak = 0;
+    int rolling = 0;
+    uint64_t want_next = UINT64_MAX;  /* 上一块匹配的下一块，优先尝试，连续段不必查表 */
+    while (1) {
+        if (have - p < block && consumed < filesize) {
+            if (lit > 0) {
+                memmove(buf, buf + lit, have - lit);
+                have -= lit;
+                p -= lit;
+                lit = 0;
+            }
+            size_t room = DELTA_WINDOW - have;
+            if (room > filesize - consumed) room = (size_t)(filesize - consumed);
+            ssize_t n = read(fd, buf + have, room);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                fprintf(stderr, "read local file failed or file shrank\n");
+                goto out;
+            }
+            have += (size_t)n;
+            consumed += (uint64_t)n;
+            continue;
+        }
+        if (have - p < block) break;
+        if (nblocks == 0) {
+            /* 服务端没有旧文件，全部是字面数据 */
+            if (delta_literal(&o, buf + lit, have - lit) != 0) goto out;
+            lit = p = have;
+            continue;
+        }
+        if (!rolling) {
+            weak = delta_weak(buf + p, block, &a, &b);
+            rolling = 1;
+        }
+
+        uint64_t hit = UINT64_MAX;
+        uint32_t strong = 0;
+        int have_strong = 0;
+        if (want_next < nblocks && sigs[want_next].weak == weak) {
+            strong = g_crc32c(0, buf + p, block);
+            have_strong = 1;
+            if (sigs[want_next].strong == strong) hit = want_next;
+        }
+        for (uint32_t i = head[(weak * 2654435761u) & (nbuckets - 1)]; hit == UINT64_MAX && i != UINT32_MAX; i = next[i]) {
+            if (sigs[i].weak != weak) continue;
+            if (!have_strong) {
+                strong = g_crc32c(0, buf + p, block);
+                have_strong = 1;
+            }
+            if (sigs[i].strong == strong) hit = i;
+        }
+        if (hit != UINT64_MAX) {
+            if (p > lit && delta_literal(&o, buf + lit, p - lit) != 0) goto out;
+            if (delta_copy(&o, hit, buf + p, block) != 0) goto out;
+            p += block;
+            lit = p;
+            rolling = 0;
+            want_next = hit + 1;
+            continue;
+        }
+
+        /* 不匹配：窗口右移一个字节，字面数据攒够一帧就先发出去 */
+        if (p + 1 - lit >= DELTA_LITERAL_MAX) {
+            if (delta_literal(&o, buf + lit, p + 1 - lit) != 0) goto out;
+            lit = p + 1;
+        }
+        if (p + block < have) {
+            uint32_t out_byte = buf[p], in_byte = buf[p + block];
+            a += in_byte - out_byte;
+            b += a - (uint32_t)block * out_byte;
+            weak = (a & 0xffff) | (b << 16);
+        } else {
+            rolling = 0;
+        }
+        p++;
+        want_next = UINT64_MAX;
+    }
+    if (have > lit && delta_literal(&o, buf + lit, have - lit) != 0) goto out;
+    if (delta_emit_copy(&o) != 0) goto out;
+    uint32_t end[2] = { htonl(DELTA_END), htonl(o.crc) };
+    if (bulk_append(&o.b, end, sizeof(end)) != 0 || bulk_flush(&o.b) != 0) goto out;
+
+    /* 6) 服务端重建、校验并落盘后回复新文件大小，校验不符为 REPLY_ERROR */
+    uint64_t net_result;
+    if (recv_all(sock, &net_result, sizeof(net_result)) != sizeof(net_result)) {
+        fprintf(stderr, "recv delta result failed\n");
+        goto out;
+    }
+    if (ntohll(net_result) != filesize) {
+        fprintf(stderr, "%s: server rejected the delta (checksum mismatch)\n", filename);
+        rc = 1;
+        goto out;
+    }
+    printf("Delta upload finished: %s literal=%" PRIu64 " matched=%" PRIu64 "\n", filename, o.literal, o.matched);
+    *moved += o.literal;
+    rc = 0;
+
+out:
+    free(sigs);
+    free(head);
+    free(next);
+    free(buf);
+    free(o.b.buf);
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+/* ---------------- 去重上传 ---------------- */
+
+/* FastCDC 按内容切块：gear 哈希逐字节滚动，平均长度之前用更严的掩码、之后用更松的掩码（归一化切块），
+   块长集中在 CDC_AVG 附近。gear 表由固定种子生成，所有客户端切出相同的块，服务端才能跨客户端去重 */
+#define CDC_MIN (16 * 1024)
+#define CDC_AVG (64 * 1024)
+#define CDC_MAX (256 * 1024)
+#define CDC_MASK_S (((1ULL << 18) - 1) << 46)  /* 比 log2(CDC_AVG) 多两位 */
+#define CDC_MASK_L (((1ULL << 14) - 1) << 50)  /* 少两位 */
+#define CDC_BUF (4 * 1024 * 1024)
+#define DEDUP_REF_LEN (SHA256_LEN + 4)  /* 一条块引用：SHA-256 + uint32_t 长度 */
+#define DEDUP_MAX_CHUNKS (1u << 20)     /* 服务端接受的最多块数，切出更多块的文件改走普通上传 */
+
+static uint64_t g_gear[256];
+
+static void cdc_init(void) {
+    uint64_t x = 0x46547632u;  /* splitmix64 */
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        g_gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* p 开始的 n 字节里切出下一块，返回块长 */
+static size_t cdc_next(const unsigned char *p, size_t n) {
+    if (n <= CDC_MIN) return n;
+    size_t normal = n < CDC_AVG ? n : CDC_AVG;
+    size_t end = n < CDC_MAX ? n : CDC_MAX;
+    uint64_t fp = 0;
+    size_t i = CDC_MIN;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + g_gear[p[i]];
+        if (!(fp & CDC_MASK_S)) return i + 1;
+    }
+    for (; i < end; i++) {
+        fp = (fp << 1) + g_gear[p[i]];
+        if (!(fp & CDC_MASK_L)) return i + 1;
+    }
+    return end;
+}
+
+/* 去重上传（-D，协商出 CAP_DEDUP）：先切块算哈希，把块列表发给服务端，
+   只发它回复缺少的块。已入库的块不会重传，失败后重新运行就相当于续传。
+   返回值同 upload_file()，另有 2 表示块数超过 DEDUP_MAX_CHUNKS、还没发出请求，调用方改走普通上传 */
+static int upload_dedup(int sock, const char *filename, uint64_t *moved) {
+    int rc = -1;
+    unsigned char *buf = NULL, *refs = NULL;
+    uint64_t *offsets = NULL;
+    uint32_t *need = NULL;
+    struct bulk_stream out = { sock, NULL, 0 };
+    uint64_t n = 0, cap = 0;
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("open file");
+        rc = 1;
+        goto out;
+    }
+    uint64_t filesize = (uint64_t)st.st_size;
+
+    /* 切块：缓冲里不足 CDC_MAX 且文件没读完时先补数据，保证切点与读入的分段无关 */
+    buf = malloc(CDC_BUF);
+    if (!buf) goto out;
+    size_t have = 0, p = 0;
+    uint64_t consumed = 0, offset = 0;
+    while (offset < filesize) {
+        if (have - p < CDC_MAX && consumed < filesize) {
+            memmove(buf, buf + p, have - p);
+            have -= p;
+            p = 0;
+            size_t room = CDC_BUF - have;
+            if (room > filesize - consumed) room = (size_t)(filesize - consumed);
+            ssize_t r = read(fd, buf + have, room);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                fprintf(stderr, "read local file failed or file shrank\n");
+                goto out;
+            }
+            have += (size_t)r;
+            consumed += (uint64_t)r;
+            continue;
+        }
+        if (n == DEDUP_MAX_CHUNKS) {
+            fprintf(stderr, "%s: too many chunks for dedup, uploading the whole file\n", filename);
+            rc = 2;
+            goto out;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            unsigned char *nr = realloc(refs, cap * DEDUP_REF_LEN);
+            uint64_t *no = realloc(offsets, cap * sizeof(*offsets));
+            if (nr) refs = nr;
+            if (no) offsets = no;
+            if (!nr || !no) goto out;
+        }
+        size_t len = cdc_next(buf + p, have - p);
+        uint32_t len_net = htonl((uint32_t)len);
+        sha256(buf + p, len, refs + n * DEDUP_REF_LEN);
+        memcpy(refs + n * DEDUP_REF_LEN + SHA256_LEN, &len_net, sizeof(len_net));
+        offsets[n++] = offset;
+        offset += len;
+        p += len;
+    }
+
+    /* 1) 2) 3) mode, filename, filesize, nchunks，随后块列表 */
+    uint64_t hdr[2] = { htonll(filesize), htonll(n) };
+    if (send_request(sock, "upload_dedup", filename, hdr, sizeof(hdr)) != 0) goto out;
+    if (n > 0 && send_all(sock, refs, n * DEDUP_REF_LEN) != (ssize_t)(n * DEDUP_REF_LEN)) {
+        perror("send chunk list");
+        goto out;
+    }
+
+    /* 4) 服务端缺少的块序号（升序） */
+    uint64_t nneed_net;
+    if (recv_all(sock, &nneed_net, sizeof(nneed_net)) != sizeof(nneed_net)) {
+        fprintf(stderr, "recv dedup reply failed\n");
+        goto out;
+    }
+    if (nneed_net == REPLY_ERROR) {
+        fprintf(stderr, "%s: server cannot store file\n", filename);
+        rc = 1;
+        goto out;
+    }
+    uint64_t nneed = ntohll(nneed_net);
+    if (nneed > n) goto out;
+    need = malloc(nneed * sizeof(*need) + 1);
+    out.buf = malloc(BULK_BUF);
+    if (!need || !out.buf) goto out;
+    if (recv_all(sock, need, nneed * sizeof(*need)) != (ssize_t)(nneed * sizeof(*need))) goto out;
+
+    /* 5) 依次发送缺少的块，小块攒满发送缓冲再发 */
+    uint64_t sent = 0;
+    for (uint64_t i = 0; i < nneed; i++) {
+        uint32_t idx = ntohl(need[i]);
+        if (idx >= n) goto out;
+        uint32_t len_net;
+        memcpy(&len_net, refs + (uint64_t)idx * DEDUP_REF_LEN + SHA256_LEN, sizeof(len_net));
+        size_t len = ntohl(len_net);
+        for (size_t got = 0; got < len; ) {
+            ssize_t r = pread(fd, buf + got, len - got, (off_t)(offsets[idx] + got));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                fprintf(stderr, "read local file failed or file shrank\n");
+                goto out;
+            }
+            got += (size_t)r;
+        }
+        if (bulk_append(&out, buf, len) != 0) goto out;
+        sent += len;
+    }
+    if (bulk_flush(&out) != 0) goto out;
+
+    /* 6) 服务端校验、入库并写好清单后回复 filesize */
+    uint64_t net_result;
+    if (recv_all(sock, &net_result, sizeof(net_result)) != sizeof(net_result)) {
+        fprintf(stderr, "recv dedup result failed\n");
+        goto out;
+    }
+    if (ntohll(net_result) != filesize) {
+        fprintf(stderr, "%s: server failed to store chunks\n", filename);
+        rc = 1;
+        goto out;
+    }
+    printf("Dedup upload finished: %s chunks=%" PRIu64 " sent=%" PRIu64 " (%" PRIu64 " bytes)\n",
+           filename, n, nneed, sent);
+    *moved += sent;
+    rc = 0;
+
+out:
+    free(buf);
+    free(refs);
+    free(offsets);
+    free(need);
+    free(out.buf);
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+/* 客户端上传 — 注意：按你的要求 upload 不读取本地 progress 偏移，
+   仅发送文件大小，等待服务器给出 agreed_offset，然后从 agreed_offset 发送剩余数据。
+   不关闭 sock（会话模式下还要继续用），moved 累加本次实际发送的字节；caps 含压缩能力时数据分帧发送。
+   返回 0 成功，1 本文件失败但连接仍可用，-1 连接已不可用 */
+static int upload_file(int sock, const char *filename, uint32_t caps, uint64_t *moved) {
+    int rc = -1;
+    FILE *fp = NULL;
+    char *buf = NULL;
+    int vfd = -1;
+    struct range *bad = NULL;  /* 续传校验发现的服务端坏区间，尾部传完后补发 */
+    int nbad = 0;
+    struct merkle tree = { 0 };  /* 续传校验建的本地树，叶子用来拼前缀 CRC */
+    uint64_t tree_len = 0;
+
+    if (caps & CAP_DEDUP) {
+        rc = upload_dedup(sock, filename, moved);
+        if (rc != 2) return rc;
+        rc = -1;
+    }
+    if (caps & CAP_DELTA) return upload_delta(sock, filename, moved);
+
+    /* 先确认本地文件可用，出错时连接上还没有发出半个请求 */
+    off_t sz = get_file_size_stat(filename);
+    if (sz < 0) {
+        perror("stat file");
+        rc = 1;
+        goto out;
+    }
+    uint64_t filesize = (uint64_t)sz;
+
+    /* 先用哈希树比对服务端已有的前缀，不一致的块等尾部传完后、服务端发布之前补发 */
+    if (caps_verify(caps) && (caps & CAP_REPAIR) && filesize > 0 && (vfd = open(filename, O_RDONLY)) >= 0) {
+        uint64_t server_size;
+        int vrc = verify_prefix(sock, filename, vfd, filesize, &server_size, &bad, &nbad, &tree);
+        if (vrc < 0) goto out;
+        // 服务端不给树或本地建树失败时没有留下树，前缀 CRC 全部现读
+        if (vrc == 0 && tree.nlevels > 0) tree_len = filesize < server_size ? filesize : server_size;
+    }
+
+    /* 1) 2) 3) send mode, filename and filesize */
+    uint64_t net_filesize = htonll(filesize);
+    if (send_request(sock, "upload", filename, &net_filesize, sizeof(net_filesize)) != 0) goto out;
+
+    /* 4) receive agreed_offset from server */
+    uint64_t net_agreed;
+    if (recv_all(sock, &net_agreed, sizeof(net_agreed)) != sizeof(net_agreed)) {
+        fprintf(stderr, "recv agreed_offset failed\n");
+        goto out;
+    }
+    uint64_t agreed = ntohll(net_agreed);
+    if (agreed == REPLY_ERROR) {
+        fprintf(stderr, "%s: server cannot store file\n", filename);
+        rc = 1;
+        goto out;
+    }
+    if (agreed > filesize) {
+        fprintf(stderr, "server agreed_offset (%" PRIu64 ") > filesize (%" PRIu64 ")\n", agreed, filesize);
+        goto out;
+    }
+
+    /* 5) open local file and seek to agreed, then send remaining data and update .progress */
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        perror("fopen file");
+        goto out;
+    }
+    int framed = caps_framed(caps);
+    size_t block = framed ? FRAME_BLOCK : CHUNK;
+    buf = malloc(framed ? 2 * FRAME_BLOCK : CHUNK);  /* 分帧时后半是压缩缓冲 */
+    if (!buf) {
+        perror("malloc");
+        goto out;
+    }
+    /* 要比对服务端确认里的整体 CRC 时先算续传前缀的 CRC：续传校验建过树的部分由叶子拼出，只读剩下的零头 */
+    int ack = (caps & CAP_ACK) != 0;
+    uint32_t crc = 0;
+    size_t nread;
+    if (ack) {
+        uint64_t pos;
+        crc = merkle_prefix_crc(&tree, tree_len, agreed, &pos);
+        while (pos < agreed) {
+            ssize_t n = pread(fileno(fp), buf, agreed - pos > block ? block : (size_t)(agreed - pos), (off_t)pos);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                fprintf(stderr, "%s: read failed before agreed offset\n", filename);
+                goto out;
+            }
+            crc = g_crc32c(crc, buf, (size_t)n);
+            pos += (uint64_t)n;
+        }
+    }
+    if (fseeko(fp, (off_t)agreed, SEEK_SET) != 0) {
+        perror("fseeko");
+        goto out;
+    }
+
+    uint64_t total_sent = agreed;
+    struct codec_picker pk;
+    picker_init(&pk, caps);
+    struct frame_stats stats[FRAME_CODECS] = { { 0, 0, 0, 0, 0 } };
+    struct checkpoint cp;
+    checkpoint_init(&cp, agreed);
+    /* 只发到声明的 filesize：文件若在上传中变长，多出的字节会被对端当成下一个请求 */
+    while (total_sent < filesize &&
+           (nread = fread(buf, 1, filesize - total_sent > block ? block : (size_t)(filesize - total_sent), fp)) > 0) {
+        if (framed ? send_frame(sock, &pk, buf, nread, buf + FRAME_BLOCK, (caps & CAP_CHECKSUM) != 0, stats) != 0
+                       : send_all(sock, buf, nread) != (ssize_t)nread) {
+            perror("send_all file data");
+            goto out;
+        }
+        if (ack) crc = g_crc32c(crc, buf, nread);
+        total_sent += (uint64_t)nread;
+
+        /* 按检查点策略原子写进度 */
+        if (checkpoint_due(&cp, total_sent) && write_progress_atomic(filename, total_sent) != 0) {
+            fprintf(stderr, "warning: write progress failed\n");
+        }
+    }
+    if (ferror(fp)) {
+        perror("fread");
+        goto out;
+    }
+    if (total_sent < filesize) {
+        fprintf(stderr, "file shrank during upload\n");
+        goto out;
+    }
+
+    /* agreed 之后的部分已经整段重发，坏区间只需补到 agreed 为止 */
+    int keep = 0;
+    for (int i = 0; i < nbad; i++) {
+        if (bad[i].start >= agreed) continue;
+        bad[keep] = bad[i];
+        if (bad[keep].end > agreed) bad[keep].end = agreed;
+        keep++;
+    }
+
+    if (keep > 0) {
+        uint64_t bytes = ranges_bytes(bad, keep);
+        printf("%s: %d corrupt range(s) on server, re-sending %" PRIu64 " bytes\n", filename, keep, bytes);
+        *moved += bytes;
+    }
+    if ((caps & CAP_REPAIR) && send_repairs(sock, vfd, bad, keep) != 0) goto out;
+
+    /* 6) 等服务端发布落盘后的确认，坏区间已在发布前补上，整个文件的 CRC 总要一致 */
+    if (ack) {
+        unsigned char reply[12];
+        if (recv_all(sock, reply, sizeof(reply)) != sizeof(reply)) {
+            fprintf(stderr, "%s: no acknowledgment from server, upload not durable\n", filename);
+            goto out;
+        }
+        uint64_t committed;
+        uint32_t server_crc;
+        memcpy(&committed, reply, 8);
+        memcpy(&server_crc, reply + 8, 4);
+        committed = ntohll(committed);
+        server_crc = ntohl(server_crc);
+        if (committed != filesize) {
+            fprintf(stderr, "%s: server committed %" PRIu64 " of %" PRIu64 " bytes\n", filename, committed, filesize);
+            goto out;
+        }
+        if (server_crc != crc) {
+            fprintf(stderr, "%s: CRC32C mismatch after upload (server %08x, local %08x)\n", filename, server_crc, crc);
+            rc = 1;
+            goto out;
+        }
+    }
+    /* 上传完成，删除进度文件 */
+    remove_progress(filename);
+    printf("Upload finished: sent=%" PRIu64 "%s\n", total_sent,
+           ack ? " (durable on server, CRC32C verified)" : "");
+    if (caps_codec(caps) >= 0) print_frames(stats);
+    *moved += total_sent - agreed;
+    rc = 0;
+
+out:
+    free(buf);
+    free(bad);
+    merkle_free(&tree);
+    if (vfd >= 0) close(vfd);
+    if (fp) fclose(fp);
+    return rc;
+}
+
+int client_upload(int sock, const char *filename, uint32_t caps) {
+    uint64_t moved = 0;
+    double start = now_sec();
+    int rc = upload_file(sock, filename, caps, &moved);
+    if (rc == 0) print_rate(moved, start);
+    close(sock);
+    return rc;
+}
+
+/* 客户端下载 — 发送本地已有偏移，接收 filesize & server_offset，然后接收数据写入并更新进度 */
+/* 下载请求的前半部分：发送 mode、filename 与本地已有偏移。
+   与 download_body() 分开，会话模式下可以先把后面几个文件的请求发出去 */
+static int download_request(int sock, const char *filename) {
+    /* 1) 2) 3) send mode, filename and local_offset（本地已有偏移，文件不存在时为 0） */
+    uint64_t net_local_offset = htonll(local_resume_offset(filename));
+    return send_request(sock, "download", filename, &net_local_offset, sizeof(net_local_offset));
+}
+
+/* 下载请求的后半部分：接收回复与数据并落盘。不关闭 sock，moved 累加本次实际接收的字节。
+   返回值同 upload_file() */
+static int download_body(int sock, const char *filename, uint32_t caps, uint64_t *moved) {
+    int rc = -1;
+    char *buf = NULL;
+    FILE *fp = fopen(filename, "r+b");
+    if (!fp) {
+        /* 不存在则创建 */
+        fp = fopen(filename, "wb+");
+        if (!fp) {
+            perror("fopen local file");
+            goto out;
+        }
+    }
+
+    /* 4) recv filesize and server_offset */
+    uint64_t net_filesize, net_server_offset;
+    if (recv_all(sock, &net_filesize, sizeof(net_filesize)) != sizeof(net_filesize)) {
+        fprintf(stderr, "recv filesize failed\n");
+        goto out;
+    }
+    if (recv_all(sock, &net_server_offset, sizeof(net_server_offset)) != sizeof(net_server_offset)) {
+        fprintf(stderr, "recv server_offset failed\n");
+        goto out;
+    }
+    uint64_t filesize = ntohll(net_filesize);
+    uint64_t server_offset = ntohll(net_server_offset);
+
+    if (filesize == REPLY_ERROR) {
+        fprintf(stderr, "%s: server cannot open file\n", filename);
+        rc = 1;
+        goto out;
+    }
+    if (server_offset > filesize) {
+        fprintf(stderr, "server_offset > filesize\n");
+        goto out;
+    }
+
+    /* seek to server_offset for writing */
+    if (fseeko(fp, (off_t)server_offset, SEEK_SET) != 0) {
+        perror("fseeko to server_offset");
+        goto out;
+    }
+
+    /* 5) receive file bytes until total_received == filesize or peer closes */
+    uint64_t total_received = server_offset;
+    struct checkpoint cp;
+    checkpoint_init(&cp, server_offset);
+    /* 先记下起点，保证传输期间始终有进度文件可依 */
+    if (server_offset < filesize && write_progress_atomic(filename, server_offset) != 0) {
+        fprintf(stderr, "warning: write progress failed\n");
+    }
+    int framed = caps_framed(caps);
+    struct frame_stats stats[FRAME_CODECS] = { { 0, 0, 0, 0, 0 } };
+    buf = malloc(framed ? 2 * FRAME_BLOCK : CHUNK);  /* 分帧时后半是压缩数据 */
+    if (!buf) {
+        perror("malloc");
+        goto out;
+    }
+    while (total_received < filesize) {
+        ssize_t want = (filesize - total_received) > CHUNK ? CHUNK : (ssize_t)(filesize - total_received);
+        ssize_t r = framed ? recv_frame(sock, buf, buf + FRAME_BLOCK, total_received, filesize - total_received,
+                                        (caps & CAP_CHECKSUM) != 0, stats)
+                           : recv_all(sock, buf, want);
+        if (r <= 0 || (!framed && r != want)) {
+            fprintf(stderr, "recv failed or connection closed prematurely\n");
+            goto out;
+        }
+        size_t w = fwrite(buf, 1, r, fp);
+        if (w != (size_t)r) {
+            perror("fwrite");
+            goto out;
+        }
+        total_received += (uint64_t)r;
+
+        /* 到检查点才落盘：先 fsync 数据，再记录进度，进度永远不超过已持久化的数据 */
+        if (checkpoint_due(&cp, total_received)) {
+            fflush(fp);
+            fdatasync(fileno(fp));
+            if (write_progress_atomic(filename, total_received) != 0) {
+                fprintf(stderr, "warning: write progress failed\n");
+            }
+        }
+    }
+
+    /* 结束时做一次完整落盘 */
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        perror("fsync");
+        goto out;
+    }
+
+    /* 下载完成，删除进度文件 */
+    remove_progress(filename);
+    printf("Download complete: %s (size=%" PRIu64 ")\n", filename, filesize);
+    if (caps_codec(caps) >= 0) print_frames(stats);
+    *moved += total_received - server_offset;
+    rc = 0;
+
+out:
+    free(buf);
+    if (fp) fclose(fp);
+    return rc;
+}
+
+int client_download(int sock, const char *filename, uint32_t caps) {
+    uint64_t moved = 0;
+    double start = now_sec();
+    int rc = download_verify(sock, filename, caps, &moved);
+    if (rc == 0) rc = download_request(sock, filename);
+    if (rc == 0) rc = download_body(sock, filename, caps, &moved);
+    if (rc == 0) print_rate(moved, start);
+    close(sock);
+    return rc;
+}
+
+/* ---------------- 会话模式：一条连接承载多个文件 ---------------- */
+
+/* 多个文件共用一条连接（服务端需支持 CAP_PIPELINE，否则每个文件一条连接）。
+   下载最多提前发出 PIPELINE_DEPTH 个请求，服务端按序回复，省掉每个文件的往返；
+   上传需要等 agreed_offset 才能发数据，但上一个文件发完立即发下一个请求，不等连接关闭和重建。
+   某个文件出错时连接状态未知，重连后从下一个文件继续。返回失败的文件数 */
+static int client_session(const char *server_ip, int server_port, int upload, char **files, int nfiles) {
+    int failures = 0;
+    int i = 0;
+    int verified = 0;  /* 下载：前缀已校验过的文件数 */
+    uint64_t moved = 0;
+    double start = now_sec();
+    while (i < nfiles) {
+        uint32_t caps;
+        int sock = connect_server(server_ip, server_port, &caps);
+        if (sock < 0) return failures + (nfiles - i);
+
+        if (!(caps & CAP_PIPELINE)) {
+            int rc = upload ? client_upload(sock, files[i], caps) : client_download(sock, files[i], caps);
+            if (rc != 0) failures++;
+            i++;
+            continue;
+        }
+
+        /* 下载请求要流水线发出，续传校验的多轮往返放在这之前逐个做完；
+           校验中连接出错就不再校验该文件，重连后继续 */
+        if (!upload && caps_verify(caps)) {
+            if (verified < i) verified = i;
+            while (verified < nfiles && download_verify(sock, files[verified], caps, &moved) == 0) verified++;
+            if (verified < nfiles) {
+                fprintf(stderr, "%s: verification failed, resuming unverified\n", files[verified]);
+                verified++;
+                close(sock);
+                continue;
+            }
+        }
+
+        int first = i;
+        int sent = i;  /* 已发出请求的下载数 */
+        while (i < nfiles) {
+            int rc;
+            if (upload) {
+                rc = upload_file(sock, files[i], caps, &moved);
+            } else {
+                while (sent < nfiles && sent - i < PIPELINE_DEPTH && download_request(sock, files[sent]) == 0) sent++;
+                rc = sent > i ? download_body(sock, files[i], caps, &moved) : -1;
+            }
+            if (rc == 1) {
+                /* 服务端回了 REPLY_ERROR，连接仍然可用 */
+                failures++;
+                i++;
+                continue;
+            }
+            if (rc != 0) {
+                /* 本连接一个文件都没完成就出错，算作该文件失败，避免反复重试 */
+                if (i == first || sent > i) {
+                    fprintf(stderr, "%s: transfer failed\n", files[i]);
+                    failures++;
+                    i++;
+                }
+                break;
+            }
+            i++;
+        }
+        close(sock);
+    }
+    printf("Session finished: %d file(s), %d failed\n", nfiles, failures);
+    print_rate(moved, start);
+    return failures;
+}
+
+/* ---------------- 分段并发传输 ---------------- */
+
+/* 写分段进度；调用方持有 job->lock。下载先 fdatasync，保证记录不超过已落盘的数据 */
+static int write_ranges_progress(struct range_job *job) {
+    if (!job->upload && fdatasync(job->fd) != 0) return -1;
+    size_t cap = 64 + (size_t)job->nranges * 64;
+    char *text = malloc(cap);
+    if (!text) return -1;
+    int len = snprintf(text, cap, "ranges %" PRIu64 " %d\n", job->filesize, job->nranges);
+    for (int i = 0; i < job->nranges; i++) {
+        struct range *r = &job->ranges[i];
+        len += snprintf(text + len, cap - (size_t)len, "%" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                        r->start, r->end, r->done);
+    }
+    int rc = write_progress_text(job->filename, text);
+    free(text);
+    return rc;
+}
+
+/* 读分段进度；不存在或不是分段格式返回 -1 */
+static int read_ranges_progress(const char *fname, uint64_t *filesize, struct range **out, int *n) {
+    char prog[4096];
+    snprintf(prog, sizeof(prog), "%s.progress", fname);
+    FILE *f = fopen(prog, "r");
+    if (!f) return -1;
+    int count;
+    struct range *ranges = NULL;
+    if (fscanf(f, "ranges %" SCNu64 " %d", filesize, &count) != 2 || count <= 0 || count > MAX_CONNECTIONS) goto bad;
+    ranges = calloc((size_t)count, sizeof(*ranges));
+    if (!ranges) goto bad;
+    for (int i = 0; i < count; i++) {
+        struct range *r = &ranges[i];
+        if (fscanf(f, "%" SCNu64 " %" SCNu64 " %" SCNu64, &r->start, &r->end, &r->done) != 3 ||
+            r->start > r->end || r->end > *filesize || r->done > r->end - r->start) goto bad;
+    }
+    fclose(f);
+    *out = ranges;
+    *n = count;
+    return 0;
+
+bad:
+    free(ranges);
+    fclose(f);
+    return -1;
+}
+
+/* 把 [from, filesize) 平均分成最多 nconn 段，每段不小于 RANGE_MIN_SIZE */
+static int plan_ranges(struct range_job *job, uint64_t from, int nconn) {
+    uint64_t span = job->filesize - from;
+    uint64_t max_n = span / RANGE_MIN_SIZE;
+    int n = (uint64_t)nconn > max_n ? (int)max_n : nconn;
+    if (n < 1) n = 1;
+    job->ranges = calloc((size_t)n, sizeof(*job->ranges));
+    if (!job->ranges) return -1;
+    for (int i = 0; i < n; i++) {
+        job->ranges[i].start = from + span * (uint64_t)i / (uint64_t)n;
+        job->ranges[i].end = from + span * (uint64_t)(i + 1) / (uint64_t)n;
+    }
+    job->nranges = n;
+    return 0;
+}
+
+/* 记录某段的完成量，按检查点策略（或 force）落盘 */
+static void range_progress(struct range_job *job, int idx, uint64_t done, uint64_t moved, int force) {
+    pthread_mutex_lock(&job->lock);
+    job->ranges[idx].done = done;
+    job->moved += moved;
+    uint64_t total = 0;
+    for (int i = 0; i < job->nranges; i++) total += job->ranges[i].done;
+    if ((checkpoint_due(&job->cp, total) || force) && write_ranges_progress(job) != 0) {
+        fprintf(stderr, "warning: write progress failed\n");
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* 收取分段上传的确认（累计的已写入位置）。blocking 为 0 时只取已到达的部分。
+   返回 0 正常，-1 连接出错 */
+static int range_drain_acks(int sock, struct range_job *job, int idx,
+                            unsigned char ack[8], size_t *got, int blocking) {
+    struct range *r = &job->ranges[idx];
+    while (1) {
+        ssize_t n = recv(sock, ack + *got, 8 - *got, blocking ? 0 : MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("recv ack");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "server closed during range upload\n");
+            return -1;
+        }
+        *got += (size_t)n;
+        if (*got < 8) continue;
+        *got = 0;
+        uint64_t net;
+        memcpy(&net, ack, sizeof(net));
+        uint64_t pos = ntohll(net);
+        if (pos < r->start + r->done || pos > r->end) {
+            fprintf(stderr, "bad range ack %" PRIu64 "\n", pos);
+            return -1;
+        }
+        range_progress(job, idx, pos - r->start, 0, pos == r->end);
+        if (blocking) return 0;
+    }
+}
+
+static void *upload_range_worker(void *arg) {
+    struct range_task *t = arg;
+    struct range_job *job = t->job;
+    struct range *r = &job->ranges[t->idx];
+    uint64_t pos = r->start + r->done;
+    char *buf = NULL;
+    int sock = -1;
+    t->rc = -1;
+    if (pos >= r->end) {
+        t->rc = 0;
+        return NULL;
+    }
+
+    sock = connect_server(job->server_ip, job->server_port, NULL);
+    buf = malloc(RANGE_BUF);
+    if (sock < 0 || !buf) goto out;
+    uint64_t hdr[3] = { htonll(job->filesize), htonll(pos), htonll(r->end) };
+    if (send_request(sock, "upload_range", job->filename, hdr, sizeof(hdr)) != 0) goto out;
+    uint64_t net_ready;
+    if (recv_all(sock, &net_ready, sizeof(net_ready)) != sizeof(net_ready) || ntohll(net_ready) != pos) {
+        fprintf(stderr, "range upload rejected by server\n");
+        goto out;
+    }
+
+    unsigned char ack[8];
+    size_t ack_got = 0;
+    while (pos < r->end) {
+        size_t want = r->end - pos > RANGE_BUF ? RANGE_BUF : (size_t)(r->end - pos);
+        ssize_t n = pread(job->fd, buf, want, (off_t)pos);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            fprintf(stderr, "read local file failed or file shrank\n");
+            goto out;
+        }
+        if (send_all(sock, buf, (size_t)n) != n) {
+            perror("send_all file data");
+            goto out;
+        }
+        pos += (uint64_t)n;
+        __atomic_add_fetch(&job->moved, (uint64_t)n, __ATOMIC_RELAXED);
+        /* 顺手收掉已到达的确认，不阻塞发送 */
+        if (range_drain_acks(sock, job, t->idx, ack, &ack_got, 0) != 0) goto out;
+    }
+    /* 数据发完，等服务端 fsync 后的最终确认 */
+    while (r->start + r->done < r->end) {
+        if (range_drain_acks(sock, job, t->idx, ack, &ack_got, 1) != 0) goto out;
+    }
+    t->rc = 0;
+
+out:
+    free(buf);
+    if (sock >= 0) close(sock);
+    return NULL;
+}
+
+static void *download_range_worker(void *arg) {
+    struct range_task *t = arg;
+    struct range_job *job = t->job;
+    struct range *r = &job->ranges[t->idx];
+    uint64_t pos = r->start + r->done;
+    char *buf = NULL;
+    int sock = -1;
+    t->rc = -1;
+    if (pos >= r->end) {
+        t->rc = 0;
+        return NULL;
+    }
+
+    sock = connect_server(job->server_ip, job->server_port, NULL);
+    buf = malloc(RANGE_BUF);
+    if (sock < 0 || !buf) goto out;
+    uint64_t hdr[2] = { htonll(pos), htonll(r->end) };
+    if (send_request(sock, "download_range", job->filename, hdr, sizeof(hdr)) != 0) goto out;
+    uint64_t net_filesize;
+    if (recv_all(sock, &net_filesize, sizeof(net_filesize)) != sizeof(net_filesize)) {
+        fprintf(stderr, "recv filesize failed\n");
+        goto out;
+    }
+    if (ntohll(net_filesize) != job->filesize) {
+        fprintf(stderr, "file changed on server (size %" PRIu64 " != %" PRIu64 ")\n",
+                ntohll(net_filesize), job->filesize);
+        goto out;
+    }
+
+    while (pos < r->end) {
+        size_t want = r->end - pos > RANGE_BUF ? RANGE_BUF : (size_t)(r->end - pos);
+        ssize_t n = recv(sock, buf, want, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("recv");
+            goto out;
+        }
+        if (n == 0) {
+            fprintf(stderr, "recv failed or connection closed prematurely\n");
+            goto out;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = pwrite(job->fd, buf + off, (size_t)(n - off), (off_t)(pos + (uint64_t)off));
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                perror("pwrite");
+                goto out;
+            }
+            off += w;
+        }
+        pos += (uint64_t)n;
+        range_progress(job, t->idx, pos - r->start, (uint64_t)n, 0);
+    }
+    t->rc = 0;
+
+out:
+    free(buf);
+    if (sock >= 0) close(sock);
+    return NULL;
+}
+
+/* 每段一个线程并发传输，全部成功返回 0 */
+static int run_ranges(struct range_job *job) {
+    pthread_t tids[MAX_CONNECTIONS];
+    struct range_task tasks[MAX_CONNECTIONS];
+    void *(*worker)(void *) = job->upload ? upload_range_worker : download_range_worker;
+    int started = 0, rc = 0;
+    for (int i = 0; i < job->nranges; i++) {
+        tasks[i].job = job;
+        tasks[i].idx = i;
+        tasks[i].rc = -1;
+        int err = pthread_create(&tids[i], NULL, worker, &tasks[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));  // 错误码由返回值给出，不在 errno 里
+            rc = -1;
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        if (tasks[i].rc != 0) rc = -1;
+    }
+
+    /* 失败时也把各段已完成的部分记下来，下次从这里续传 */
+    pthread_mutex_lock(&job->lock);
+    if (rc != 0 && write_ranges_progress(job) != 0) {
+        fprintf(stderr, "warning: write progress failed\n");
+    }
+    pthread_mutex_unlock(&job->lock);
+    return rc;
+}
+
+static void range_job_init(struct range_job *job, const char *server_ip, int server_port,
+                           const char *filename, int upload) {
+    memset(job, 0, sizeof(*job));
+    job->server_ip = server_ip;
+    job->server_port = server_port;
+    job->filename = filename;
+    job->upload = upload;
+    job->fd = -1;
+    pthread_mutex_init(&job->lock, NULL);
+}
+
+static void range_job_free(struct range_job *job) {
+    if (job->fd >= 0) close(job->fd);
+    free(job->ranges);
+    pthread_mutex_destroy(&job->lock);
+}
+
+/* 所有段都已确认：服务端支持 CAP_RANGE_STAGE 时发提交，让暂存文件改名发布；旧服务端是原地写入，无需提交 */
+static int commit_ranges(struct range_job *job) {
+    uint32_t caps;
+    int sock = connect_server(job->server_ip, job->server_port, &caps);
+    if (sock < 0) return -1;
+    int rc = -1;
+    if (!(caps & CAP_RANGE_STAGE)) {
+        rc = 0;
+        goto out;
+    }
+    uint64_t hdr[3] = { htonll(job->filesize), htonll(job->filesize), htonll(job->filesize) };
+    if (send_request(sock, "upload_range", job->filename, hdr, sizeof(hdr)) != 0) goto out;
+    uint64_t reply[2];
+    if (recv_all(sock, &reply[0], sizeof(reply[0])) != sizeof(reply[0]) || ntohll(reply[0]) != job->filesize ||
+        recv_all(sock, &reply[1], sizeof(reply[1])) != sizeof(reply[1]) || ntohll(reply[1]) != job->filesize) {
+        fprintf(stderr, "range upload commit failed\n");
+        goto out;
+    }
+    rc = 0;
+
+out:
+    close(sock);
+    return rc;
+}
+
+/* 分段上传；文件太小拆不开且没有分段进度时，退回单连接 client_upload */
+int client_upload_ranges(const char *server_ip, int server_port, const char *filename, int nconn) {
+    struct range_job job;
+    range_job_init(&job, server_ip, server_port, filename, 1);
+    int rc = -1;
+
+    off_t sz = get_file_size_stat(filename);
+    if (sz < 0) {
+        perror("stat file");
+        goto out;
+    }
+    job.filesize = (uint64_t)sz;
+    uint64_t recorded_size;
+    if (read_ranges_progress(filename, &recorded_size, &job.ranges, &job.nranges) == 0 &&
+        recorded_size != job.filesize) {
+        fprintf(stderr, "local file changed since last attempt, starting over\n");
+        free(job.ranges);
+        job.ranges = NULL;
+    }
+    if (!job.ranges) {
+        if (plan_ranges(&job, 0, nconn) != 0) goto out;
+        if (job.nranges == 1) {
+            range_job_free(&job);
+            uint32_t caps;
+            int sock = connect_server(server_ip, server_port, &caps);
+            return sock < 0 ? -1 : client_upload(sock, filename, caps);
+        }
+    }
+
+    job.fd = open(filename, O_RDONLY);
+    if (job.fd < 0) {
+        perror("open file");
+        goto out;
+    }
+    checkpoint_init(&job.cp, 0);
+    pthread_mutex_lock(&job.lock);
+    write_ranges_progress(&job);
+    pthread_mutex_unlock(&job.lock);
+
+    double start = now_sec();
+    if (run_ranges(&job) != 0) goto out;
+    // 提交失败时保留进度，重试只需再提交一次
+    if (commit_ranges(&job) != 0) goto out;
+
+    remove_progress(filename);
+    printf("Upload finished: sent=%" PRIu64 " over %d connections\n", job.filesize, job.nranges);
+    print_rate(job.moved, start);
+    rc = 0;
+
+out:
+    range_job_free(&job);
+    return rc;
+}
+
+/* 分段下载；先用 start == end 的 download_range 查询大小再拆分 */
+int client_download_ranges(const char *server_ip, int server_port, const char *filename, int nconn) {
+    struct range_job job;
+    range_job_init(&job, server_ip, server_port, filename, 0);
+    int rc = -1;
+
+    if (read_ranges_progress(filename, &job.filesize, &job.ranges, &job.nranges) != 0) {
+        int sock = connect_server(server_ip, server_port, NULL);
+        if (sock < 0) goto out;
+        uint64_t hdr[2] = { 0, 0 };
+        uint64_t net_filesize;
+        if (send_request(sock, "download_range", filename, hdr, sizeof(hdr)) != 0 ||
+            recv_all(sock, &net_filesize, sizeof(net_filesize)) != sizeof(net_filesize) ||
+            ntohll(net_filesize) == REPLY_ERROR) {
+            fprintf(stderr, "query filesize failed\n");
+            close(sock);
+            goto out;
+        }
+        close(sock);
+        job.filesize = ntohll(net_filesize);
+
+        /* 之前单连接下载留下的前缀直接沿用 */
+        uint64_t from = local_resume_offset(filename);
+        if (from > job.filesize) from = job.filesize;
+        if (plan_ranges(&job, from, nconn) != 0) goto out;
+        if (job.nranges == 1) {
+            range_job_free(&job);
+            uint32_t caps;
+            sock = connect_server(server_ip, server_port, &caps);
+            return sock < 0 ? -1 : client_download(sock, filename, caps);
+        }
+    }
+
+    job.fd = open(filename, O_RDWR | O_CREAT, 0666);
+    if (job.fd < 0) {
+        perror("open local file");
+        goto out;
+    }
+    if (ftruncate(job.fd, (off_t)job.filesize) != 0) {
+        perror("ftruncate");
+        goto out;
+    }
+    checkpoint_init(&job.cp, 0);
+    pthread_mutex_lock(&job.lock);
+    if (write_ranges_progress(&job) != 0) fprintf(stderr, "warning: write progress failed\n");
+    pthread_mutex_unlock(&job.lock);
+
+    double start = now_sec();
+    if (run_ranges(&job) != 0) goto out;
+    if (fsync(job.fd) != 0) {
+        perror("fsync");
+        goto out;
+    }
+
+    remove_progress(filename);
+    printf("Download complete: %s (size=%" PRIu64 ", %d connections)\n", filename, job.filesize, job.nranges);
+    print_rate(job.moved, start);
+    rc = 0;
+
+out:
+    range_job_free(&job);
+    return rc;
+}
+
+/* ---------------- 批量模式：多个小文件打包成一个请求 ---------------- */
+
+struct file_list {
+    char **paths;
+    int n;
+    int cap;
+};
+
+static int file_list_add(struct file_list *l, const char *path) {
+    if (l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 256;
+        char **p = realloc(l->paths, (size_t)cap * sizeof(*p));
+        if (!p) return -1;
+        l->paths = p;
+        l->cap = cap;
+    }
+    l->paths[l->n] = strdup(path);
+    if (!l->paths[l->n]) return -1;
+    l->n++;
+    return 0;
+}
+
+static void file_list_free(struct file_list *l) {
+    for (int i = 0; i < l->n; i++) free(l->paths[i]);
+    free(l->paths);
+}
+
+/* 展开命令行参数：目录递归收集其中的普通文件，路径原样作为服务端的相对文件名 */
+static int collect_files(struct file_list *l, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        if (path[0] == '/' || strlen(path) >= 512) {
+            fprintf(stderr, "%s: bulk mode needs a relative path shorter than 512 bytes\n", path);
+            return -1;
+        }
+        return file_list_add(l, path);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: skipped (not a regular file)\n", path);
+        return 0;
+    }
+    DIR *d = opendir(path);
+    if (!d) {
+        perror(path);
+        return -1;
+    }
+    int rc = 0;
+    struct dirent *e;
+    while (rc == 0 && (e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+        rc = collect_files(l, child);
+    }
+    closedir(d);
+    return rc;
+}
+
+/* 追加一个文件记录；数据直接读进发送缓冲，缓冲满了才发，小文件的记录会被合并发送 */
+static int bulk_add_file(struct bulk_stream *b, const char *path, uint64_t *bytes) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    int rc = -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        goto out;
+    }
+    uint32_t name_len = (uint32_t)strlen(path);
+    uint32_t name_len_net = htonl(name_len);
+    uint64_t size_net = htonll((uint64_t)st.st_size);
+    if (bulk_append(b, &name_len_net, sizeof(name_len_net)) != 0 ||
+        bulk_append(b, path, name_len) != 0 ||
+        bulk_append(b, &size_net, sizeof(size_net)) != 0) goto out;
+
+    uint64_t left = (uint64_t)st.st_size;
+    while (left > 0) {
+        if (b->len == BULK_BUF && bulk_flush(b) != 0) goto out;
+        size_t want = BULK_BUF - b->len;
+        if (want > left) want = (size_t)left;
+        ssize_t n = read(fd, b->buf + b->len, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            /* 已声明的大小无法兑现，只能中止整个批次 */
+            fprintf(stderr, "%s: read failed or file shrank\n", path);
+            goto out;
+        }
+        b->len += (size_t)n;
+        left -= (uint64_t)n;
+    }
+    *bytes += (uint64_t)st.st_size;
+    rc = 0;
+
+out:
+    close(fd);
+    return rc;
+}
+
+/* 批量上传：展开文件列表后在一个 upload_bulk 请求里连续发出全部记录，
+   服务端边收边写临时文件，按批逐个 fsync 后改名发布，回复前再同步剩下的文件和涉及的目录。
+   批量模式不做断点续传，失败后重新运行即可。
+   服务端不支持时退回会话模式逐个上传 */
+int client_bulk(const char *server_ip, int server_port, char **args, int nargs) {
+    struct file_list list = { NULL, 0, 0 };
+    struct bulk_stream b = { -1, NULL, 0 };
+    int rc = -1;
+    for (int i = 0; i < nargs; i++) {
+        if (collect_files(&list, args[i]) != 0) goto out;
+    }
+    if (list.n == 0) {
+        fprintf(stderr, "no files to upload\n");
+        goto out;
+    }
+
+    uint32_t caps;
+    b.sock = connect_server(server_ip, server_port, &caps);
+    if (b.sock < 0) goto out;
+    if (!(caps & CAP_BULK)) {
+        fprintf(stderr, "server does not support bulk mode, uploading files one by one\n");
+        close(b.sock);
+        b.sock = -1;
+        rc = client_session(server_ip, server_port, 1, list.paths, list.n) == 0 ? 0 : -1;
+        goto out;
+    }
+
+    b.buf = malloc(BULK_BUF);
+    if (!b.buf) goto out;
+    double start = now_sec();
+    uint64_t bytes = 0;
+    if (send_request(b.sock, "upload_bulk", ".", NULL, 0) != 0) goto out;
+    for (int i = 0; i < list.n; i++) {
+        if (bulk_add_file(&b, list.paths[i], &bytes) != 0) goto out;
+    }
+    uint32_t end = 0;
+    if (bulk_append(&b, &end, sizeof(end)) != 0 || bulk_flush(&b) != 0) goto out;
+
+    uint64_t net_count;
+    if (recv_all(b.sock, &net_count, sizeof(net_count)) != sizeof(net_count)) {
+        fprintf(stderr, "recv bulk result failed\n");
+        goto out;
+    }
+    if (ntohll(net_count) != (uint64_t)list.n) {
+        fprintf(stderr, "server stored %" PRIu64 " of %d files\n", ntohll(net_count), list.n);
+        goto out;
+    }
+    printf("Bulk upload finished: %d file(s), %" PRIu64 " bytes\n", list.n, bytes);
+    print_rate(bytes, start);
+    rc = 0;
+
+out:
+    if (b.sock >= 0) close(b.sock);
+    free(b.buf);
+    file_list_free(&list);
+    return rc;
+}
+
+/* 是否存在分段格式的进度文件 */
+static int has_ranges_progress(const char *filename) {
+    uint64_t filesize;
+    struct range *ranges;
+    int n;
+    if (read_ranges_progress(filename, &filesize, &ranges, &n) != 0) return 0;
+    free(ranges);
+    return 1;
+}
+
+/* 传输单个文件：按需走分段传输，否则单连接；成功返回 0，失败返回 1 */
+static int transfer_one(const char *server_ip, int server_port, int upload, const char *filename) {
+    uint32_t caps;
+    int sock = connect_server(server_ip, server_port, &caps);
+    if (sock < 0) return 1;
+
+    int resume_ranges = has_ranges_progress(filename);
+    if (g_connections > 1 || resume_ranges) {
+        if (caps & CAP_RANGES) {
+            close(sock);
+            int rc = upload ? client_upload_ranges(server_ip, server_port, filename, g_connections)
+                            : client_download_ranges(server_ip, server_port, filename, g_connections);
+            return rc == 0 ? 0 : 1;
+        }
+        if (resume_ranges) {
+            fprintf(stderr, "server does not support range transfers, cannot resume %s.progress\n", filename);
+            close(sock);
+            return 1;
+        }
+        fprintf(stderr, "server does not support range transfers, using a single connection\n");
+    }
+
+    int rc = upload ? client_upload(sock, filename, caps) : client_download(sock, filename, caps);
+    return rc == 0 ? 0 : 1;
+}
+
+/* 解析字节数，支持 K/M/G 后缀；失败返回 -1 */
+static int parse_size(const char *s, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || end == s) return -1;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0') return -1;
+    *out = (uint64_t)v;
+    return 0;
+}
+
+/* 解析 -z lz4|zstd|auto[:level]；本程序编译时没有对应的库也算失败。
+   auto 按块在不压缩、LZ4 和 Zstd 之间自适应选择，level 为 Zstd 的上档级别 */
+static int parse_compress(const char *s) {
+    const char *colon = strchr(s, ':');
+    size_t n = colon ? (size_t)(colon - s) : strlen(s);
+    if (n == 3 && strncmp(s, "lz4", 3) == 0) {
+#ifdef HAVE_LZ4
+        g_codec_cap = CAP_LZ4;
+#endif
+    } else if (n == 4 && strncmp(s, "zstd", 4) == 0) {
+#ifdef HAVE_ZSTD
+        g_codec_cap = CAP_ZSTD;
+#endif
+    } else if (n == 4 && strncmp(s, "auto", 4) == 0) {
+#if defined(HAVE_LZ4) && defined(HAVE_ZSTD)
+        g_codec_cap = CAP_LZ4 | CAP_ZSTD;
+#endif
+    } else {
+        return -1;
+    }
+    if (!g_codec_cap) {
+        fprintf(stderr, "%.*s support not compiled in\n", (int)n, s);
+        return -1;
+    }
+    if (colon) {
+        char *end;
+        long level = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || level < -100 || level > 100) return -1;
+        g_level = (int)level;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b checkpoint_bytes] [-t checkpoint_secs] [-c connections] [-z lz4|zstd|auto[:level]] [-k] [-n] [-d|-D]\n"
+                    "          upload|download <server_ip> <server_port> <filename>...\n"
+                    "       %s bulk <server_ip> <server_port> <file|dir>...\n", prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+    crc32c_init();
+    sha256_init();
+    cdc_init();
+    int ch;
+    while ((ch = getopt(argc, argv, "b:t:c:z:kndDh")) != -1) {
+        switch (ch) {
+        case 'b':
+            if (parse_size(optarg, &g_checkpoint_bytes) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            g_checkpoint_secs = atof(optarg);
+            if (g_checkpoint_secs < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            g_connections = atoi(optarg);
+            if (g_connections < 1 || g_connections > MAX_CONNECTIONS) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'z':
+            if (parse_compress(optarg) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'k':
+            g_checksum = 1;
+            break;
+        case 'n':
+            g_verify = 0;
+            break;
+        case 'd':
+            g_delta = 1;
+            break;
+        case 'D':
+            g_dedup = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind < 4) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *mode = argv[optind];
+    const char *server_ip = argv[optind + 1];
+    int server_port = atoi(argv[optind + 2]);
+
+    if (strcmp(mode, "bulk") == 0) {
+        return client_bulk(server_ip, server_port, &argv[optind + 3], argc - optind - 3) == 0 ? 0 : 1;
+    }
+    if (!(strcmp(mode, "upload") == 0 || strcmp(mode, "download") == 0)) {
+        fprintf(stderr, "mode must be 'upload', 'download' or 'bulk'\n");
+        return 1;
+    }
+
+    int upload = strcmp(mode, "upload") == 0;
+    char **files = &argv[optind + 3];
+    int nfiles = argc - optind - 3;
+    if (nfiles == 1) return transfer_one(server_ip, server_port, upload, files[0]);
+
+    /* 多个文件：有分段进度的按分段单独续传，其余共用一条会话连接 */
+    int failures = 0, rest = 0;
+    for (int k = 0; k < nfiles; k++) {
+        if (has_ranges_progress(files[k])) failures += transfer_one(server_ip, server_port, upload, files[k]);
+        else files[rest++] = files[k];
     }
+    if (rest > 0) failures += client_session(server_ip, server_port, upload, files, rest);
+    return failures == 0 ? 0 : 1;
 }
@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -8,12 +10,109 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <linux/sockios.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define BUF_SIZE 8192
 #define PORT 9000
+#define QUEUE_PER_WORKER 4   /* 默认队列容量 = 工作线程数 * QUEUE_PER_WORKER */
+#define LOOP_BUF_SIZE (64 * 1024)    /* 每个事件循环共用的数据缓冲 */
+#define LOOP_IO_BUDGET (1024 * 1024) /* 单个连接每次唤醒最多搬运的字节数，保证公平 */
+#define LOOP_MAX_EVENTS 128
+#define LOOP_HELPERS 4                /* epoll 引擎执行阻塞文件操作的辅助线程数 */
+#define URING_GROUP_SIZE (512 * 1024)  /* io_uring 每批收/发的字节数，共两组交替使用 */
+#define SENDFILE_MAX 0x7ffff000        /* Linux 单次 sendfile 的上限 */
+#define SPLICE_PIPE_SIZE (1024 * 1024) /* 上传 splice 中转管道的期望容量 */
+#define RANGE_ACK_INTERVAL (8ULL * 1024 * 1024) /* 分段上传每写入这么多字节回一次确认 */
+
+/* 版本握手：客户端在请求前先发 PROTO_MAGIC, version, caps。
+   魔数远大于 mode_len 的上限，不会与旧客户端的请求混淆；不握手的连接 caps 为空。
+   协商出压缩能力时，客户端收到回复后再发一个 uint32_t 压缩级别 */
+#define PROTO_MAGIC 0x46547632u  /* "FTv2" */
+#define PROTO_VERSION 2
+#define CAP_RANGES   (1u << 0)   /* upload_range / download_range */
+#define CAP_PIPELINE (1u << 1)   /* 一条连接上连续多个请求 */
+#define CAP_LZ4      (1u << 2)   /* upload/download 数据阶段分帧，LZ4 压缩 */
+#define CAP_CHECKSUM (1u << 3)   /* upload/download 数据阶段分帧，每帧带 CRC32C */
+#define CAP_BULK     (1u << 4)   /* upload_bulk：一个请求打包多个小文件 */
+#define CAP_ZSTD     (1u << 5)   /* 同 CAP_LZ4，Zstandard 压缩 */
+#define CAP_VERIFY   (1u << 6)   /* hash_tree：续传前按哈希树比对已有前缀 */
+#define CAP_DELTA    (1u << 7)   /* upload_delta：按旧文件的块签名只收差异 */
+#define CAP_DEDUP    (1u << 8)   /* upload_dedup：按内容切块，只收存储里没有的块 */
+#define CAP_ACK      (1u << 9)   /* upload 结束时在落盘之后回 {大小, 整个文件的 CRC32C} */
+#define CAP_REPAIR   (1u << 10)  /* upload 数据之后、发布之前补发续传校验发现的坏区间 */
+#define CAP_RANGE_STAGE (1u << 11)  /* upload_range 写暂存文件，各段完成后由空的 upload_range 提交发布 */
+#define SERVER_CAPS (CAP_RANGES | CAP_PIPELINE | CAP_BULK | CAP_RANGE_STAGE)
+
+/* 数据阶段分帧：协商出压缩或校验能力后，upload/download 的数据按块发送，每块前是 16 字节帧头
+   {uint32_t codec, uint32_t raw_len, uint32_t wire_len, uint32_t crc}，压不小的块以 FRAME_RAW 原样发送；
+   crc 是该块原始数据的 CRC32C（没协商 CAP_CHECKSUM 时为 0），接收端解码后校验，不符的块不写入 */
+#define FRAME_BLOCK (128 * 1024)
+enum frame_codec { FRAME_RAW, FRAME_LZ4, FRAME_ZSTD, FRAME_CODECS };
+#define REPLY_ERROR UINT64_MAX   /* 会话模式下请求无法执行（如文件不存在）时回复的值，连接继续可用 */
+
+enum server_engine {
+    ENGINE_THREADS,  /* acceptor + 工作线程池，每个连接占一个线程 */
+    ENGINE_EPOLL,    /* 每核一个 epoll 循环，连接是非阻塞状态机 */
+    ENGINE_URING,    /* 同 threads，但数据阶段由每个工作线程的 io_uring 批量提交 */
+};
+
+/* 上传完成（发布、回最终确认）前的落盘方式 */
+enum durability {
+    DURABLE_NONE,   /* 不 fsync，交给内核回写 */
+    DURABLE_BATCH,  /* 交给落盘线程，与同时完成的其它上传合成一组提交 */
+    DURABLE_FILE,   /* 各连接自己 fsync */
+};
+
+/* 服务端配置（可由命令行覆盖） */
+struct server_config {
+    int port;
+    int workers;    /* 工作线程数 / 事件循环数，0 表示按 CPU 核数 */
+    int queue_len;  /* acceptor -> worker 交接队列容量，0 表示按线程数推算 */
+    enum server_engine engine;
+    const char *store;  /* -D：去重存储目录，NULL 表示不启用 */
+    const char *session_log;  /* -L：上传会话日志，NULL 表示续传状态放在各自的 .part.ofs */
+    uint64_t readahead;       /* -a：下载时在发送位置之前预读的窗口，0 表示不给提示 */
+    uint64_t drop_behind;     /* -A：不小于此大小的文件下载时丢掉已发送部分的页缓存，0 表示不丢 */
+    int direct;               /* -O：upload / download 的文件读写用 O_DIRECT */
+    enum durability durability;  /* -S：上传完成时的落盘方式 */
+    unsigned sync_window;        /* -S batch:usec：成组前多等的微秒数，0 表示不等 */
+    uint64_t hot_bytes;          /* -C：热点文件缓存的字节预算，0 表示不启用 */
+    int fd_cache;                /* -F：描述符缓存的条目上限，0 表示不启用 */
+};
+
+static struct server_config g_cfg = { PORT, 0, 0, ENGINE_THREADS, NULL, NULL, 8ULL << 20, 256ULL << 20, 0, DURABLE_BATCH, 0, 0, 0 };
+
+/* 一条连接握手后的协商结果 */
+struct peer {
+    uint32_t caps;
+    int level;  /* 客户端要求的压缩级别，0 表示按编码默认；自适应时为 Zstd 的上档级别 */
+};
 
 /* 大小端转换 */
 uint64_t htonll(uint64_t v) {
@@ -38,10 +137,11 @@ ssize_t send_all(int sock, const void *buf, size_t len) {
     const char *p = buf;
     while (total < len) {
         ssize_t n = send(sock, p + total, len - total, 0);
-        if (n <= 0) {
+        if (n < 0) {
             if (errno == EINTR) continue;
             return -1;
         }
+        if (n == 0) return -1;  // 对端关闭；不能再看 errno，工作线程里它可能残留 EINTR
         total += n;
     }
     return total;
@@ -53,223 +153,5137 @@ ssize_t recv_all(int sock, void *buf, size_t len) {
     char *p = buf;
     while (total < len) {
         ssize_t n = recv(sock, p + total, len - total, 0);
-        if (n <= 0) {
+        if (n < 0) {
             if (errno == EINTR) continue;
             return -1;
         }
+        if (n == 0) return -1;  // 对端关闭；不能再看 errno，工作线程里它可能残留 EINTR
         total += n;
     }
     return total;
 }
 
-/* 处理上传：从 offset 开始写，直到 filesize */
-int handle_upload(int sock, const char *filename, uint64_t filesize, uint64_t offset) {
-    FILE *fp = fopen(filename, "r+b");
-    if (!fp) {
-        fp = fopen(filename, "wb+");  // 不存在则创建
-    }
-    if (!fp) {
-        perror("fopen");
-        return -1;
+/* 定位写全部数据 */
+int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = pwrite(fd, p, len, (off_t)offset);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            perror("pwrite");
+            return -1;
+        }
+        p += w;
+        len -= (size_t)w;
+        offset += (uint64_t)w;
     }
+    return 0;
+}
 
-    int fd = fileno(fp);
+uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-    // 如果现有文件比 offset 大，先截断到 offset，避免旧数据残留
+/* 收数据前先分配 [offset, offset + len)：文件一次拿到连续的区段，不会在并发上传间交错着按写入增长，
+   空间不足时在传输开始前就失败。keep_size 时不改变文件大小（续传仍按大小判断）。
+   文件系统不支持 fallocate 时退回比较剩余空间与尚未分配的字节数 */
+int preallocate(int fd, uint64_t offset, uint64_t len, int keep_size) {
+    if (len == 0) return 0;
+    if (fallocate(fd, keep_size ? FALLOC_FL_KEEP_SIZE : 0, (off_t)offset, (off_t)len) == 0) return 0;
+    if (errno == ENOSPC || errno == EDQUOT) {
+        fprintf(stderr, "cannot reserve %" PRIu64 " bytes: %s\n", len, strerror(errno));
+        return -1;
+    }
     struct stat st;
-    if (fstat(fd, &st) == 0) {
-        if ((uint64_t)st.st_size > offset) {
-            if (ftruncate(fd, (off_t)offset) != 0) {
-                perror("ftruncate");
-                fclose(fp);
-                return -1;
+    struct statvfs vfs;
+    if (fstat(fd, &st) != 0 || fstatvfs(fd, &vfs) != 0) return 0;  // 查不到就不拦，写入时自然会报错
+    uint64_t have = (uint64_t)st.st_blocks * 512;
+    uint64_t need = offset + len > have ? offset + len - have : 0;
+    if (need > (uint64_t)vfs.f_bavail * vfs.f_frsize) {
+        fprintf(stderr, "cannot reserve %" PRIu64 " bytes: only %" PRIu64 " free\n",
+                need, (uint64_t)vfs.f_bavail * vfs.f_frsize);
+        errno = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+/* 把 in_fd 的 [in_off, in_off + len) 复制到 out_fd 的 out_off 处：先用 copy_file_range 在内核里复制
+   （支持的文件系统上直接共享数据块），不支持时退回 pread + pwrite */
+int copy_range(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t len, char *buf, size_t buf_size) {
+    int use_copy = 0;
+    while (len > 0) {
+        ssize_t n;
+        if (!use_copy) {
+            loff_t ioff = (loff_t)in_off, ooff = (loff_t)out_off;
+            n = copy_file_range(in_fd, &ioff, out_fd, &ooff, (size_t)len, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                use_copy = 1;
+                continue;
             }
+        } else {
+            n = pread(in_fd, buf, len > buf_size ? buf_size : (size_t)len, (off_t)in_off);
+            if (n > 0 && pwrite_all(out_fd, buf, (size_t)n, out_off) != 0) return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("copy_file_range");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "copy: source file shrank\n");
+            return -1;
+        }
+        in_off += (uint64_t)n;
+        out_off += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+/* ---------------- CRC32C 数据块校验 ---------------- */
+
+/* CRC32C（Castagnoli，反射多项式 0x82f63b78）。支持 SSE4.2 与 PCLMUL 的 CPU 上用 crc32 指令
+   三路交错计算，再用无进位乘法把三段结果拼接起来（约 20GB/s）；否则退回 slicing-by-8 查表（约 1.5GB/s）。
+   crc32c_init() 在 main 开头调用一次，按 CPU 选定实现 */
+#define CRC32C_POLY 0x82f63b78u
+#define CRC32C_LONG 8192   /* 三路交错的段长 */
+#define CRC32C_SHORT 256   /* 不足 3 * CRC32C_LONG 的部分改用短段 */
+
+static uint32_t g_crc32c_table[8][256];
+static uint32_t g_crc32c_long_k, g_crc32c_short_k;  /* x^(8 * 段长 - 33) mod P，拼接用 */
+static uint32_t (*g_crc32c)(uint32_t crc, const void *buf, size_t len);
+
+/* a * b mod P（反射表示） */
+uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^n mod P */
+uint32_t crc32c_xpow(uint64_t n) {
+    uint32_t r = 1u << 31, base = 1u << 30;
+    while (n) {
+        if (n & 1) r = crc32c_multmodp(r, base);
+        base = crc32c_multmodp(base, base);
+        n >>= 1;
+    }
+    return r;
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc = g_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = g_crc32c_table[7][w & 0xff] ^ g_crc32c_table[6][(w >> 8) & 0xff] ^
+              g_crc32c_table[5][(w >> 16) & 0xff] ^ g_crc32c_table[4][(w >> 24) & 0xff] ^
+              g_crc32c_table[3][(w >> 32) & 0xff] ^ g_crc32c_table[2][(w >> 40) & 0xff] ^
+              g_crc32c_table[1][(w >> 48) & 0xff] ^ g_crc32c_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = g_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+/* crc 后面再接 k 对应长度的数据时的 crc 贡献：clmul 得到 crc * k * x，crc32 指令再乘 x^32 并约简 */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc32c_shift(uint32_t crc, uint32_t k) {
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc), _mm_cvtsi32_si128((int)k), 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t c0 = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+        len--;
+    }
+    // 三段各自独立计算，隐藏 crc32 指令 3 个周期的延迟
+    for (size_t seg = CRC32C_LONG;; seg = CRC32C_SHORT) {
+        uint32_t k = seg == CRC32C_LONG ? g_crc32c_long_k : g_crc32c_short_k;
+        while (len >= 3 * seg) {
+            uint64_t c1 = 0, c2 = 0;
+            const unsigned char *end = p + seg;
+            do {
+                c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+                c1 = _mm_crc32_u64(c1, *(const uint64_t *)(p + seg));
+                c2 = _mm_crc32_u64(c2, *(const uint64_t *)(p + 2 * seg));
+                p += 8;
+            } while (p < end);
+            c0 = crc32c_shift((uint32_t)c0, k) ^ c1;
+            c0 = crc32c_shift((uint32_t)c0, k) ^ c2;
+            p += 2 * seg;
+            len -= 3 * seg;
         }
+        if (seg == CRC32C_SHORT) break;
+    }
+    while (len >= 8) {
+        c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    return ~(uint32_t)c0;
+}
+#endif
+
+void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        g_crc32c_table[0][n] = c;
     }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int t = 1; t < 8; t++)
+            g_crc32c_table[t][n] = g_crc32c_table[0][g_crc32c_table[t - 1][n] & 0xff] ^ (g_crc32c_table[t - 1][n] >> 8);
+    g_crc32c = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        g_crc32c_long_k = crc32c_xpow(8ull * CRC32C_LONG - 33);
+        g_crc32c_short_k = crc32c_xpow(8ull * CRC32C_SHORT - 33);
+        g_crc32c = crc32c_hw;
+    }
+#endif
+}
+
+/* ---------------- 直接 I/O ----------------
+ * -O 时 upload / download 的文件读写绕过页缓存（O_DIRECT），几百 GB 的备份既不挤占页缓存，
+ * 也不会攒出大量脏页在回写时拖慢其它连接。O_DIRECT 要求缓冲区、偏移和长度都按 DIRECT_ALIGN 对齐：
+ * 每个工作线程一块 DIRECT_IO_SIZE 的对齐缓冲，数据攒满整块再写、整块读；续传起点不对齐时先读回所在的块，
+ * 不满一块的尾部补零写出后再 ftruncate 回真实大小。文件系统不支持 O_DIRECT 时照常走页缓存 */
+#define DIRECT_ALIGN 4096
+#define DIRECT_IO_SIZE (4 * 1024 * 1024)
 
-    if (fseeko(fp, (off_t)offset, SEEK_SET) != 0) {
-        perror("fseeko");
-        fclose(fp);
+struct direct_io {
+    int fd;
+    char *buf;      /* DIRECT_IO_SIZE，按 DIRECT_ALIGN 对齐 */
+    uint64_t base;  /* buf[0] 对应的文件偏移，DIRECT_ALIGN 的倍数 */
+    size_t len;     /* 写：buf 中待写出的字节；读：buf 中有效的字节 */
+};
+
+static __thread char *t_direct_buf;
+
+/* 给 fd 打开 O_DIRECT；未启用、不支持或缓冲分配失败返回 -1，调用方照常读写 */
+int direct_open(struct direct_io *d, int fd) {
+    if (!g_cfg.direct) return -1;
+    if (!t_direct_buf && posix_memalign((void **)&t_direct_buf, DIRECT_ALIGN, DIRECT_IO_SIZE) != 0) {
+        t_direct_buf = NULL;
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) != 0) {
+        static int warned;
+        if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) perror("O_DIRECT not supported, using page cache");
         return -1;
     }
+    d->fd = fd;
+    d->buf = t_direct_buf;
+    d->base = 0;
+    d->len = 0;
+    return 0;
+}
 
-    char buf[BUF_SIZE];
-    uint64_t received = offset;
-    while (received < filesize) {
-        size_t to_read = (size_t)((filesize - received) > BUF_SIZE ? BUF_SIZE : (filesize - received));
-        ssize_t n = recv(sock, buf, to_read, 0);
+/* 写入从 pos 开始：pos 不对齐时先读回所在块中 pos 之前的部分 */
+int direct_write_start(struct direct_io *d, uint64_t pos) {
+    d->base = pos & ~(uint64_t)(DIRECT_ALIGN - 1);
+    d->len = (size_t)(pos - d->base);
+    if (d->len == 0) return 0;
+    ssize_t n;
+    do n = pread(d->fd, d->buf, DIRECT_ALIGN, (off_t)d->base); while (n < 0 && errno == EINTR);
+    if (n < (ssize_t)d->len) {
+        perror("direct read head");
+        return -1;
+    }
+    return 0;
+}
+
+/* 缓冲写满后整块写出 */
+int direct_write_full(struct direct_io *d) {
+    if (pwrite_all(d->fd, d->buf, DIRECT_IO_SIZE, d->base) != 0) return -1;
+    d->base += DIRECT_IO_SIZE;
+    d->len = 0;
+    return 0;
+}
+
+int direct_put(struct direct_io *d, const char *data, size_t n) {
+    while (n > 0) {
+        size_t k = DIRECT_IO_SIZE - d->len < n ? DIRECT_IO_SIZE - d->len : n;
+        memcpy(d->buf + d->len, data, k);
+        d->len += k;
+        data += k;
+        n -= k;
+        if (d->len == DIRECT_IO_SIZE && direct_write_full(d) != 0) return -1;
+    }
+    return 0;
+}
+
+/* 写出缓冲中剩下的部分：补零到对齐长度写出，再把文件截回 base + len。缓冲内容保留 */
+int direct_write_tail(struct direct_io *d) {
+    if (d->len == 0) return 0;
+    size_t padded = (d->len + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    memset(d->buf + d->len, 0, padded - d->len);
+    if (pwrite_all(d->fd, d->buf, padded, d->base) != 0) return -1;
+    if (padded != d->len && ftruncate(d->fd, (off_t)(d->base + d->len)) != 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    return 0;
+}
+
+/* 直接从 socket 收到对齐缓冲里，收满一块写一块 */
+int recv_direct(int sock, struct direct_io *d, uint64_t *pos, uint64_t end, uint32_t *crc) {
+    while (*pos < end) {
+        size_t room = DIRECT_IO_SIZE - d->len;
+        size_t want = end - *pos < room ? (size_t)(end - *pos) : room;
+        ssize_t n = recv(sock, d->buf + d->len, want, 0);
         if (n < 0) {
             if (errno == EINTR) continue;
             perror("recv");
-            fclose(fp);
             return -1;
         }
         if (n == 0) {
             fprintf(stderr, "client closed during upload\n");
-            fclose(fp);
             return -1;
         }
-        if (fwrite(buf, 1, (size_t)n, fp) != (size_t)n) {
-            perror("fwrite");
-            fclose(fp);
+        if (crc) *crc = g_crc32c(*crc, d->buf + d->len, (size_t)n);
+        d->len += (size_t)n;
+        *pos += (uint64_t)n;
+        if (d->len == DIRECT_IO_SIZE && direct_write_full(d) != 0) return -1;
+    }
+    return 0;
+}
+
+/* 读 pos 处至多 want 字节：不在缓冲中时整块读入所在的对齐区间，*data 指向缓冲内的数据。
+   返回可用字节数，0 表示文件在 pos 处已结束，-1 出错 */
+ssize_t direct_read(struct direct_io *d, uint64_t pos, size_t want, const char **data) {
+    if (pos < d->base || pos >= d->base + d->len) {
+        d->base = pos & ~(uint64_t)(DIRECT_ALIGN - 1);
+        ssize_t n;
+        do n = pread(d->fd, d->buf, DIRECT_IO_SIZE, (off_t)d->base); while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            perror("direct read");
             return -1;
         }
-        received += (uint64_t)n;
+        d->len = (size_t)n;
+        if (pos >= d->base + d->len) return 0;
     }
+    size_t avail = (size_t)(d->base + d->len - pos);
+    *data = d->buf + (pos - d->base);
+    return (ssize_t)(avail < want ? avail : want);
+}
 
-    fflush(fp);
-    fsync(fd);
-    fclose(fp);
+/* 从对齐缓冲发送 [*pos, end) */
+int send_direct(int sock, struct direct_io *d, uint64_t *pos, uint64_t end) {
+    while (*pos < end) {
+        const char *data;
+        ssize_t n = direct_read(d, *pos, (size_t)(end - *pos > DIRECT_IO_SIZE ? DIRECT_IO_SIZE : end - *pos), &data);
+        if (n <= 0) {
+            if (n == 0) fprintf(stderr, "file truncated during download\n");
+            return -1;
+        }
+        if (send_all(sock, data, (size_t)n) != n) {
+            perror("send");
+            return -1;
+        }
+        *pos += (uint64_t)n;
+    }
     return 0;
 }
 
-/* 处理下载：按照 client_offset 协商 server_offset 并从该处开始发送 */
-int handle_download(int sock, const char *filename, uint64_t client_offset) {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("fopen");
+/* ---------------- 落盘调度 ----------------
+ * 大量小文件同时上传时，各连接各自 fsync 会在文件系统日志上排队，每个 fsync 都等一次日志提交。
+ * DURABLE_BATCH 下连接把要落盘的文件交给落盘线程池：空闲的线程取走全部排队的请求成为一组，先对整组发起回写，
+ * 再放进待 fsync 队列由池里的线程并行逐个 fsync（同一次日志提交覆盖整组的元数据）。每个请求在自己的 fsync
+ * 完成时单独完成，组里的大文件不会拖住小文件；一组进行时新到的请求自然攒成下一组。
+ * -S batch:usec 时取组的线程先等 usec 微秒再取走，让稀疏到达的请求也能多凑几个进同一组，代价是每个请求多等这么久；
+ * 等待期间别的线程不取组，照常 fsync 上一组。
+ * 请求可以带一次改名：fsync 之后改名并让目标所在目录落盘，发布暂存文件只需一次往返。
+ * 同步请求由调用方在条件变量上等；异步请求（epoll 引擎）完成时在落盘线程上回调 complete，
+ * 事件循环线程从不等待落盘，因此不论哪种模式都启动线程池，DURABLE_FILE 与 DURABLE_NONE 下只给异步请求用 */
+#define SYNC_THREADS 4
+
+struct sync_req {
+    int fd;
+    const char *from, *to;  /* 非空时 fd 落盘后把 from 改名为 to，再让 to 所在目录落盘 */
+    int rc;
+    int done;
+    void (*complete)(struct sync_req *req);  /* 非空为异步请求：完成后在落盘线程上调用，之后不再访问 req */
+    void *arg;
+    struct sync_req *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    struct sync_req *head;   /* 新到的请求，等空闲线程整批取走 */
+    struct sync_req *ready;  /* 已发起回写、等 fsync 的请求 */
+    int gathering;           /* 有线程正在窗口内等请求攒组 */
+    uint64_t groups, syncs;
+} g_sync = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0 };
+
+/* path 所在的目录 */
+void path_dir(const char *path, char *dir, size_t size) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) snprintf(dir, size, ".");
+    else snprintf(dir, size, "%.*s", slash == path ? 1 : (int)(slash - path), path);
+}
+
+/* 直接 fsync path 所在的目录 */
+int fsync_dir(const char *path) {
+    char dir[1024];
+    path_dir(path, dir, sizeof(dir));
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        perror("open dir");
         return -1;
     }
+    int rc = fsync(fd);
+    if (rc != 0) perror("fsync dir");
+    close(fd);
+    return rc;
+}
 
-    struct stat st;
-    if (stat(filename, &st) != 0) {
-        perror("stat");
-        fclose(fp);
-        return -1;
+/* 执行一个请求：fsync，带改名时再改名并让目录落盘；DURABLE_NONE 只改名 */
+void sync_run(struct sync_req *r) {
+    r->rc = 0;
+    if (g_cfg.durability != DURABLE_NONE && fsync(r->fd) != 0) {
+        perror("fsync");
+        r->rc = -1;
+        return;
     }
+    if (!r->from) return;
+    if (rename(r->from, r->to) != 0) {
+        perror("rename");
+        r->rc = -1;
+        return;
+    }
+    if (g_cfg.durability != DURABLE_NONE && fsync_dir(r->to) != 0) r->rc = -1;
+}
 
-    uint64_t filesize = (uint64_t)st.st_size;
-    uint64_t server_offset = client_offset > filesize ? filesize : client_offset;
+void *sync_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_sync.lock);
+    while (1) {
+        if (g_sync.ready) {
+            struct sync_req *r = g_sync.ready;
+            g_sync.ready = r->next;
+            g_sync.syncs++;
+            pthread_mutex_unlock(&g_sync.lock);
+            sync_run(r);
+            if (r->complete) {
+                r->complete(r);
+                pthread_mutex_lock(&g_sync.lock);
+            } else {
+                pthread_mutex_lock(&g_sync.lock);
+                r->done = 1;
+                pthread_cond_broadcast(&g_sync.done);
+            }
+            continue;
+        }
+        if (g_sync.head && !g_sync.gathering) {
+            if (g_cfg.sync_window) {
+                // 条件变量用 CLOCK_REALTIME；期间的唤醒（新请求入队）不提前结束窗口
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += (long)(g_cfg.sync_window % 1000000) * 1000;
+                deadline.tv_sec += g_cfg.sync_window / 1000000 + deadline.tv_nsec / 1000000000;
+                deadline.tv_nsec %= 1000000000;
+                g_sync.gathering = 1;
+                while (pthread_cond_timedwait(&g_sync.work, &g_sync.lock, &deadline) != ETIMEDOUT) {}
+                g_sync.gathering = 0;
+            }
+            struct sync_req *group = g_sync.head, *last = NULL;
+            g_sync.head = NULL;
+            g_sync.groups++;
+            pthread_mutex_unlock(&g_sync.lock);
+            for (struct sync_req *r = group; r; r = r->next) {
+                if (g_cfg.durability != DURABLE_NONE) sync_file_range(r->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+                last = r;
+            }
+            pthread_mutex_lock(&g_sync.lock);
+            last->next = g_sync.ready;
+            g_sync.ready = group;
+            pthread_cond_broadcast(&g_sync.work);  // 叫醒其他线程一起 fsync 这一组
+            continue;
+        }
+        pthread_cond_wait(&g_sync.work, &g_sync.lock);
+    }
+    return NULL;
+}
 
-    uint64_t net_filesize = htonll(filesize);
-    uint64_t net_server_offset = htonll(server_offset);
+/* 启动落盘线程池；DURABLE_NONE 下只有异步请求的改名用它 */
+int sync_start(void) {
+    for (int i = 0; i < SYNC_THREADS; i++) {
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, sync_main, NULL);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            return i > 0 ? 0 : -1;  // 少几个线程只是并行度低些
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
 
-    if (send_all(sock, &net_filesize, sizeof(net_filesize)) != sizeof(net_filesize)) {
-        perror("send filesize");
-        fclose(fp);
-        return -1;
+/* 把 n 个请求一起排进落盘队列（落进同一组提交） */
+void sync_enqueue(struct sync_req *reqs, int n) {
+    pthread_mutex_lock(&g_sync.lock);
+    for (int i = 0; i < n; i++) {
+        reqs[i].next = g_sync.head;
+        g_sync.head = &reqs[i];
     }
-    if (send_all(sock, &net_server_offset, sizeof(net_server_offset)) != sizeof(net_server_offset)) {
-        perror("send server_offset");
-        fclose(fp);
-        return -1;
+    pthread_cond_signal(&g_sync.work);
+    pthread_mutex_unlock(&g_sync.lock);
+}
+
+/* 同步执行 n 个请求：DURABLE_BATCH 交给线程池并等全部完成，否则在本线程上做 */
+void sync_wait_all(struct sync_req *reqs, int n) {
+    if (g_cfg.durability != DURABLE_BATCH) {
+        if (g_cfg.durability == DURABLE_FILE) {
+            for (int i = 0; i < n; i++) sync_file_range(reqs[i].fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+        for (int i = 0; i < n; i++) sync_run(&reqs[i]);
+        return;
     }
+    for (int i = 0; i < n; i++) {
+        reqs[i].done = 0;
+        reqs[i].complete = NULL;
+    }
+    sync_enqueue(reqs, n);
+    pthread_mutex_lock(&g_sync.lock);
+    for (int i = 0; i < n; i++) {
+        while (!reqs[i].done) pthread_cond_wait(&g_sync.done, &g_sync.lock);
+    }
+    pthread_mutex_unlock(&g_sync.lock);
+}
 
-    if (server_offset >= filesize) {
-        fclose(fp);
-        return 0; // 对端已完整，无需发送
+/* 异步执行一个请求，完成后在落盘线程上调用 req->complete */
+void durable_submit(struct sync_req *req) {
+    sync_enqueue(req, 1);
+}
+
+/* 让 fd（文件或目录）落盘，按 g_cfg.durability 直接 fsync、交给落盘线程或跳过 */
+int durable_sync(int fd) {
+    struct sync_req req = { .fd = fd };
+    sync_wait_all(&req, 1);
+    return req.rc;
+}
+
+/* fd 落盘后把 from 改名为 to，再让 to 所在目录落盘：临时文件的发布，整个过程只排一次队 */
+int durable_rename(int fd, const char *from, const char *to) {
+    struct sync_req req = { .fd = fd, .from = from, .to = to };
+    sync_wait_all(&req, 1);
+    return req.rc;
+}
+
+/* 一次让多个 fd 落盘：先全部发起回写再逐个 fsync，DURABLE_BATCH 下同属一组提交。任一失败返回 -1 */
+int durable_sync_many(const int *fds, int n) {
+    if (g_cfg.durability == DURABLE_NONE || n == 0) return 0;
+    struct sync_req *reqs = calloc((size_t)n, sizeof(*reqs));
+    if (!reqs) return -1;
+    for (int i = 0; i < n; i++) reqs[i].fd = fds[i];
+    sync_wait_all(reqs, n);
+    int rc = 0;
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].rc != 0) rc = -1;
     }
+    free(reqs);
+    return rc;
+}
 
-    if (fseeko(fp, (off_t)server_offset, SEEK_SET) != 0) {
-        perror("fseeko");
-        fclose(fp);
+/* 改名后让 path 所在目录落盘，改名本身才不会在崩溃后丢失 */
+int durable_sync_dir(const char *path) {
+    if (g_cfg.durability == DURABLE_NONE) return 0;
+    char dir[1024];
+    path_dir(path, dir, sizeof(dir));
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        perror("open dir");
         return -1;
     }
+    int rc = durable_sync(fd);
+    close(fd);
+    return rc;
+}
 
-    char buf[BUF_SIZE];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-        if (send_all(sock, buf, n) != (ssize_t)n) {
-            perror("send");
-            fclose(fp);
-            return -1;
+void sync_stats_dump(void) {
+    static const char *const names[] = { "none", "batch", "file" };
+    pthread_mutex_lock(&g_sync.lock);
+    fprintf(stderr, "durability: %s", names[g_cfg.durability]);
+    if (g_cfg.durability == DURABLE_BATCH)
+        fprintf(stderr, ", %" PRIu64 " syncs in %" PRIu64 " groups, window %u us", g_sync.syncs, g_sync.groups,
+                g_cfg.sync_window);
+    fprintf(stderr, "\n");
+    pthread_mutex_unlock(&g_sync.lock);
+}
+
+/* ---------------- 上传暂存 ----------------
+ * upload 先写到 <filename>.part，旁边的 <filename>.part.ofs 记录 {filesize, committed}（网络字节序；
+ * 指定 -L 时改记在会话表里，见下文）：committed 之前的数据已 fdatasync，续传直接从这里开始，不必再校验。
+ * 收满 filesize 后 fsync 并改名发布，下载方不会读到写了一半的文件，崩溃也只会留下暂存文件 */
+#define STAGING_COMMIT_INTERVAL (64ULL * 1024 * 1024) /* 每收到这么多字节提交一次 */
+#define STAGING_PATH_MAX 600
+
+/* 一段已有数据的来源，用来判断续传校验建的树是否还描述着它 */
+enum origin { ORIGIN_NONE, ORIGIN_PART, ORIGIN_FILE };
+
+struct staging {
+    int fd;          /* .part；-1 表示目标已完整，无需接收 */
+    int ofs_fd;      /* .part.ofs，启用会话表时为 -1 */
+    uint64_t session;  /* 启用会话表时的会话 id */
+    uint64_t filesize;
+    uint64_t committed;
+    enum origin origin;  /* [0, committed) 来自续传的暂存文件还是复制前缀的目标文件 */
+    struct stat origin_st;
+};
+
+int staging_path(const char *filename, const char *suffix, char *path) {
+    int n = snprintf(path, STAGING_PATH_MAX, "%s%s", filename, suffix);
+    return n < 0 || n >= STAGING_PATH_MAX ? -1 : 0;
+}
+
+/* ---------------- 上传会话表 ----------------
+ * 指定 -L 时续传状态不再放在各个 .part.ofs 里，而是登记在进程内的会话表中：
+ * {id, filename, filesize, committed, 最近活动时间}，按文件名和 id 各挂一张散列表，
+ * 连接落到哪个工作线程都只需一次查找。表的每次变更以定长记录追加到日志，启动时重放并压缩成只含未完成的会话；
+ * 提交记录在锁内追加、锁外落盘，同时提交的记录共用一次 fdatasync。日志增长超过 SESSION_COMPACT_BYTES 后由
+ * 后台线程重写，请求路径只负责发起。超过 SESSION_TTL 没有活动的会话连同暂存文件一起清理。upload 的数据按顺序到达，已提交的区间总是 [0, committed) */
+#define SESSION_BUCKETS 1024
+#define SESSION_TTL (7 * 24 * 3600)               /* 秒 */
+#define SESSION_SWEEP_INTERVAL 3600               /* 秒，开新会话时顺带清理的最小间隔 */
+#define SESSION_COMPACT_BYTES (16 * 1024 * 1024)  /* 压缩后追加超过这么多字节就再压缩一次 */
+
+enum { SESSION_OPEN = 1, SESSION_COMMIT, SESSION_CLOSE };
+
+/* 日志记录，网络字节序；SESSION_OPEN 后跟 name_len 字节的文件名 */
+struct session_rec {
+    uint32_t type;
+    uint32_t name_len;
+    uint64_t id;
+    uint64_t value;  /* OPEN: filesize；COMMIT: committed */
+    uint64_t time;
+};
+
+struct session {
+    struct session *name_next, *id_next;
+    uint64_t id, filesize, committed;
+    uint64_t last;  /* 最近活动时间（time(NULL)） */
+    char name[];
+};
+
+/* 压缩期间追加的记录另存一份，换上新日志前补写进去 */
+struct session_buf {
+    char *data;
+    size_t len, cap;
+    int failed;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t synced_cond;  /* 一次 fdatasync 结束 */
+    int fd;                 /* 追加写的日志，-1 表示未启用 */
+    uint64_t next_id;
+    uint64_t log_bytes;     /* 上次压缩后追加的字节数 */
+    uint64_t seq, synced;   /* 已追加的记录数；其中已落盘的前缀 */
+    int syncing;            /* 有线程正在锁外 fdatasync */
+    int compacting;         /* 后台压缩进行中，pending 收集期间追加的记录 */
+    struct session_buf pending;
+    uint64_t live, expired;
+    time_t last_sweep;
+    struct session *by_name[SESSION_BUCKETS], *by_id[SESSION_BUCKETS];
+} g_sessions = { .lock = PTHREAD_MUTEX_INITIALIZER, .synced_cond = PTHREAD_COND_INITIALIZER, .fd = -1, .next_id = 1 };
+
+uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (; *name; name++) h = (h ^ (unsigned char)*name) * 16777619u;
+    return h;
+}
+
+uint32_t session_hash(const char *name) {
+    return name_hash(name) % SESSION_BUCKETS;
+}
+
+/* 以下 session_* 除 session_init、session_lookup、session_begin、session_commit、session_end 外都要求已持锁 */
+struct session *session_find(const char *name) {
+    struct session *s = g_sessions.by_name[session_hash(name)];
+    while (s && strcmp(s->name, name) != 0) s = s->name_next;
+    return s;
+}
+
+struct session *session_find_id(uint64_t id) {
+    struct session *s = g_sessions.by_id[id % SESSION_BUCKETS];
+    while (s && s->id != id) s = s->id_next;
+    return s;
+}
+
+struct session *session_insert(uint64_t id, uint64_t filesize, uint64_t last, const char *name) {
+    size_t len = strlen(name) + 1;
+    struct session *s = malloc(sizeof(*s) + len);
+    if (!s) return NULL;
+    s->id = id;
+    s->filesize = filesize;
+    s->committed = 0;
+    s->last = last;
+    memcpy(s->name, name, len);
+    struct session **b = &g_sessions.by_name[session_hash(name)];
+    s->name_next = *b;
+    *b = s;
+    b = &g_sessions.by_id[id % SESSION_BUCKETS];
+    s->id_next = *b;
+    *b = s;
+    if (id >= g_sessions.next_id) g_sessions.next_id = id + 1;
+    g_sessions.live++;
+    return s;
+}
+
+void session_remove(struct session *s) {
+    struct session **p = &g_sessions.by_name[session_hash(s->name)];
+    while (*p != s) p = &(*p)->name_next;
+    *p = s->name_next;
+    p = &g_sessions.by_id[s->id % SESSION_BUCKETS];
+    while (*p != s) p = &(*p)->id_next;
+    *p = s->id_next;
+    g_sessions.live--;
+    free(s);
+}
+
+/* 把一条记录编码进 buf（至少 sizeof(struct session_rec) + 512 字节），返回长度，文件名过长返回 0 */
+size_t session_encode(char *buf, uint32_t type, const struct session *s, uint64_t value) {
+    struct session_rec rec;
+    size_t name_len = type == SESSION_OPEN ? strlen(s->name) : 0;
+    if (name_len > 512) return 0;
+    rec.type = htonl(type);
+    rec.name_len = htonl((uint32_t)name_len);
+    rec.id = htonll(s->id);
+    rec.value = htonll(value);
+    rec.time = htonll(s->last);
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), s->name, name_len);
+    return sizeof(rec) + name_len;
+}
+
+void session_buf_add(struct session_buf *b, const char *data, size_t n) {
+    if (b->failed) return;
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 65536;
+        while (cap < b->len + n) cap *= 2;
+        char *p = realloc(b->data, cap);
+        if (!p) {
+            b->failed = 1;
+            return;
         }
+        b->data = p;
+        b->cap = cap;
     }
-    if (ferror(fp)) {
-        perror("fread");
-        fclose(fp);
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+/* 追加一条记录到当前日志，返回 0 成功 */
+int session_append(uint32_t type, const struct session *s, uint64_t value) {
+    char buf[sizeof(struct session_rec) + 512];
+    size_t n = session_encode(buf, type, s, value);
+    if (n == 0) return -1;
+    if (write(g_sessions.fd, buf, n) != (ssize_t)n) {
+        perror("write session log");
         return -1;
     }
+    g_sessions.log_bytes += n;
+    g_sessions.seq++;
+    if (g_sessions.compacting) session_buf_add(&g_sessions.pending, buf, n);
+    return 0;
+}
 
-    fclose(fp);
+/* 让日志至少落盘到第 seq 条记录（持锁调用）：已有线程在 fdatasync 时等它结束，覆盖不到再自己来；
+   锁外落盘，等待期间追加的记录由下一次 fdatasync 一并带上 */
+int session_sync(uint64_t seq) {
+    while (g_sessions.synced < seq) {
+        if (g_sessions.syncing) {
+            pthread_cond_wait(&g_sessions.synced_cond, &g_sessions.lock);
+            continue;
+        }
+        uint64_t target = g_sessions.seq;
+        int fd = g_sessions.fd;
+        g_sessions.syncing = 1;
+        pthread_mutex_unlock(&g_sessions.lock);
+        int rc = fdatasync(fd);
+        pthread_mutex_lock(&g_sessions.lock);
+        g_sessions.syncing = 0;
+        if (rc == 0 && target > g_sessions.synced) g_sessions.synced = target;
+        pthread_cond_broadcast(&g_sessions.synced_cond);
+        if (rc != 0) {
+            perror("fdatasync session log");
+            return -1;
+        }
+    }
     return 0;
 }
 
-/* 客户端处理：与 client.c 协议匹配，并保证早退时关闭套接字 */
-void handle_client(int client_sock) {
-    uint32_t mode_len_net, filename_len_net;
-    char mode[32], filename[512];
+/* 重写日志，只留仍未完成的会话：锁内只把会话表编码进内存，写临时文件在锁外；期间追加的记录记在 pending 里，
+   持锁补写后新日志接替追加，再在锁外 durable_rename 替换（文件与目录都落盘）。改名期间压缩线程占着 syncing，
+   提交者等它完成，换下的旧日志不会还在被 fdatasync；改名失败时把这期间的记录补回旧日志 */
+int session_compact(const char *path) {
+    char tmp[1024], rec[sizeof(struct session_rec) + 512];
+    struct session_buf snap = { 0 };
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    if (fd < 0) {
+        perror("open session log");
+        return -1;
+    }
 
-    // 统一用 goto cleanup，避免早退不 close
-    if (recv_all(client_sock, &mode_len_net, sizeof(mode_len_net)) != sizeof(mode_len_net)) goto cleanup;
-    uint32_t mode_len = ntohl(mode_len_net);
-    if (mode_len == 0 || mode_len >= sizeof(mode)) goto cleanup;
-    if (recv_all(client_sock, mode, mode_len) != (ssize_t)mode_len) goto cleanup;
-    mode[mode_len] = '\0';
+    pthread_mutex_lock(&g_sessions.lock);
+    g_sessions.compacting = 1;
+    for (int b = 0; b < SESSION_BUCKETS; b++) {
+        for (struct session *s = g_sessions.by_name[b]; s; s = s->name_next) {
+            session_buf_add(&snap, rec, session_encode(rec, SESSION_OPEN, s, s->filesize));
+            session_buf_add(&snap, rec, session_encode(rec, SESSION_COMMIT, s, s->committed));
+        }
+    }
+    g_sessions.pending.len = 0;  // 快照之前追加的记录已经包含在快照里
+    pthread_mutex_unlock(&g_sessions.lock);
 
-    if (recv_all(client_sock, &filename_len_net, sizeof(filename_len_net)) != sizeof(filename_len_net)) goto cleanup;
-    uint32_t filename_len = ntohl(filename_len_net);
-    if (filename_len == 0 || filename_len >= sizeof(filename)) goto cleanup;
-    if (recv_all(client_sock, filename, filename_len) != (ssize_t)filename_len) goto cleanup;
-    filename[filename_len] = '\0';
+    int rc = snap.failed || (snap.len > 0 && write(fd, snap.data, snap.len) != (ssize_t)snap.len) ? -1 : 0;
+    free(snap.data);
 
-    if (strcmp(mode, "upload") == 0) {
-        // 3) C->S: filesize
-        uint64_t filesize_net;
-        if (recv_all(client_sock, &filesize_net, sizeof(filesize_net)) != sizeof(filesize_net)) goto cleanup;
-        uint64_t filesize = ntohll(filesize_net);
+    pthread_mutex_lock(&g_sessions.lock);
+    struct session_buf *p = &g_sessions.pending;
+    if (rc == 0 && (p->failed || (p->len > 0 && write(fd, p->data, p->len) != (ssize_t)p->len))) rc = -1;
+    if (rc != 0) goto done;
+    while (g_sessions.syncing) pthread_cond_wait(&g_sessions.synced_cond, &g_sessions.lock);
+    int old = g_sessions.fd;
+    uint64_t target = g_sessions.seq;
+    size_t switched = p->len;
+    g_sessions.syncing = 1;
+    g_sessions.fd = fd;
+    g_sessions.log_bytes = p->len;
+    pthread_mutex_unlock(&g_sessions.lock);
 
-        // 4) S->C: agreed_offset（本地已有大小，裁剪到 filesize）
-        uint64_t existing = 0;
-        struct stat st;
-        if (stat(filename, &st) == 0) {
-            existing = (uint64_t)st.st_size;
-        } else if (errno != ENOENT) {
-            perror("stat");
-            goto cleanup;
+    rc = durable_rename(fd, tmp, path);
+
+    pthread_mutex_lock(&g_sessions.lock);
+    if (rc == 0) {
+        if (old >= 0) close(old);
+        if (target > g_sessions.synced) g_sessions.synced = target;  // 新日志到 target 为止已整个落盘
+    } else {
+        if (p->len > switched && write(old, p->data + switched, p->len - switched) != (ssize_t)(p->len - switched)) {
+            perror("write session log");
         }
-        uint64_t agreed = existing > filesize ? filesize : existing;
-        uint64_t net_agreed = htonll(agreed);
-        if (send_all(client_sock, &net_agreed, sizeof(net_agreed)) != sizeof(net_agreed)) goto cleanup;
+        g_sessions.fd = old;
+        g_sessions.log_bytes = SESSION_COMPACT_BYTES;  // 仍然该压缩，下次再试
+    }
+    g_sessions.syncing = 0;
+    pthread_cond_broadcast(&g_sessions.synced_cond);
 
-        // 5) 接收 [agreed, filesize) 的数据
-        (void)handle_upload(client_sock, filename, filesize, agreed);
+done:
+    g_sessions.compacting = 0;
+    free(p->data);
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_unlock(&g_sessions.lock);
+    if (rc != 0) {
+        perror("compact session log");
+        if (g_sessions.fd != fd) close(fd);
+        unlink(tmp);
     }
-    else if (strcmp(mode, "download") == 0) {
-        // 3) C->S: client_offset
-        uint64_t offset_net;
-        if (recv_all(client_sock, &offset_net, sizeof(offset_net)) != sizeof(offset_net)) goto cleanup;
-        uint64_t client_offset = ntohll(offset_net);
+    return rc;
+}
 
-        // 4) S->C: filesize + server_offset, 然后发数据
-        (void)handle_download(client_sock, filename, client_offset);
+void *session_compact_main(void *arg) {
+    session_compact(arg);
+    return NULL;
+}
+
+/* 日志长到该压缩时开一个后台线程去做（持锁调用），请求路径不等它 */
+void session_maybe_compact(void) {
+    if (g_sessions.compacting || g_sessions.log_bytes <= SESSION_COMPACT_BYTES) return;
+    pthread_t tid;
+    g_sessions.compacting = 1;  // 线程真正开始前也不要重复发起
+    if (pthread_create(&tid, NULL, session_compact_main, (void *)g_cfg.session_log) != 0) {
+        g_sessions.compacting = 0;
+        return;
     }
+    pthread_detach(tid);
+}
 
-cleanup:
-    close(client_sock);
+/* 清理过期会话：删掉暂存文件并记一条 CLOSE */
+void session_sweep(time_t now) {
+    g_sessions.last_sweep = now;
+    for (int b = 0; b < SESSION_BUCKETS; b++) {
+        struct session *s = g_sessions.by_name[b];
+        while (s) {
+            struct session *next = s->name_next;
+            if ((uint64_t)now > s->last + SESSION_TTL) {
+                char part[STAGING_PATH_MAX];
+                if (staging_path(s->name, ".part", part) == 0) unlink(part);
+                if (g_sessions.fd >= 0) session_append(SESSION_CLOSE, s, 0);  // 启动时随后的压缩会丢掉它
+                fprintf(stderr, "session %" PRIu64 " (%s) expired at %" PRIu64 "/%" PRIu64 " bytes\n",
+                        s->id, s->name, s->committed, s->filesize);
+                g_sessions.expired++;
+                session_remove(s);
+            }
+            s = next;
+        }
+    }
 }
 
-int main() {
-    signal(SIGPIPE, SIG_IGN);  // 忽略 SIGPIPE，send 出错时只返回 -1，不会杀进程
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("socket");
-        exit(1);
+/* 启动时重放日志：末尾不完整的记录（写到一半时崩溃）丢弃，随后清理过期会话并压缩 */
+int session_init(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp && errno != ENOENT) {
+        perror("open session log");
+        return -1;
+    }
+    struct session_rec rec;
+    char name[512];
+    while (fp && fread(&rec, sizeof(rec), 1, fp) == 1) {
+        uint32_t type = ntohl(rec.type), name_len = ntohl(rec.name_len);
+        uint64_t id = ntohll(rec.id), value = ntohll(rec.value);
+        struct session *s = session_find_id(id);
+        if (type == SESSION_OPEN) {
+            if (name_len == 0 || name_len >= sizeof(name) || fread(name, name_len, 1, fp) != 1) break;
+            name[name_len] = '\0';
+            struct session *old = session_find(name);
+            if (old) session_remove(old);
+            if (!session_insert(id, value, ntohll(rec.time), name)) break;
+        } else if (type == SESSION_COMMIT && s) {
+            s->committed = value;
+            s->last = ntohll(rec.time);
+        } else if (type == SESSION_CLOSE && s) {
+            session_remove(s);
+        } else if (type != SESSION_COMMIT && type != SESSION_CLOSE) {
+            fprintf(stderr, "session log: bad record type %u, ignoring the rest\n", type);
+            break;
+        }
     }
+    if (fp) fclose(fp);
+    session_sweep(time(NULL));
+    if (session_compact(path) != 0) return -1;
+    printf("session log %s: %" PRIu64 " resumable upload(s)\n", path, g_sessions.live);
+    return 0;
+}
 
-    int opt = 1;
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+/* 查找 name 上 filesize 字节的未完成会话；大小不符视为没有 */
+int session_lookup(const char *name, uint64_t filesize, uint64_t *committed, uint64_t *id) {
+    int rc = -1;
+    pthread_mutex_lock(&g_sessions.lock);
+    struct session *s = session_find(name);
+    if (s && s->filesize == filesize) {
+        *committed = s->committed;
+        if (id) *id = s->id;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&g_sessions.lock);
+    return rc;
+}
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = INADDR_ANY;
+/* 为 name 开一个新会话，替换同名的旧会话 */
+int session_begin(const char *name, uint64_t filesize, uint64_t *id) {
+    int rc = -1;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&g_sessions.lock);
+    if (now - g_sessions.last_sweep >= SESSION_SWEEP_INTERVAL) {
+        session_sweep(now);
+        session_maybe_compact();
+    }
+    struct session *s = session_find(name);
+    if (s) {
+        session_append(SESSION_CLOSE, s, 0);
+        session_remove(s);
+    }
+    s = session_insert(g_sessions.next_id, filesize, (uint64_t)now, name);
+    if (s && session_append(SESSION_OPEN, s, filesize) == 0) {
+        *id = s->id;
+        rc = 0;
+    } else if (s) {
+        session_remove(s);
+    }
+    pthread_mutex_unlock(&g_sessions.lock);
+    return rc;
+}
 
-    if (bind(server_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        exit(1);
+/* 记录已提交位置；调用前数据已落盘，记录本身落盘后才算数（见 session_sync） */
+int session_commit(uint64_t id, uint64_t committed) {
+    int rc = -1;
+    pthread_mutex_lock(&g_sessions.lock);
+    struct session *s = session_find_id(id);
+    if (s) {
+        s->committed = committed;
+        s->last = (uint64_t)time(NULL);
+        if (session_append(SESSION_COMMIT, s, committed) == 0) rc = session_sync(g_sessions.seq);
+        session_maybe_compact();
+    } else {
+        fprintf(stderr, "session %" PRIu64 " no longer exists\n", id);
     }
+    pthread_mutex_unlock(&g_sessions.lock);
+    return rc;
+}
 
-    if (listen(server_sock, 5) < 0) {
-        perror("listen");
-        exit(1);
+/* 上传已发布：结束会话。CLOSE 丢失无妨，下次查到时暂存文件已不存在 */
+void session_end(uint64_t id) {
+    pthread_mutex_lock(&g_sessions.lock);
+    struct session *s = session_find_id(id);
+    if (s) {
+        session_append(SESSION_CLOSE, s, 0);
+        session_remove(s);
     }
+    session_maybe_compact();
+    pthread_mutex_unlock(&g_sessions.lock);
+}
 
-    printf("Server listening on port %d...\n", PORT);
+void session_stats_dump(void) {
+    if (!g_cfg.session_log) return;
+    pthread_mutex_lock(&g_sessions.lock);
+    fprintf(stderr, "sessions: %" PRIu64 " resumable, %" PRIu64 " expired\n", g_sessions.live, g_sessions.expired);
+    pthread_mutex_unlock(&g_sessions.lock);
+}
 
-    while (1) {
-        struct sockaddr_in client_addr;
+/* ---------------- 热点文件缓存 ----------------
+ * -C 给出字节预算时，被反复下载的文件整份读进锁定的内存，之后的 download / download_range 直接从内存发出，
+ * 不再打开文件。按路径查找，条目记下装入时的 {大小, mtime, 设备, inode}：本进程的上传发布、改名、分段写入
+ * 会主动作废条目，外部修改由命中时的 stat 核对发现（同一条目每 HOT_REVALIDATE_NS 最多核对一次）。
+ * 文件第 HOT_ADMIT 次被请求时才由后台线程装入（这次请求照常从文件发送），只下载一次的文件不占预算；
+ * 超出预算按 LRU 淘汰 */
+#define HOT_BUCKETS 1024
+#define HOT_ADMIT 2                       /* 第几次请求时装入 */
+#define HOT_MAX_SHARE 4                   /* 单个文件最多占预算的 1/HOT_MAX_SHARE */
+#define HOT_MAX_ENTRIES 4096              /* 条目数上限（含只记了请求次数、还没装入的） */
+#define HOT_MAX_LOADERS 2                 /* 同时在后台装入的文件数 */
+#define HOT_REVALIDATE_NS 1000000000ull
+
+struct hot_entry {
+    struct hot_entry *next;                /* 哈希链 */
+    struct hot_entry *lru_prev, *lru_next; /* 链表头是最近使用的 */
+    uint64_t size, dev, ino;
+    struct timespec mtime;
+    char *data;          /* 锁定内存中的文件内容，NULL 表示还没装入 */
+    uint64_t requests;
+    uint64_t checked;    /* 上次核对元数据的 mono_ns */
+    int refs;            /* 正在用它发送的连接数 */
+    int loading, dead;   /* dead：已移出表，引用归零时释放 */
+    char name[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct hot_entry *buckets[HOT_BUCKETS];
+    struct hot_entry *lru_head, *lru_tail;
+    uint64_t bytes, entries;
+    uint64_t hits, misses, loads, evictions, bytes_served;
+    int loaders;         /* 正在运行的装入线程数 */
+} g_hot = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* 以下 hot_* 除 hot_get、hot_admit、hot_load_main、hot_put、hot_invalidate、hot_stats_dump 外都要求已持锁 */
+struct hot_entry *hot_find(const char *name) {
+    struct hot_entry *e = g_hot.buckets[name_hash(name) % HOT_BUCKETS];
+    while (e && strcmp(e->name, name) != 0) e = e->next;
+    return e;
+}
+
+void hot_lru_remove(struct hot_entry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else g_hot.lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else g_hot.lru_tail = e->lru_prev;
+}
+
+void hot_lru_push(struct hot_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = g_hot.lru_head;
+    if (g_hot.lru_head) g_hot.lru_head->lru_prev = e;
+    else g_hot.lru_tail = e;
+    g_hot.lru_head = e;
+}
+
+void hot_free(struct hot_entry *e) {
+    if (e->data) munmap(e->data, e->size);
+    free(e);
+}
+
+void hot_unlink(struct hot_entry *e) {
+    struct hot_entry **p = &g_hot.buckets[name_hash(e->name) % HOT_BUCKETS];
+    while (*p != e) p = &(*p)->next;
+    *p = e->next;
+    hot_lru_remove(e);
+    if (e->data) g_hot.bytes -= e->size;
+    g_hot.entries--;
+    e->dead = 1;
+    if (e->refs == 0) hot_free(e);
+}
+
+int hot_same(const struct hot_entry *e, const struct stat *st) {
+    return e->size == (uint64_t)st->st_size && e->dev == (uint64_t)st->st_dev && e->ino == (uint64_t)st->st_ino &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* 从 LRU 尾部淘汰到字节数和条目数都不超限；keep 与正在装入的条目不动 */
+void hot_evict(const struct hot_entry *keep) {
+    struct hot_entry *e = g_hot.lru_tail;
+    while (e && (g_hot.bytes > g_cfg.hot_bytes || g_hot.entries > HOT_MAX_ENTRIES)) {
+        struct hot_entry *prev = e->lru_prev;
+        if (e != keep && !e->loading && (e->data || g_hot.entries > HOT_MAX_ENTRIES)) {
+            if (e->data) g_hot.evictions++;
+            hot_unlink(e);
+        }
+        e = prev;
+    }
+}
+
+void hot_put(struct hot_entry *e) {
+    pthread_mutex_lock(&g_hot.lock);
+    if (--e->refs == 0 && e->dead) hot_free(e);
+    pthread_mutex_unlock(&g_hot.lock);
+}
+
+/* 查找已装入的条目，命中时持有一个引用（用完 hot_put）；距上次核对超过 HOT_REVALIDATE_NS 时先 stat 一次 */
+struct hot_entry *hot_get(const char *name) {
+    if (!g_cfg.hot_bytes) return NULL;
+    pthread_mutex_lock(&g_hot.lock);
+    struct hot_entry *e = hot_find(name);
+    if (!e || !e->data) {
+        pthread_mutex_unlock(&g_hot.lock);
+        return NULL;
+    }
+    e->refs++;
+    uint64_t now = mono_ns();
+    int stale = now - e->checked > HOT_REVALIDATE_NS;
+    pthread_mutex_unlock(&g_hot.lock);
+
+    struct stat st;
+    int same = !stale || (stat(name, &st) == 0 && hot_same(e, &st));
+    pthread_mutex_lock(&g_hot.lock);
+    if (!same || e->dead) {
+        if (!e->dead) hot_unlink(e);
+        if (--e->refs == 0) hot_free(e);
+        e = NULL;
+    } else {
+        if (stale) e->checked = now;
+        e->requests++;
+        g_hot.hits++;
+        hot_lru_remove(e);
+        hot_lru_push(e);
+    }
+    pthread_mutex_unlock(&g_hot.lock);
+    return e;
+}
+
+/* 后台装入线程：按路径重新打开（请求方的描述符可能被 -O 切成 O_DIRECT，或随请求结束关闭），
+   inode 与元数据仍与条目一致才读入；持有 hot_admit 给的引用 */
+void *hot_load_main(void *arg) {
+    struct hot_entry *e = arg;
+    uint64_t size = e->size, got = 0;
+    char *data = NULL;
+    struct stat st;
+    int fd = open(e->name, O_RDONLY | O_CLOEXEC);
+    // mlock 受 RLIMIT_MEMLOCK 限制，失败时内容照样可用，只是可能被换出
+    if (fd >= 0 && fstat(fd, &st) == 0 && hot_same(e, &st)) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        } else {
+            while (got < size) {
+                ssize_t n = pread(fd, data + got, size - got, (off_t)got);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                got += (uint64_t)n;
+            }
+            mlock(data, size);
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    pthread_mutex_lock(&g_hot.lock);
+    e->loading = 0;
+    g_hot.loaders--;
+    if (!data || got < size || e->dead) {
+        if (data) munmap(data, size);
+        if (!e->dead) hot_unlink(e);
+    } else {
+        e->data = data;
+        e->checked = mono_ns();
+        g_hot.bytes += size;
+        g_hot.loads++;
+        hot_evict(e);
+    }
+    if (--e->refs == 0 && e->dead) hot_free(e);
+    pthread_mutex_unlock(&g_hot.lock);
+    return NULL;
+}
+
+/* 未命中时记一次请求（st 是本次已打开文件的 fstat 结果）；达到 HOT_ADMIT 次时交给后台线程装入，
+   本次请求总是由调用方照常从文件发送，装好之后的请求才从内存发出 */
+void hot_admit(const char *name, const struct stat *st) {
+    if (!g_cfg.hot_bytes) return;
+    uint64_t size = (uint64_t)st->st_size;
+    pthread_mutex_lock(&g_hot.lock);
+    g_hot.misses++;
+    if (!S_ISREG(st->st_mode) || size == 0 || size > g_cfg.hot_bytes / HOT_MAX_SHARE) {
+        pthread_mutex_unlock(&g_hot.lock);
+        return;
+    }
+    struct hot_entry *e = hot_find(name);
+    if (e && !hot_same(e, st)) {
+        hot_unlink(e);
+        e = NULL;
+    }
+    if (!e) {
+        size_t len = strlen(name) + 1;
+        if (!(e = calloc(1, sizeof(*e) + len))) {
+            pthread_mutex_unlock(&g_hot.lock);
+            return;
+        }
+        memcpy(e->name, name, len);
+        e->size = size;
+        e->dev = (uint64_t)st->st_dev;
+        e->ino = (uint64_t)st->st_ino;
+        e->mtime = st->st_mtim;
+        struct hot_entry **b = &g_hot.buckets[name_hash(name) % HOT_BUCKETS];
+        e->next = *b;
+        *b = e;
+        hot_lru_push(e);
+        g_hot.entries++;
+        hot_evict(e);
+    } else {
+        hot_lru_remove(e);
+        hot_lru_push(e);
+    }
+    // 装入线程已满时不计这次请求，留给下一次请求再试
+    if (e->data || e->loading || g_hot.loaders >= HOT_MAX_LOADERS || ++e->requests < HOT_ADMIT) {
+        pthread_mutex_unlock(&g_hot.lock);
+        return;
+    }
+    pthread_t tid;
+    e->loading = 1;
+    e->refs++;
+    g_hot.loaders++;
+    if (pthread_create(&tid, NULL, hot_load_main, e) != 0) {
+        e->loading = 0;
+        e->refs--;
+        e->requests--;
+        g_hot.loaders--;
+    } else {
+        pthread_detach(tid);
+    }
+    pthread_mutex_unlock(&g_hot.lock);
+}
+
+/* 本进程改写了 name（发布、改名、分段写入）：丢掉它的条目，正在发送的连接发完旧内容后释放 */
+void hot_invalidate(const char *name) {
+    if (!g_cfg.hot_bytes) return;
+    pthread_mutex_lock(&g_hot.lock);
+    struct hot_entry *e = hot_find(name);
+    if (e) hot_unlink(e);
+    pthread_mutex_unlock(&g_hot.lock);
+}
+
+void hot_stats_dump(void) {
+    if (!g_cfg.hot_bytes) return;
+    pthread_mutex_lock(&g_hot.lock);
+    fprintf(stderr, "hot cache: %" PRIu64 "/%" PRIu64 " bytes in %" PRIu64 " entries, %" PRIu64 " hits, %" PRIu64
+                    " misses, %" PRIu64 " loads, %" PRIu64 " evictions, %" PRIu64 " bytes served\n",
+            g_hot.bytes, g_cfg.hot_bytes, g_hot.entries, g_hot.hits, g_hot.misses, g_hot.loads, g_hot.evictions,
+            __atomic_load_n(&g_hot.bytes_served, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&g_hot.lock);
+}
+
+/* ---------------- 描述符缓存 ----------------
+ * -F n 时 download / download_range / hash_tree 打开的文件连同 fstat 结果留在缓存里（最多 n 个，LRU），
+ * 同一文件的后续请求不再做路径查找和 open/close。缓存文件所在的目录挂 inotify 监视：目录里的文件被改名覆盖、删除、
+ * 改属性或写完关闭时作废同名条目（连同热点缓存里的），正在用它的连接发完后才关闭描述符；
+ * 本进程自己的写入由 cache_invalidate 同步作废。不监视 IN_MODIFY（每次 write 都会产生事件），
+ * 原地写入中途的大小变化靠命中时重新 fstat 发现。
+ * 缓存的描述符被多条连接共用同一个打开文件表项，内核的预读状态（f_ra）也随之共用，
+ * 所以这些描述符上不设 POSIX_FADV_SEQUENTIAL，只按各自位置发 WILLNEED。
+ * 监视加不上（如超出 max_user_watches）的文件照常打开但不进缓存 */
+#define FD_BUCKETS 1024
+#define FD_WATCH_MASK (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct fd_entry {
+    struct fd_entry *next;                /* 哈希链 */
+    struct fd_entry *base_next;           /* 按 (wd, base) 的哈希链，inotify 事件据此只找受影响的条目 */
+    struct fd_entry *lru_prev, *lru_next; /* 链表头是最近使用的 */
+    int fd, wd;
+    struct stat st;
+    const char *base;    /* name 最后一个 '/' 之后的部分，与 inotify 事件里的文件名比对 */
+    int refs, dead;      /* dead：已移出表，引用归零时关闭 */
+    char name[];
+};
+
+/* 一个被监视的目录：count 个条目在用，gen 为收到的事件数 */
+struct fd_watch {
+    int wd, count;
+    uint64_t gen;
+};
+
+/* file_open 的结果，cached 为 NULL 时 fd 归调用方所有 */
+struct open_file {
+    int fd;
+    struct stat st;
+    struct fd_entry *cached;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int inotify_fd;      /* -1 表示不缓存 */
+    struct fd_entry *buckets[FD_BUCKETS];
+    struct fd_entry *by_base[FD_BUCKETS];
+    struct fd_entry *lru_head, *lru_tail;
+    struct fd_watch *watches;
+    int nwatches, watch_cap;
+    uint64_t entries, hits, misses, invalidated;
+} g_fds = { .lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1 };
+
+/* 以下 fd_* 除 fd_cache_init、fd_watch_main、fd_invalidate、fd_stats_dump 外都要求已持锁 */
+struct fd_watch *fd_watch_find(int wd) {
+    for (int i = 0; i < g_fds.nwatches; i++)
+        if (g_fds.watches[i].wd == wd) return &g_fds.watches[i];
+    return NULL;
+}
+
+/* 监视 name 所在的目录并占用一次，失败返回 NULL */
+struct fd_watch *fd_watch_get(const char *name) {
+    char dir[1024];
+    path_dir(name, dir, sizeof(dir));
+    int wd = inotify_add_watch(g_fds.inotify_fd, dir, FD_WATCH_MASK);
+    if (wd < 0) return NULL;
+    struct fd_watch *w = fd_watch_find(wd);
+    if (!w) {
+        if (g_fds.nwatches == g_fds.watch_cap) {
+            int cap = g_fds.watch_cap ? 2 * g_fds.watch_cap : 16;
+            struct fd_watch *p = realloc(g_fds.watches, (size_t)cap * sizeof(*p));
+            if (!p) {
+                inotify_rm_watch(g_fds.inotify_fd, wd);
+                return NULL;
+            }
+            g_fds.watches = p;
+            g_fds.watch_cap = cap;
+        }
+        w = &g_fds.watches[g_fds.nwatches++];
+        w->wd = wd;
+        w->count = 0;
+        w->gen = 0;
+    }
+    w->count++;
+    return w;
+}
+
+/* 放掉一次占用，目录里没有缓存的文件时撤掉监视（removed 表示内核已经撤了，IN_IGNORED） */
+void fd_watch_put(int wd, int removed) {
+    struct fd_watch *w = fd_watch_find(wd);
+    if (!w || (--w->count > 0 && !removed)) return;
+    if (!removed) inotify_rm_watch(g_fds.inotify_fd, wd);
+    *w = g_fds.watches[--g_fds.nwatches];
+}
+
+uint32_t fd_base_hash(int wd, const char *base) {
+    return (name_hash(base) ^ (uint32_t)wd * 2654435761u) % FD_BUCKETS;
+}
+
+struct fd_entry *fd_find(const char *name) {
+    struct fd_entry *e = g_fds.buckets[name_hash(name) % FD_BUCKETS];
+    while (e && strcmp(e->name, name) != 0) e = e->next;
+    return e;
+}
+
+void fd_lru_remove(struct fd_entry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else g_fds.lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else g_fds.lru_tail = e->lru_prev;
+}
+
+void fd_lru_push(struct fd_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = g_fds.lru_head;
+    if (g_fds.lru_head) g_fds.lru_head->lru_prev = e;
+    else g_fds.lru_tail = e;
+    g_fds.lru_head = e;
+}
+
+void fd_free(struct fd_entry *e) {
+    close(e->fd);
+    free(e);
+}
+
+/* 移出表；removed 见 fd_watch_put */
+void fd_unlink(struct fd_entry *e, int removed) {
+    struct fd_entry **p = &g_fds.buckets[name_hash(e->name) % FD_BUCKETS];
+    while (*p != e) p = &(*p)->next;
+    *p = e->next;
+    p = &g_fds.by_base[fd_base_hash(e->wd, e->base)];
+    while (*p != e) p = &(*p)->base_next;
+    *p = e->base_next;
+    fd_lru_remove(e);
+    g_fds.entries--;
+    fd_watch_put(e->wd, removed);
+    e->dead = 1;
+    if (e->refs == 0) fd_free(e);
+}
+
+/* 处理一个 inotify 事件：作废目录 wd 下同名的条目（按 (wd, base) 直接查）；事件不带文件名（目录本身被删或改名、
+   监视被撤）时作废整个目录，这类事件很少，才遍历全部条目 */
+void fd_event(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        while (g_fds.lru_head) {
+            g_fds.invalidated++;
+            fd_unlink(g_fds.lru_head, 0);
+        }
+        for (int i = 0; i < g_fds.nwatches; i++) g_fds.watches[i].gen++;
+        return;
+    }
+    struct fd_watch *w = fd_watch_find(ev->wd);
+    if (!w) return;
+    w->gen++;
+    int removed = (ev->mask & IN_IGNORED) != 0;
+    int named = ev->len > 0 && !removed;
+    for (struct fd_entry *e = named ? g_fds.by_base[fd_base_hash(ev->wd, ev->name)] : g_fds.lru_head, *next; e; e = next) {
+        next = named ? e->base_next : e->lru_next;
+        if (e->wd != ev->wd || (named && strcmp(e->base, ev->name) != 0)) continue;
+        hot_invalidate(e->name);  // 热点缓存里的同一文件也不必等到下次 stat 核对
+        g_fds.invalidated++;
+        fd_unlink(e, removed);
+    }
+    if (removed && (w = fd_watch_find(ev->wd)) != NULL) *w = g_fds.watches[--g_fds.nwatches];
+}
+
+void *fd_watch_main(void *arg) {
+    (void)arg;
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(g_fds.inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("inotify read");
+            break;
+        }
+        pthread_mutex_lock(&g_fds.lock);
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            fd_event(ev);
+            p += sizeof(*ev) + ev->len;
+        }
+        pthread_mutex_unlock(&g_fds.lock);
+    }
+    // 收不到事件就无法作废，之后不再缓存，已有的条目清掉
+    pthread_mutex_lock(&g_fds.lock);
+    g_cfg.fd_cache = 0;
+    while (g_fds.lru_head) fd_unlink(g_fds.lru_head, 0);
+    pthread_mutex_unlock(&g_fds.lock);
+    return NULL;
+}
+
+int fd_cache_init(void) {
+    g_fds.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (g_fds.inotify_fd < 0) {
+        perror("inotify_init1");
+        return -1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, fd_watch_main, NULL) != 0) {
+        close(g_fds.inotify_fd);
+        g_fds.inotify_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/* 只读打开 name 并取元数据，cacheable 时先查描述符缓存；失败返回 -1（errno 为 open/fstat 的错误）。
+   用完调用 file_close */
+int file_open(const char *name, struct open_file *f, int cacheable) {
+    f->cached = NULL;
+    struct fd_watch *w = NULL;
+    uint64_t gen = 0;
+    int wd = -1;
+    if (cacheable && g_cfg.fd_cache > 0) {
+        pthread_mutex_lock(&g_fds.lock);
+        struct fd_entry *e = g_cfg.fd_cache > 0 ? fd_find(name) : NULL;
+        if (e) {
+            e->refs++;
+            fd_lru_remove(e);
+            fd_lru_push(e);
+            g_fds.hits++;
+            f->fd = e->fd;
+            f->st = e->st;
+            f->cached = e;
+            pthread_mutex_unlock(&g_fds.lock);
+            // 原地追加或截断不关闭文件就不会有 inotify 事件，大小以命中时的 fstat 为准（只差一次系统调用）
+            struct stat st;
+            if (fstat(f->fd, &st) == 0) f->st = st;
+            return 0;
+        }
+        g_fds.misses++;
+        // 先挂监视再打开：打开之后的改动都会产生事件，打开期间目录有事件就不缓存这次的结果
+        if (g_cfg.fd_cache > 0 && (w = fd_watch_get(name)) != NULL) {
+            wd = w->wd;
+            gen = w->gen;
+        }
+        pthread_mutex_unlock(&g_fds.lock);
+    }
+
+    f->fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (f->fd >= 0 && fstat(f->fd, &f->st) != 0) {
+        int err = errno;
+        close(f->fd);
+        f->fd = -1;
+        errno = err;
+    }
+    if (wd < 0) return f->fd >= 0 ? 0 : -1;
+
+    int err = errno;
+    pthread_mutex_lock(&g_fds.lock);
+    w = fd_watch_find(wd);
+    size_t len = strlen(name) + 1;
+    struct fd_entry *e = NULL;
+    if (f->fd >= 0 && w && w->gen == gen && g_cfg.fd_cache > 0 && S_ISREG(f->st.st_mode) && !fd_find(name))
+        e = malloc(sizeof(*e) + len);
+    if (e) {
+        memcpy(e->name, name, len);
+        const char *slash = strrchr(e->name, '/');
+        e->base = slash ? slash + 1 : e->name;
+        e->fd = f->fd;
+        e->wd = wd;
+        e->st = f->st;
+        e->refs = 1;
+        e->dead = 0;
+        struct fd_entry **b = &g_fds.buckets[name_hash(name) % FD_BUCKETS];
+        e->next = *b;
+        *b = e;
+        b = &g_fds.by_base[fd_base_hash(wd, e->base)];
+        e->base_next = *b;
+        *b = e;
+        fd_lru_push(e);
+        g_fds.entries++;
+        f->cached = e;
+        while (g_fds.entries > (uint64_t)g_cfg.fd_cache) fd_unlink(g_fds.lru_tail, 0);
+    } else {
+        fd_watch_put(wd, 0);
+    }
+    pthread_mutex_unlock(&g_fds.lock);
+    errno = err;
+    return f->fd >= 0 ? 0 : -1;
+}
+
+void file_close(struct open_file *f) {
+    struct fd_entry *e = f->cached;
+    if (!e) {
+        close(f->fd);
+        return;
+    }
+    pthread_mutex_lock(&g_fds.lock);
+    if (--e->refs == 0 && e->dead) fd_free(e);
+    pthread_mutex_unlock(&g_fds.lock);
+}
+
+void fd_invalidate(const char *name) {
+    if (g_fds.inotify_fd < 0) return;
+    pthread_mutex_lock(&g_fds.lock);
+    struct fd_entry *e = fd_find(name);
+    if (e) {
+        g_fds.invalidated++;
+        fd_unlink(e, 0);
+    }
+    pthread_mutex_unlock(&g_fds.lock);
+}
+
+void fd_stats_dump(void) {
+    if (g_fds.inotify_fd < 0) return;
+    pthread_mutex_lock(&g_fds.lock);
+    fprintf(stderr, "fd cache: %" PRIu64 " open in %d watched dirs, %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+                    " invalidated\n", g_fds.entries, g_fds.nwatches, g_fds.hits, g_fds.misses, g_fds.invalidated);
+    pthread_mutex_unlock(&g_fds.lock);
+}
+
+/* 本进程改写了 name（发布、改名、原地写入）：同步作废两级缓存，不等 inotify 事件 */
+void cache_invalidate(const char *name) {
+    hot_invalidate(name);
+    fd_invalidate(name);
+}
+
+/* 读出同一 filesize 的暂存记录，committed 裁剪到暂存文件实际大小；没有可续传的暂存返回 -1。
+   启用会话表时只查表，*session 返回会话 id（可为 NULL） */
+int staging_read(const char *filename, uint64_t filesize, uint64_t *committed, uint64_t *session) {
+    if (g_sessions.fd >= 0) return session_lookup(filename, filesize, committed, session);
+    char part[STAGING_PATH_MAX], ofs[STAGING_PATH_MAX];
+    if (staging_path(filename, ".part", part) != 0 || staging_path(filename, ".part.ofs", ofs) != 0) return -1;
+    struct stat st;
+    if (stat(part, &st) != 0) return -1;  // 发布后、删记录前崩溃时只剩记录
+    int fd = open(ofs, O_RDONLY);
+    if (fd < 0) return -1;
+    uint64_t rec[2];
+    ssize_t n = pread(fd, rec, sizeof(rec), 0);
+    close(fd);
+    if (n != (ssize_t)sizeof(rec) || ntohll(rec[0]) != filesize) return -1;
+    *committed = ntohll(rec[1]);
+    if (*committed > filesize) *committed = filesize;
+    if (*committed > (uint64_t)st.st_size) *committed = (uint64_t)st.st_size;
+    return 0;
+}
+
+/* 记录 committed；16 字节落在同一扇区内，覆盖写不会撕裂 */
+int staging_record(struct staging *s, uint64_t committed) {
+    if (s->ofs_fd < 0) {
+        if (session_commit(s->session, committed) != 0) return -1;
+        s->committed = committed;
+        return 0;
+    }
+    uint64_t rec[2] = { htonll(s->filesize), htonll(committed) };
+    if (pwrite(s->ofs_fd, rec, sizeof(rec), 0) != (ssize_t)sizeof(rec) || fdatasync(s->ofs_fd) != 0) {
+        perror("write staging offset");
+        return -1;
+    }
+    s->committed = committed;
+    return 0;
+}
+
+/* 把 [0, pos) 变为已提交：先让数据落盘再更新记录 */
+int staging_commit(struct staging *s, uint64_t pos) {
+    if (pos <= s->committed) return 0;
+    if (fdatasync(s->fd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    return staging_record(s, pos);
+}
+
+/* 准备接收 filesize 字节的上传，s->committed 为协商出的续传位置：
+   有同一 filesize 的暂存记录时从 committed 续传，丢掉其后未提交的数据；
+   否则目标已是 filesize 大小视为已完整（s->fd 为 -1），已有较短（或较长）的目标时把它的前缀
+   复制进新的暂存文件作为续传起点，客户端的续传校验比对的正是这份前缀。
+   whole 为真时已完整的目标也整个复制成暂存（要在发布前修补它） */
+int staging_open(const char *filename, uint64_t filesize, struct staging *s, int whole) {
+    char part[STAGING_PATH_MAX], ofs[STAGING_PATH_MAX];
+    s->fd = s->ofs_fd = -1;
+    s->session = 0;
+    s->filesize = filesize;
+    s->committed = 0;
+    s->origin = ORIGIN_NONE;
+    if (staging_path(filename, ".part", part) != 0 || staging_path(filename, ".part.ofs", ofs) != 0) {
+        fprintf(stderr, "filename too long: %s\n", filename);
+        return -1;
+    }
+
+    uint64_t committed = 0, seed = 0;
+    int src = -1, fresh = 0;
+    if (staging_read(filename, filesize, &committed, &s->session) == 0) {
+        s->fd = open(part, O_RDWR);
+        if (s->fd < 0 && errno != ENOENT) {
+            perror("open staging");
+            return -1;
+        }
+        if (s->fd >= 0 && fstat(s->fd, &s->origin_st) == 0) {
+            s->origin = ORIGIN_PART;
+            if ((uint64_t)s->origin_st.st_size < committed) committed = (uint64_t)s->origin_st.st_size;
+        }
+    }
+    if (s->fd < 0) {
+        // 没有可续传的暂存（记录还在而暂存文件已没了，说明发布后记录没来得及删）
+        committed = 0;
+        s->origin = ORIGIN_NONE;
+        src = open(filename, O_RDONLY);
+        struct stat st;
+        if (src >= 0 && fstat(src, &st) == 0) {
+            s->origin = ORIGIN_FILE;
+            s->origin_st = st;
+            if ((uint64_t)st.st_size == filesize && !whole) {
+                close(src);
+                if (s->session) session_end(s->session);
+                s->committed = filesize;
+                return 0;
+            }
+            seed = (uint64_t)st.st_size < filesize ? (uint64_t)st.st_size : filesize;
+        } else if (src < 0 && errno != ENOENT) {
+            perror("open");
+            return -1;
+        }
+        s->fd = open(part, O_RDWR | O_CREAT, 0666);
+        if (s->fd < 0) {
+            perror("open staging");
+            goto fail;
+        }
+        fresh = 1;
+        if (g_sessions.fd >= 0 && session_begin(filename, filesize, &s->session) != 0) goto fail;
+    }
+    if (g_sessions.fd < 0 && (s->ofs_fd = open(ofs, O_RDWR | O_CREAT, 0666)) < 0) {
+        perror("open staging");
+        goto fail;
+    }
+    if (ftruncate(s->fd, (off_t)committed) != 0) {
+        perror("ftruncate");
+        goto fail;
+    }
+    if (preallocate(s->fd, committed, filesize - committed, 1) != 0) goto fail;
+    if (seed > 0) {
+        char buf[BUF_SIZE];
+        if (copy_range(src, 0, s->fd, 0, seed, buf, sizeof(buf)) != 0) goto fail;
+        committed = seed;
+    }
+    if (src >= 0) close(src);
+    src = -1;
+    if (fdatasync(s->fd) != 0 || staging_record(s, committed) != 0) goto fail;
+    return 0;
+
+fail:
+    if (fresh) {  // 新建的暂存不留下（例如空间不足被拒）
+        unlink(part);
+        if (s->ofs_fd >= 0) unlink(ofs);
+        if (s->session) session_end(s->session);
+    }
+    if (src >= 0) close(src);
+    if (s->fd >= 0) close(s->fd);
+    if (s->ofs_fd >= 0) close(s->ofs_fd);
+    s->fd = s->ofs_fd = -1;
+    return -1;
+}
+
+/* 准备发布用的落盘请求：暂存文件落盘，改名覆盖目标，目录落盘。part 至少 STAGING_PATH_MAX 字节，
+ * 请求完成前须保持有效 */
+int staging_publish_req(const char *filename, struct staging *s, struct sync_req *req, char *part) {
+    if (staging_path(filename, ".part", part) != 0) return -1;
+    memset(req, 0, sizeof(*req));
+    req->fd = s->fd;
+    req->from = part;
+    req->to = filename;
+    return 0;
+}
+
+/* 发布请求完成之后：失效缓存，成功时删掉记录 */
+int staging_published(const char *filename, struct staging *s, int rc) {
+    char ofs[STAGING_PATH_MAX];
+    cache_invalidate(filename);  // 改名后目录 fsync 失败时文件也可能已换掉
+    if (rc != 0) {
+        fprintf(stderr, "publish upload: %s failed\n", filename);
+        return -1;
+    }
+    if (s->ofs_fd >= 0) {
+        if (staging_path(filename, ".part.ofs", ofs) == 0) unlink(ofs);
+    } else {
+        session_end(s->session);
+    }
+    return 0;
+}
+
+/* 收满后发布：一次落盘请求完成 fsync、改名与目录 fsync，再删掉记录 */
+int staging_publish(const char *filename, struct staging *s) {
+    char part[STAGING_PATH_MAX];
+    struct sync_req req;
+    if (staging_publish_req(filename, s, &req, part) != 0) return -1;
+    sync_wait_all(&req, 1);
+    return staging_published(filename, s, req.rc);
+}
+
+/* 关闭描述符；未发布的暂存文件与记录留给下次续传 */
+void staging_close(struct staging *s) {
+    if (s->fd >= 0) close(s->fd);
+    if (s->ofs_fd >= 0) close(s->ofs_fd);
+    s->fd = s->ofs_fd = -1;
+}
+
+/* ---------------- io_uring 数据通道 ----------------
+ * 只替换 handle_upload / handle_download 的数据阶段。每个工作线程一个 ring，
+ * 两组缓冲注册为 fixed buffers，socket 与文件注册为 fixed files：
+ * 一次 io_uring_enter 同时提交「本组 recv/read」与「上一组 write/send」，
+ * 系统调用数从每 8KB 一次降到每 512KB 一次。
+ * 文件表在建 ring 时以两个空槽注册一次，每次传输只用 FILES_UPDATE 换槽，
+ * 不再反复整表注册/注销（注销要等整个 ring 静默）。 */
+
+#define URING_CANCEL 2  /* 取消请求自己的 user_data，与数据请求的 0 / 1 区分 */
+
+struct uring {
+    int fd;
+    unsigned inflight;  /* 已提交、完成事件尚未收割的请求数 */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    char *bufs[2];  /* 两组缓冲，fixed buffer 下标 0 / 1 */
+};
+
+static __thread struct uring *t_ring;
+static __thread int t_ring_failed;
+
+struct uring *uring_get(void) {
+    if (t_ring || t_ring_failed) return t_ring;
+
+    struct uring *r = calloc(1, sizeof(*r));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (!r) goto fail;
+    r->fd = (int)syscall(__NR_io_uring_setup, 4, &p);
+    if (r->fd < 0) goto fail;
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_sz > sq_sz) sq_sz = cq_sz;
+    char *sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto fail;
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto fail;
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    struct iovec iov[2];
+    for (int i = 0; i < 2; i++) {
+        r->bufs[i] = malloc(URING_GROUP_SIZE);
+        if (!r->bufs[i]) goto fail;
+        iov[i].iov_base = r->bufs[i];
+        iov[i].iov_len = URING_GROUP_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, 2) != 0) goto fail;
+    int empty[2] = { -1, -1 };  // 稀疏文件表：槽 0 = socket，槽 1 = 文件，传输时再填
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, empty, 2) != 0) goto fail;
+
+    t_ring = r;
+    return r;
+
+fail:
+    perror("io_uring setup, falling back to recv/send loop");
+    t_ring_failed = 1;
+    return NULL;  // 失败的 ring 只在出错时泄漏一次，工作线程常驻，不值得逐项回收
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* 收割已有的 CQE；res 非空时按 user_data 保存数据请求的结果，返回收割个数 */
+static unsigned uring_reap(struct uring *r, int res[2]) {
+    unsigned head = *r->cq_head, n = 0;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        if (res && cqe->user_data < 2) res[cqe->user_data] = cqe->res;
+        head++;
+        n++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    r->inflight -= n;
+    return n;
+}
+
+/* 提交 n 个 SQE 并等它们全部完成；res[user_data] 保存结果。
+ * 出错返回 -1 时可能还有请求未提交或在途，调用方须 uring_drain */
+int uring_submit_wait(struct uring *r, unsigned n, int res[2]) {
+    unsigned submitted = 0, done = 0;
+    while (done < n) {
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, n - submitted, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            perror("io_uring_enter");
+            return -1;
+        }
+        submitted += (unsigned)ret;
+        r->inflight += (unsigned)ret;
+        done += uring_reap(r, res);
+    }
+    return 0;
+}
+
+/* 出错后收尾：丢掉还没交给内核的 SQE，取消在途请求并收割它们全部的 CQE，
+ * 保证残留的完成事件不会被下一次传输当成自己的结果。收不干净就弃用这个 ring */
+void uring_drain(struct uring *r) {
+    __atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    uring_reap(r, NULL);
+    if (r->inflight == 0) return;
+
+    unsigned n = 0;
+    for (uint64_t target = 0; target < 2; target++) {
+        struct io_uring_sqe *sqe = uring_sqe(r);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = target;  // 按 user_data 匹配；目标已完成时内核回 -ENOENT
+        sqe->user_data = URING_CANCEL;
+        n++;
+    }
+    while (r->inflight > 0 || n > 0) {
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, n, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            perror("io_uring_enter drain");
+            t_ring = NULL;
+            t_ring_failed = 1;  // 状态未知，本线程此后改走 splice / recv
+            return;
+        }
+        r->inflight += (unsigned)ret;
+        n -= (unsigned)ret;
+        uring_reap(r, NULL);
+    }
+}
+
+/* 把 socket 和文件换进槽 0 / 1；传完换回 -1，否则 ring 一直持有它们，
+ * 关闭的 socket 也发不出 FIN */
+int uring_set_files(struct uring *r, int sock, int fd) {
+    int fds[2] = { sock, fd };
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.fds = (uint64_t)(uintptr_t)fds;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE, &up, 2) != 2) {
+        perror("io_uring files update");
+        return -1;
+    }
+    return 0;
+}
+
+/* 上传：socket(fixed 0) -> 缓冲组 g，同时把上一组写入文件(fixed 1) 的 offset 处；crc 非空时累计收到数据的 CRC32C */
+int uring_upload(struct uring *r, int sock, int fd, uint64_t offset, uint64_t filesize, uint32_t *crc) {
+    if (uring_set_files(r, sock, fd) != 0) return -1;
+
+    uint64_t recv_pos = offset;
+    uint64_t prev_off = 0;
+    size_t prev_len = 0;
+    int g = 0, rc = -1;
+    while (recv_pos < filesize || prev_len > 0) {
+        unsigned n = 0;
+        int res[2] = { 0, 0 };
+        if (recv_pos < filesize) {
+            uint64_t left = filesize - recv_pos;
+            struct io_uring_sqe *sqe = uring_sqe(r);
+            sqe->opcode = IORING_OP_RECV;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 0;
+            sqe->addr = (uint64_t)(uintptr_t)r->bufs[g];
+            sqe->len = left > URING_GROUP_SIZE ? URING_GROUP_SIZE : (unsigned)left;
+            sqe->msg_flags = MSG_WAITALL;
+            sqe->user_data = 0;
+            n++;
+        }
+        if (prev_len > 0) {
+            struct io_uring_sqe *sqe = uring_sqe(r);
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 1;
+            sqe->addr = (uint64_t)(uintptr_t)r->bufs[g ^ 1];
+            sqe->len = (unsigned)prev_len;
+            sqe->off = prev_off;
+            sqe->buf_index = (uint16_t)(g ^ 1);
+            sqe->user_data = 1;
+            n++;
+        }
+        if (uring_submit_wait(r, n, res) != 0) goto out;
+
+        if (prev_len > 0) {
+            if (res[1] < 0) {
+                errno = -res[1];
+                perror("io_uring write");
+                goto out;
+            }
+            // 短写极少见，同步补完剩余部分
+            size_t written = (size_t)res[1];
+            if (written < prev_len &&
+                pwrite_all(fd, r->bufs[g ^ 1] + written, prev_len - written, prev_off + written) != 0) goto out;
+            prev_len = 0;
+        }
+        if (recv_pos < filesize) {
+            if (res[0] < 0) {
+                errno = -res[0];
+                perror("io_uring recv");
+                goto out;
+            }
+            if (res[0] == 0) {
+                fprintf(stderr, "client closed during upload\n");
+                goto out;
+            }
+            // 短收只意味着本组没填满，数据仍按顺序连续，下一轮继续收
+            if (crc) *crc = g_crc32c(*crc, r->bufs[g], (size_t)res[0]);
+            prev_off = recv_pos;
+            prev_len = (size_t)res[0];
+            recv_pos += (uint64_t)res[0];
+            g ^= 1;
+        }
+    }
+    rc = 0;
+
+out:
+    if (rc != 0) uring_drain(r);
+    uring_set_files(r, -1, -1);
+    return rc;
+}
+
+/* 下载：文件(fixed 1) offset 处读入缓冲组 g，同时把上一组发往 socket(fixed 0) */
+int uring_download(struct uring *r, int sock, int fd, uint64_t offset, uint64_t filesize) {
+    if (uring_set_files(r, sock, fd) != 0) return -1;
+
+    uint64_t read_pos = offset;
+    size_t prev_len = 0;
+    int g = 0, rc = -1;
+    while (read_pos < filesize || prev_len > 0) {
+        unsigned n = 0;
+        int res[2] = { 0, 0 };
+        if (read_pos < filesize) {
+            uint64_t left = filesize - read_pos;
+            struct io_uring_sqe *sqe = uring_sqe(r);
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 1;
+            sqe->addr = (uint64_t)(uintptr_t)r->bufs[g];
+            sqe->len = left > URING_GROUP_SIZE ? URING_GROUP_SIZE : (unsigned)left;
+            sqe->off = read_pos;
+            sqe->buf_index = (uint16_t)g;
+            sqe->user_data = 0;
+            n++;
+        }
+        if (prev_len > 0) {
+            struct io_uring_sqe *sqe = uring_sqe(r);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 0;
+            sqe->addr = (uint64_t)(uintptr_t)r->bufs[g ^ 1];
+            sqe->len = (unsigned)prev_len;
+            sqe->msg_flags = MSG_WAITALL;
+            sqe->user_data = 1;
+            n++;
+        }
+        if (uring_submit_wait(r, n, res) != 0) goto out;
+
+        if (prev_len > 0) {
+            if (res[1] < 0) {
+                errno = -res[1];
+                perror("io_uring send");
+                goto out;
+            }
+            // 老内核可能短发，剩余部分同步发完再复用这组缓冲
+            size_t sent = (size_t)res[1];
+            if (sent < prev_len &&
+                send_all(sock, r->bufs[g ^ 1] + sent, prev_len - sent) != (ssize_t)(prev_len - sent)) {
+                perror("send");
+                goto out;
+            }
+            prev_len = 0;
+        }
+        if (read_pos < filesize) {
+            if (res[0] < 0) {
+                errno = -res[0];
+                perror("io_uring read");
+                goto out;
+            }
+            if (res[0] == 0) {
+                fprintf(stderr, "file truncated during download\n");
+                goto out;
+            }
+            prev_len = (size_t)res[0];
+            read_pos += (uint64_t)res[0];
+            g ^= 1;
+        }
+    }
+    rc = 0;
+
+out:
+    if (rc != 0) uring_drain(r);
+    uring_set_files(r, -1, -1);
+    return rc;
+}
+
+/* ---------------- splice 上传通道 ----------------
+ * socket -> pipe -> 文件，数据只在内核页之间移动。每个线程（工作线程或
+ * 事件循环）缓存一条管道，出错时管道里可能残留数据，必须丢弃重建。 */
+
+static __thread int t_pipe[2] = { -1, -1 };
+static __thread size_t t_pipe_size;
+
+/* 取本线程的中转管道，返回读端；失败返回 -1 */
+int thread_pipe(void) {
+    if (t_pipe[0] >= 0) return t_pipe[0];
+    if (pipe2(t_pipe, O_CLOEXEC) != 0) {
+        perror("pipe2");
+        t_pipe[0] = t_pipe[1] = -1;
+        return -1;
+    }
+    fcntl(t_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);  // 尽力而为，失败就用默认 64KB
+    int sz = fcntl(t_pipe[1], F_GETPIPE_SZ);
+    t_pipe_size = sz > 0 ? (size_t)sz : 65536;
+    return t_pipe[0];
+}
+
+void thread_pipe_reset(void) {
+    if (t_pipe[0] >= 0) {
+        close(t_pipe[0]);
+        close(t_pipe[1]);
+    }
+    t_pipe[0] = t_pipe[1] = -1;
+}
+
+/* 把管道里的 len 字节写到文件 offset 处；文件系统不支持 splice 写入时用 buf 读出再 pwrite */
+int pipe_to_file(int fd, uint64_t offset, size_t len, char *buf, size_t buf_size) {
+    int use_copy = 0;
+    while (len > 0) {
+        ssize_t n;
+        if (!use_copy) {
+            off_t off = (off_t)offset;
+            n = splice(t_pipe[0], NULL, fd, &off, len, SPLICE_F_MOVE);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                use_copy = 1;
+                continue;
+            }
+        } else {
+            n = read(t_pipe[0], buf, len > buf_size ? buf_size : len);
+            if (n > 0 && pwrite_all(fd, buf, (size_t)n, offset) != 0) return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("splice to file");
+            return -1;
+        }
+        if (n == 0) return -1;
+        offset += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* 零拷贝接收 [*offset, end) 写入 fd。返回 0 完成，-1 出错，
+   1 表示 socket 不支持 splice，*offset 停在已写入的位置，调用方改走拷贝路径 */
+int splice_range(int sock, int fd, uint64_t *offset, uint64_t end) {
+    char buf[BUF_SIZE];  // 只在文件不支持 splice 写入时使用
+    if (thread_pipe() < 0) return 1;
+    while (*offset < end) {
+        uint64_t left = end - *offset;
+        ssize_t n = splice(sock, NULL, t_pipe[1], NULL, left > t_pipe_size ? t_pipe_size : (size_t)left,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) return 1;
+            perror("splice from socket");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "client closed during upload\n");
+            return -1;
+        }
+        if (pipe_to_file(fd, *offset, (size_t)n, buf, sizeof(buf)) != 0) {
+            thread_pipe_reset();
+            return -1;
+        }
+        *offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+/* 零拷贝发送 [*offset, end)：页缓存直接进 socket，不经过用户态缓冲。
+   返回 0 完成，-1 出错，1 表示文件/套接字不支持 sendfile，*offset 停在已发送的位置 */
+int sendfile_range(int sock, int fd, uint64_t *offset, uint64_t end) {
+    while (*offset < end) {
+        uint64_t left = end - *offset;
+        off_t off = (off_t)*offset;
+        ssize_t n = sendfile(sock, fd, &off, left > SENDFILE_MAX ? SENDFILE_MAX : (size_t)left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) return 1;
+            perror("sendfile");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "file truncated during download\n");
+            return -1;
+        }
+        *offset += (uint64_t)n;  // 短发送只是 socket 缓冲满，继续从新位置发
+    }
+    return 0;
+}
+
+/* 接收 [*pos, end) 写入 fd：按引擎依次尝试 io_uring、splice，最后是 recv + pwrite。
+   crc 非空时边收边累计 CRC32C：数据不经过用户态就算不了，所以不走 splice，换成多一次拷贝（不必事后读回文件）。
+   返回 0 完成，-1 出错；*pos 为已写入文件的位置 */
+int recv_to_file(int sock, int fd, uint64_t *pos, uint64_t end, uint32_t *crc) {
+    struct uring *ring = g_cfg.engine == ENGINE_URING ? uring_get() : NULL;
+    if (ring) {
+        if (uring_upload(ring, sock, fd, *pos, end, crc) != 0) return -1;
+        *pos = end;
+        return 0;
+    }
+
+    int rc = crc ? 1 : splice_range(sock, fd, pos, end);
+    if (rc <= 0) return rc;
+
+    // splice 不可用时退回拷贝路径，从已写入的位置继续
+    char buf[BUF_SIZE];
+    while (*pos < end) {
+        size_t to_read = (size_t)((end - *pos) > BUF_SIZE ? BUF_SIZE : (end - *pos));
+        ssize_t n = recv(sock, buf, to_read, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("recv");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "client closed during upload\n");
+            return -1;
+        }
+        if (crc) *crc = g_crc32c(*crc, buf, (size_t)n);
+        if (pwrite_all(fd, buf, (size_t)n, *pos) != 0) return -1;
+        *pos += (uint64_t)n;
+    }
+    return 0;
+}
+
+/* 发送 fd 中 [*pos, end)：io_uring、sendfile，最后是 pread + send。返回 0 完成，-1 出错 */
+int send_from_file(int sock, int fd, uint64_t *pos, uint64_t end) {
+    struct uring *ring = g_cfg.engine == ENGINE_URING ? uring_get() : NULL;
+    if (ring) {
+        if (uring_download(ring, sock, fd, *pos, end) != 0) return -1;
+        *pos = end;
+        return 0;
+    }
+
+    int rc = sendfile_range(sock, fd, pos, end);
+    if (rc <= 0) return rc;
+
+    // sendfile 不可用时退回拷贝路径，从已发送的位置继续
+    char buf[BUF_SIZE];
+    while (*pos < end) {
+        size_t want = (size_t)((end - *pos) > BUF_SIZE ? BUF_SIZE : (end - *pos));
+        ssize_t n = pread(fd, buf, want, (off_t)*pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("pread");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "file truncated during download\n");
+            return -1;
+        }
+        if (send_all(sock, buf, (size_t)n) != n) {
+            perror("send");
+            return -1;
+        }
+        *pos += (uint64_t)n;
+    }
+    return 0;
+}
+
+/* ---------------- 下载的页缓存提示 ----------------
+ * 发送位置之前 g_cfg.readahead 字节用 WILLNEED 提前读入，冷文件的大下载是连续读盘而不是随发送逐块等待；
+ * 不小于 g_cfg.drop_behind 的文件，已发送且落后一个窗口以上的部分用 DONTNEED 丢掉，
+ * 单个大文件的下载不会把常用小文件挤出页缓存（落后一个窗口是为了不碰 socket 里还引用着的页） */
+struct readahead {
+    int fd;            /* -1 表示不提示 */
+    int drop;
+    uint64_t ahead;    /* [.., ahead) 已提示过 WILLNEED */
+    uint64_t dropped;  /* [.., dropped) 已提示过 DONTNEED */
+};
+
+void ra_advance(struct readahead *ra, uint64_t pos) {
+    if (!ra || ra->fd < 0) return;
+    uint64_t window = g_cfg.readahead;
+    if (window > 0 && pos + window / 2 >= ra->ahead) {
+        posix_fadvise(ra->fd, (off_t)ra->ahead, (off_t)(pos + window - ra->ahead), POSIX_FADV_WILLNEED);
+        ra->ahead = pos + window;
+    }
+    uint64_t lag = window > 0 ? window : 8ULL << 20;
+    if (ra->drop && pos >= ra->dropped + 2 * lag) {
+        posix_fadvise(ra->fd, (off_t)ra->dropped, (off_t)(pos - lag - ra->dropped), POSIX_FADV_DONTNEED);
+        ra->dropped = pos - lag;
+    }
+}
+
+/* shared：fd 来自描述符缓存，与其他连接共用打开文件表项，不改它的预读模式 */
+void ra_start(struct readahead *ra, int fd, uint64_t pos, uint64_t filesize, int shared) {
+    ra->fd = -1;
+    ra->drop = g_cfg.drop_behind > 0 && filesize >= g_cfg.drop_behind;
+    if (g_cfg.readahead == 0 && !ra->drop) return;
+    ra->fd = fd;
+    ra->ahead = ra->dropped = pos;
+    if (!shared) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ra_advance(ra, pos);
+}
+
+/* ---------------- 哈希树续传校验 ----------------
+ * 续传前把双方共有的前缀 [0, L) 按 MERKLE_CHUNK 切块，叶子是各块的 CRC32C，
+ * 每 MERKLE_FANOUT 个子节点的哈希（网络字节序拼接）再算一次 CRC32C 得到父节点，直到只剩根。
+ * 根相同说明前缀一致；否则客户端逐层只展开哈希不同的节点，最后得到需要重传的块。 */
+#define MERKLE_CHUNK (1024 * 1024)
+#define MERKLE_FANOUT 16
+#define MERKLE_MAX_LEVELS 16   /* 2^64 / MERKLE_CHUNK 个叶子也只需 12 层 */
+
+struct merkle {
+    int nlevels;                           /* level[0] 是叶子，level[nlevels - 1] 只有根 */
+    uint64_t count[MERKLE_MAX_LEVELS];
+    uint32_t *level[MERKLE_MAX_LEVELS];
+};
+
+void merkle_free(struct merkle *t) {
+    for (int i = 0; i < t->nlevels; i++) free(t->level[i]);
+    t->nlevels = 0;
+}
+
+/* 第 lvl 层节点 idx 的子节点范围 [*first, 返回值) */
+uint64_t merkle_children(const struct merkle *t, int lvl, uint64_t idx, uint64_t *first) {
+    *first = idx * MERKLE_FANOUT;
+    uint64_t end = *first + MERKLE_FANOUT;
+    return end < t->count[lvl - 1] ? end : t->count[lvl - 1];
+}
+
+/* 读 fd 的 [0, len) 建树，len 为 0 时为空树；失败返回 -1 */
+int merkle_build(int fd, uint64_t len, struct merkle *t) {
+    memset(t, 0, sizeof(*t));
+    if (len == 0) return 0;
+    char *buf = malloc(MERKLE_CHUNK);
+    uint64_t n = (len + MERKLE_CHUNK - 1) / MERKLE_CHUNK;
+    t->level[0] = malloc(n * sizeof(uint32_t));
+    t->count[0] = n;
+    t->nlevels = 1;
+    if (!buf || !t->level[0]) goto fail;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t off = i * MERKLE_CHUNK;
+        size_t want = len - off > MERKLE_CHUNK ? MERKLE_CHUNK : (size_t)(len - off);
+        for (size_t got = 0; got < want; ) {
+            ssize_t r = pread(fd, buf + got, want - got, (off_t)(off + got));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                fprintf(stderr, "merkle: read failed or file shrank\n");
+                goto fail;
+            }
+            got += (size_t)r;
+        }
+        t->level[0][i] = g_crc32c(0, buf, want);
+    }
+    while (t->count[t->nlevels - 1] > 1) {
+        int lvl = t->nlevels;
+        uint64_t cnt = (t->count[lvl - 1] + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+        t->level[lvl] = malloc(cnt * sizeof(uint32_t));
+        if (!t->level[lvl]) goto fail;
+        t->count[lvl] = cnt;
+        t->nlevels++;
+        for (uint64_t i = 0; i < cnt; i++) {
+            uint64_t first, end = merkle_children(t, lvl, i, &first);
+            uint32_t kids[MERKLE_FANOUT];
+            for (uint64_t k = first; k < end; k++) kids[k - first] = htonl(t->level[lvl - 1][k]);
+            t->level[lvl][i] = g_crc32c(0, kids, (end - first) * sizeof(uint32_t));
+        }
+    }
+    free(buf);
+    return 0;
+
+fail:
+    free(buf);
+    merkle_free(t);
+    return -1;
+}
+
+uint32_t merkle_root(const struct merkle *t) {
+    return t->nlevels ? t->level[t->nlevels - 1][0] : 0;
+}
+
+/* 树覆盖 [0, len) 时按叶子拼出 [0, *covered) 的 CRC32C：upto 不小于 len 时是整棵树，
+   否则只取 upto 之前的整块，剩下不到一块的部分由调用方读 */
+uint32_t merkle_prefix_crc(const struct merkle *t, uint64_t len, uint64_t upto, uint64_t *covered) {
+    if (t->nlevels == 0) {
+        *covered = 0;  // 没有树，整段都由调用方读
+        return 0;
+    }
+    uint64_t n = upto >= len ? t->count[0] : upto / MERKLE_CHUNK;
+    uint32_t shift = crc32c_xpow(8ull * MERKLE_CHUNK), crc = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t leaf = len - i * MERKLE_CHUNK < MERKLE_CHUNK ? len - i * MERKLE_CHUNK : MERKLE_CHUNK;
+        crc = crc32c_multmodp(leaf == MERKLE_CHUNK ? shift : crc32c_xpow(8 * leaf), crc) ^ t->level[0][i];
+    }
+    *covered = upto >= len ? len : n * MERKLE_CHUNK;
+    return crc;
+}
+
+/* 续传校验为 upload 建的树留到同一线程的下一个 upload：叶子就是前缀各块的 CRC32C，
+   上传确认里的前缀 CRC 由叶子拼出，不必再读一遍。只有来源文件还是建树时那一个才用 */
+static __thread struct {
+    char name[512];
+    enum origin origin;  /* 树建在暂存文件上还是目标文件上 */
+    struct stat st;      /* 建树时来源文件的状态 */
+    uint64_t len;        /* 树覆盖 [0, len) */
+    struct merkle t;
+} t_tree;
+
+/* 收下刚建好的树（t 转归 t_tree） */
+void tree_keep(const char *filename, enum origin origin, const struct stat *st, uint64_t len, struct merkle *t) {
+    merkle_free(&t_tree.t);
+    t_tree.origin = ORIGIN_NONE;
+    if (origin == ORIGIN_NONE || strlen(filename) >= sizeof(t_tree.name)) {
+        merkle_free(t);
+        return;
+    }
+    strcpy(t_tree.name, filename);
+    t_tree.origin = origin;
+    t_tree.st = *st;
+    t_tree.len = len;
+    t_tree.t = *t;
+    t->nlevels = 0;
+}
+
+/* 按留下的树拼出 filename 前缀 [0, *covered) 的 CRC32C，*covered 不超过 upto；没有可用的树时为 0。
+   暂存文件续传时只改动 committed 之后的部分，认 inode 即可；目标文件还要大小与修改时间都没变 */
+uint32_t tree_prefix_crc(const char *filename, enum origin origin, const struct stat *st, uint64_t upto,
+                         uint64_t *covered) {
+    *covered = 0;
+    if (t_tree.origin == ORIGIN_NONE || t_tree.origin != origin || strcmp(t_tree.name, filename) != 0 ||
+        t_tree.st.st_dev != st->st_dev || t_tree.st.st_ino != st->st_ino)
+        return 0;
+    if (origin == ORIGIN_FILE &&
+        (t_tree.st.st_size != st->st_size || t_tree.st.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+         t_tree.st.st_mtim.tv_nsec != st->st_mtim.tv_nsec))
+        return 0;
+    return merkle_prefix_crc(&t_tree.t, t_tree.len, upto, covered);
+}
+
+/* 树只给紧接着的那个 upload 用 */
+void tree_drop(void) {
+    merkle_free(&t_tree.t);
+    t_tree.origin = ORIGIN_NONE;
+}
+
+/* filename 的 [start, end) 在建树之后被修补过：从 fd 读回重算涉及的叶子（上层节点只用于比对，不再更新） */
+void tree_refresh(const char *filename, int fd, uint64_t start, uint64_t end) {
+    if (t_tree.origin == ORIGIN_NONE || strcmp(t_tree.name, filename) != 0 || start >= t_tree.len) return;
+    char *buf = malloc(MERKLE_CHUNK);
+    if (!buf) {
+        tree_drop();  // 没法更新就不用这棵树，确认时读回前缀
+        return;
+    }
+    for (uint64_t i = start / MERKLE_CHUNK; i * MERKLE_CHUNK < end && i < t_tree.t.count[0]; i++) {
+        uint64_t off = i * MERKLE_CHUNK;
+        size_t want = t_tree.len - off > MERKLE_CHUNK ? MERKLE_CHUNK : (size_t)(t_tree.len - off);
+        for (size_t got = 0; got < want; ) {
+            ssize_t r = pread(fd, buf + got, want - got, (off_t)(off + got));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                tree_drop();
+                free(buf);
+                return;
+            }
+            got += (size_t)r;
+        }
+        t_tree.t.level[0][i] = g_crc32c(0, buf, want);
+    }
+    free(buf);
+}
+
+/* ---------------- SHA-256 ---------------- */
+
+/* 去重存储按内容寻址，CRC32C 的碰撞概率不够用，块以 SHA-256 命名。
+   支持 SHA 扩展指令的 CPU 上用 sha256rnds2 等指令，比逐轮计算快约 3 倍 */
+#define SHA256_LEN 32
+
+static const uint32_t k_sha256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void (*g_sha256_blocks)(uint32_t h[8], const unsigned char *p, size_t nblocks);
+
+void sha256_block(uint32_t h[8], const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+                      k_sha256[i] + w[i];
+        uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+void sha256_blocks_sw(uint32_t h[8], const unsigned char *p, size_t nblocks) {
+    for (; nblocks > 0; nblocks--, p += 64) sha256_block(h, p);
+}
+
+#if defined(__x86_64__)
+/* SHA 扩展指令：每条 sha256rnds2 做两轮，消息扩展用 sha256msg1/msg2，状态按 ABEF/CDGH 排列 */
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha256_blocks_ni(uint32_t h[8], const unsigned char *p, size_t nblocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);  /* CDAB */
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);  /* EFGH */
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);       /* CDGH */
+    for (; nblocks > 0; nblocks--, p += 64) {
+        __m128i abef = state0, cdgh = state1, m[4];
+        for (int i = 0; i < 4; i++) m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+        for (int g = 0; g < 16; g++) {
+            __m128i msg = _mm_add_epi32(m[g & 3], _mm_loadu_si128((const __m128i *)&k_sha256[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+            if (g < 12) {  // 算出第 g + 4 组的 4 个消息字，占用第 g 组的位置
+                __m128i w = _mm_add_epi32(_mm_sha256msg1_epu32(m[g & 3], m[(g + 1) & 3]),
+                                          _mm_alignr_epi8(m[(g + 3) & 3], m[(g + 2) & 3], 4));
+                m[g & 3] = _mm_sha256msg2_epu32(w, m[(g + 3) & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1b);       /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xb1);    /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0); /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);    /* HGFE */
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+#endif
+
+/* 按 CPU 选定实现，main 开头调用一次 */
+void sha256_init(void) {
+    g_sha256_blocks = sha256_blocks_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) g_sha256_blocks = sha256_blocks_ni;
+#endif
+}
+
+/* 一次算完整段数据的 SHA-256 */
+void sha256(const void *data, size_t len, unsigned char out[SHA256_LEN]) {
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    const unsigned char *p = data;
+    size_t left = len;
+    g_sha256_blocks(h, p, left / 64);
+    p += left / 64 * 64;
+    left %= 64;
+    unsigned char tail[128] = { 0 };
+    memcpy(tail, p, left);
+    tail[left] = 0x80;
+    size_t tail_len = left < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) tail[tail_len - 1 - i] = (unsigned char)(bits >> (8 * i));
+    g_sha256_blocks(h, tail, tail_len / 64);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char)(h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)h[i];
+    }
+}
+
+/* ---------------- 数据阶段压缩 ---------------- */
+
+#ifdef HAVE_ZSTD
+static __thread ZSTD_CCtx *t_zcctx;
+static __thread ZSTD_DCtx *t_zdctx;
+#endif
+static __thread char *t_frame_buf;  /* 2 * FRAME_BLOCK：原始块 + 压缩块 */
+
+char *frame_buffers(void) {
+    if (!t_frame_buf) t_frame_buf = malloc(2 * FRAME_BLOCK);
+    return t_frame_buf;
+}
+
+/* 各编码的分帧计数，SIGUSR1 时打印。发送按尝试的编码计，压不小而原样发出的块计入 bypassed */
+struct frame_stats {
+    uint64_t frames;
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;  /* 含帧头 */
+    uint64_t bypassed;
+    uint64_t usecs;       /* 压缩耗时 */
+};
+static struct frame_stats g_frames_sent[FRAME_CODECS];
+static struct frame_stats g_frames_recv[FRAME_CODECS];
+static uint64_t g_crc_errors;
+static const char *const k_codec_names[FRAME_CODECS] = { "raw", "lz4", "zstd" };
+
+void frame_stats_add(struct frame_stats *st, uint64_t raw, uint64_t wire, int bypassed, uint64_t ns) {
+    __atomic_fetch_add(&st->frames, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->raw_bytes, raw, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->wire_bytes, wire, __ATOMIC_RELAXED);
+    if (bypassed) __atomic_fetch_add(&st->bypassed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->usecs, ns / 1000, __ATOMIC_RELAXED);
+}
+
+void frame_stats_dump(void) {
+    for (int dir = 0; dir < 2; dir++) {
+        struct frame_stats *st = dir == 0 ? g_frames_sent : g_frames_recv;
+        for (int c = 0; c < FRAME_CODECS; c++) {
+            uint64_t frames = __atomic_load_n(&st[c].frames, __ATOMIC_RELAXED);
+            if (frames == 0) continue;
+            uint64_t raw = __atomic_load_n(&st[c].raw_bytes, __ATOMIC_RELAXED);
+            uint64_t wire = __atomic_load_n(&st[c].wire_bytes, __ATOMIC_RELAXED);
+            fprintf(stderr, "frames %s %-4s: %" PRIu64 " frames, %" PRIu64 " -> %" PRIu64 " bytes (%.1f%%), "
+                    "%" PRIu64 " bypassed, %.3f s compressing\n",
+                    dir == 0 ? "sent" : "recv", k_codec_names[c], frames, raw, wire,
+                    raw ? 100.0 * (double)wire / (double)raw : 0.0,
+                    __atomic_load_n(&st[c].bypassed, __ATOMIC_RELAXED),
+                    (double)__atomic_load_n(&st[c].usecs, __ATOMIC_RELAXED) / 1e6);
+        }
+    }
+    uint64_t crc_errors = __atomic_load_n(&g_crc_errors, __ATOMIC_RELAXED);
+    if (crc_errors) fprintf(stderr, "frames with bad crc: %" PRIu64 "\n", crc_errors);
+}
+
+/* 本进程能用于某条连接的压缩编码：-1 表示不压缩 */
+int peer_codec(const struct peer *p) {
+    if (p->caps & CAP_ZSTD) return FRAME_ZSTD;
+    if (p->caps & CAP_LZ4) return FRAME_LZ4;
+    return -1;
+}
+
+/* upload/download 的数据阶段是否分帧 */
+int peer_framed(const struct peer *p) {
+    return (p->caps & (CAP_LZ4 | CAP_ZSTD | CAP_CHECKSUM)) != 0;
+}
+
+/* 压缩一块到 dst（容量 cap）；压不进 cap 或出错返回 0，调用方改发原始数据 */
+size_t codec_compress(int codec, int level, const char *src, size_t len, char *dst, size_t cap) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case FRAME_LZ4: {
+        int n = level >= LZ4HC_CLEVEL_MIN ? LZ4_compress_HC(src, dst, (int)len, (int)cap, level)
+                                          : LZ4_compress_default(src, dst, (int)len, (int)cap);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case FRAME_ZSTD: {
+        if (!t_zcctx && !(t_zcctx = ZSTD_createCCtx())) return 0;
+        size_t n = ZSTD_compressCCtx(t_zcctx, dst, cap, src, len, level ? level : ZSTD_CLEVEL_DEFAULT);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        (void)level; (void)src; (void)len; (void)dst; (void)cap;
+        return 0;
+    }
+}
+
+/* 解压一块，结果必须正好 raw_len 字节（FRAME_RAW 由调用方直接收进目标缓冲） */
+int codec_decompress(int codec, const char *src, size_t len, char *dst, size_t raw_len) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case FRAME_LZ4:
+        return LZ4_decompress_safe(src, dst, (int)len, (int)raw_len) == (int)raw_len ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+    case FRAME_ZSTD: {
+        if (!t_zdctx && !(t_zdctx = ZSTD_createDCtx())) return -1;
+        size_t n = ZSTD_decompressDCtx(t_zdctx, dst, raw_len, src, len);
+        return !ZSTD_isError(n) && n == raw_len ? 0 : -1;
+    }
+#endif
+    default:
+        (void)src; (void)len; (void)dst; (void)raw_len;
+        return -1;
+    }
+}
+
+/* 分帧接收 [*pos, end) 并按原始偏移写入文件（dio 非空时写入对齐缓冲）；
+   checksum 时校验失败的块不写入，*pos 停在该块起点。run 非空时把写入部分的 CRC32C 接在 *run 之后 */
+int recv_frames_to_file(int sock, int fd, uint64_t *pos, uint64_t end, int checksum, struct direct_io *dio,
+                        uint32_t *run) {
+    char *buf = frame_buffers();
+    if (!buf) return -1;
+    char *raw = buf, *wire = buf + FRAME_BLOCK;
+    while (*pos < end) {
+        uint32_t hdr[4];
+        if (recv_all(sock, hdr, sizeof(hdr)) != sizeof(hdr)) return -1;
+        uint32_t codec = ntohl(hdr[0]), raw_len = ntohl(hdr[1]), wire_len = ntohl(hdr[2]);
+        if (raw_len == 0 || raw_len > FRAME_BLOCK || wire_len > FRAME_BLOCK || raw_len > end - *pos) {
+            fprintf(stderr, "bad frame header\n");
+            return -1;
+        }
+        if (codec == FRAME_RAW) {
+            if (wire_len != raw_len || recv_all(sock, raw, raw_len) != (ssize_t)raw_len) return -1;
+        } else if (recv_all(sock, wire, wire_len) != (ssize_t)wire_len ||
+                   codec_decompress((int)codec, wire, wire_len, raw, raw_len) != 0) {
+            fprintf(stderr, "frame decode failed (codec %u)\n", codec);
+            return -1;
+        }
+        uint32_t crc = checksum || run ? g_crc32c(0, raw, raw_len) : 0;
+        if (checksum && crc != ntohl(hdr[3])) {
+            fprintf(stderr, "crc mismatch in chunk at offset %" PRIu64 "\n", *pos);
+            __atomic_fetch_add(&g_crc_errors, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        if (dio ? direct_put(dio, raw, raw_len) != 0 : pwrite_all(fd, raw, raw_len, *pos) != 0) return -1;
+        frame_stats_add(&g_frames_recv[codec], raw_len, sizeof(hdr) + wire_len, 0, 0);
+        if (run) *run = crc32c_multmodp(crc32c_xpow(8ull * raw_len), *run) ^ crc;
+        *pos += raw_len;
+    }
+    return 0;
+}
+
+/* 自适应选码（CAP_LZ4 与 CAP_ZSTD 都协商出时）：候选按压缩程度排成 不压缩 -> LZ4 -> Zstd 1 -> Zstd 上档。
+   每 PICK_WINDOW 块评估一次：窗口结束时 socket 发送队列（SIOCOUTQ）仍积压说明链路（或对端）是瓶颈，
+   用窗口内实际流出的线上字节除以墙钟时间得到链路速率，对每个候选估计原始字节吞吐
+   min(压缩速度, 链路速率 / 压缩比)，取最大者，没试过的上一档先试一个窗口；
+   队列见底说明压缩跟不上链路，降一档。每 PICK_PROBE 块用相邻档位压一块，保持各档的压缩比与耗时是新的 */
+#define PICK_WINDOW 8
+#define PICK_PROBE 16
+#define PICK_MIN_GAIN 0.9          /* 线上字节 / 原始字节超过它就不值得压缩 */
+#define PICK_QUEUE_MIN (64 * 1024) /* 发送队列积压不少于此值视为链路占满 */
+#define PICK_ZSTD_LEVEL 6          /* 自适应时 Zstd 上档的默认级别 */
+#define PICK_EWMA 0.25
+
+enum { PICK_RAW, PICK_LZ4, PICK_ZSTD_FAST, PICK_ZSTD, PICK_CANDIDATES };
+
+struct codec_picker {
+    int fixed;                          /* >= 0：固定编码（-z lz4|zstd），-1：自适应 */
+    int fixed_level;
+    int zstd_level;
+    int cur;                            /* 当前档位 */
+    unsigned blocks;
+    unsigned win_blocks;
+    uint64_t win_start_ns, win_wire;
+    int win_outq;                       /* 窗口开始时的发送队列积压 */
+    int seen[PICK_CANDIDATES];
+    double ratio[PICK_CANDIDATES];      /* 线上字节 / 原始字节 */
+    double cpu_ns[PICK_CANDIDATES];     /* 每原始字节的压缩耗时 */
+};
+
+/* 按协商结果初始化：只有一种编码时固定使用它 */
+void picker_init(struct codec_picker *pk, const struct peer *peer) {
+    memset(pk, 0, sizeof(*pk));
+    int adaptive = (peer->caps & CAP_LZ4) && (peer->caps & CAP_ZSTD);
+    pk->fixed = adaptive ? -1 : peer_codec(peer) >= 0 ? peer_codec(peer) : FRAME_RAW;
+    pk->fixed_level = peer->level;
+    pk->zstd_level = peer->level > 1 ? peer->level : PICK_ZSTD_LEVEL;
+    pk->cur = PICK_LZ4;  // 从最便宜的压缩起步，头几块就能看出数据可压程度
+}
+
+int picker_codec(int cand) {
+    return cand == PICK_RAW ? FRAME_RAW : cand == PICK_LZ4 ? FRAME_LZ4 : FRAME_ZSTD;
+}
+
+int picker_level(const struct codec_picker *pk, int cand) {
+    return cand == PICK_ZSTD_FAST ? 1 : cand == PICK_ZSTD ? pk->zstd_level : 0;
+}
+
+int picker_choose(struct codec_picker *pk) {
+    if (++pk->blocks % PICK_PROBE != 0) return pk->cur;
+    // 抽样：交替试上一档和下一档（不压缩没有要测的）
+    int probe = (pk->blocks / PICK_PROBE) % 2 ? pk->cur + 1 : pk->cur - 1;
+    if (probe < PICK_LZ4 || probe >= PICK_CANDIDATES) probe = pk->cur + 1 < PICK_CANDIDATES ? pk->cur + 1 : pk->cur - 1;
+    return probe;
+}
+
+/* 发送队列中还没被对端确认的字节数 */
+int send_queue_bytes(int sock) {
+    int outq = 0;
+    if (ioctl(sock, SIOCOUTQ, &outq) != 0) outq = 0;
+    return outq;
+}
+
+void picker_update(struct codec_picker *pk, int sock, int cand, size_t raw, size_t wire, uint64_t cpu_ns) {
+    if (cand != PICK_RAW) {
+        double r = (double)wire / (double)raw, c = (double)cpu_ns / (double)raw;
+        pk->ratio[cand] = pk->seen[cand] ? pk->ratio[cand] + PICK_EWMA * (r - pk->ratio[cand]) : r;
+        pk->cpu_ns[cand] = pk->seen[cand] ? pk->cpu_ns[cand] + PICK_EWMA * (c - pk->cpu_ns[cand]) : c;
+        pk->seen[cand] = 1;
+    }
+    pk->win_wire += wire;
+    if (++pk->win_blocks < PICK_WINDOW) return;
+
+    uint64_t now = mono_ns();
+    int outq = send_queue_bytes(sock);
+    if (pk->win_start_ns == 0 || (outq >= PICK_QUEUE_MIN && pk->win_outq < PICK_QUEUE_MIN)) {
+        // 第一个窗口只建立起点；开始时队列没积压的窗口量不准链路速率，也不动
+    } else if (outq < PICK_QUEUE_MIN) {
+        if (pk->cur != PICK_RAW) pk->cur--;
+    } else if (pk->cur + 1 < PICK_CANDIDATES && !pk->seen[pk->cur + 1]) {
+        pk->cur++;
+    } else {
+        double drained = (double)pk->win_wire + pk->win_outq - outq;
+        double link = drained / (double)(now - pk->win_start_ns);  // 线上字节 / ns
+        int best = PICK_RAW;
+        double best_rate = link;
+        for (int i = PICK_LZ4; i < PICK_CANDIDATES; i++) {
+            if (!pk->seen[i] || pk->ratio[i] > PICK_MIN_GAIN) continue;
+            double rate = link / pk->ratio[i];
+            if (pk->cpu_ns[i] > 0 && 1.0 / pk->cpu_ns[i] < rate) rate = 1.0 / pk->cpu_ns[i];
+            if (rate > best_rate) {
+                best = i;
+                best_rate = rate;
+            }
+        }
+        pk->cur = best;
+    }
+    pk->win_blocks = 0;
+    pk->win_wire = 0;
+    pk->win_start_ns = now;
+    pk->win_outq = outq;
+}
+
+/* 分帧发送文件 [*pos, end)：每块按 picker 选编码，压不小就原样发。mem 非空时数据取自内存（热点缓存），不读 fd */
+int send_frames_from_file(int sock, int fd, uint64_t *pos, uint64_t end, const struct peer *peer,
+                          struct readahead *ra, struct direct_io *dio, const char *mem) {
+    char *buf = frame_buffers();
+    if (!buf) return -1;
+    char *raw = buf, *wire = buf + FRAME_BLOCK;
+    struct codec_picker pk;
+    picker_init(&pk, peer);
+    int checksum = (peer->caps & CAP_CHECKSUM) != 0;
+    while (*pos < end) {
+        ra_advance(ra, *pos);
+        size_t want = end - *pos > FRAME_BLOCK ? FRAME_BLOCK : (size_t)(end - *pos);
+        const char *data = mem ? mem + *pos : raw;
+        ssize_t n = mem ? (ssize_t)want : dio ? direct_read(dio, *pos, want, &data) : pread(fd, raw, want, (off_t)*pos);
+        if (n < 0 && !dio && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0 && !dio) perror("pread");  // direct_read 已报过错
+            return -1;  // 读错误或文件在传输中被截断
+        }
+        int cand = pk.fixed >= 0 ? -1 : picker_choose(&pk);
+        int codec = cand >= 0 ? picker_codec(cand) : pk.fixed;
+        int level = cand >= 0 ? picker_level(&pk, cand) : pk.fixed_level;
+        uint64_t t0 = mono_ns();
+        size_t wire_len = codec == FRAME_RAW ? 0 : codec_compress(codec, level, data, (size_t)n, wire, (size_t)n - 1);
+        uint64_t t1 = mono_ns();
+        int used = wire_len ? codec : FRAME_RAW;
+        if (!wire_len) wire_len = (size_t)n;
+        uint32_t crc = checksum ? g_crc32c(0, data, (size_t)n) : 0;
+        uint32_t hdr[4] = { htonl((uint32_t)used), htonl((uint32_t)n), htonl((uint32_t)wire_len), htonl(crc) };
+        if (send_all(sock, hdr, sizeof(hdr)) != sizeof(hdr) ||
+            send_all(sock, used == FRAME_RAW ? data : wire, wire_len) != (ssize_t)wire_len) return -1;
+        frame_stats_add(&g_frames_sent[codec], (uint64_t)n, sizeof(hdr) + wire_len, codec != used, t1 - t0);
+        if (cand >= 0) picker_update(&pk, sock, cand, (size_t)n, wire_len, t1 - t0);
+        *pos += (uint64_t)n;
+    }
+    return 0;
+}
+
+/* 下载的数据阶段：分帧时逐帧更新提示，否则按半个预读窗口分段交给 send_from_file（peer 为 NULL 表示不分帧）；
+   dio 非空时经对齐缓冲读文件，不做页缓存提示 */
+int send_download(int sock, int fd, uint64_t *pos, uint64_t end, const struct peer *peer,
+                  struct readahead *ra, struct direct_io *dio) {
+    if (peer && peer_framed(peer)) return send_frames_from_file(sock, fd, pos, end, peer, ra, dio, NULL);
+    if (dio) return send_direct(sock, dio, pos, end);
+    uint64_t step = ra && ra->fd >= 0 && g_cfg.readahead >= 2 ? g_cfg.readahead / 2 : UINT64_MAX;
+    while (*pos < end) {
+        ra_advance(ra, *pos);
+        uint64_t stop = end - *pos > step ? *pos + step : end;
+        if (send_from_file(sock, fd, pos, stop) != 0) return -1;
+    }
+    return 0;
+}
+
+/* 读回文件 [start, end) 算 CRC32C（dio 非空时经对齐缓冲读） */
+int file_crc32c(int fd, uint64_t start, uint64_t end, struct direct_io *dio, uint32_t *crc) {
+    char *buf = dio ? NULL : frame_buffers();
+    if (!dio && !buf) return -1;
+    if (dio) dio->len = 0;  // 缓冲里可能还是写出尾部时补的零
+    uint32_t c = 0;
+    for (uint64_t pos = start; pos < end; ) {
+        size_t want = end - pos > FRAME_BLOCK ? FRAME_BLOCK : (size_t)(end - pos);
+        const char *data = buf;
+        ssize_t n = dio ? direct_read(dio, pos, want, &data) : pread(fd, buf, want, (off_t)pos);
+        if (n < 0 && !dio && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0 && !dio) perror("pread");
+            else if (n == 0) fprintf(stderr, "file shrank while computing digest\n");
+            return -1;
+        }
+        c = g_crc32c(c, data, (size_t)n);
+        pos += (uint64_t)n;
+    }
+    *crc = c;
+    return 0;
+}
+
+/* 6) 上传确认（CAP_ACK）：发布已落盘之后回 uint64_t filesize, uint32_t 整个文件的 CRC32C。
+   续传前的前缀 [0, start) 有续传校验留下的树时由叶子拼出，只读回不到一块的零头；
+   body 是本次收到的 [start, filesize) 接收时算好的 CRC（分帧时由各帧 CRC 拼成），不再读回 */
+int send_upload_ack(int sock, const char *filename, const struct staging *s, uint64_t filesize,
+                    uint64_t start, uint32_t body, struct direct_io *dio) {
+    int fd = s->fd;
+    enum origin origin = s->origin;
+    struct stat st = s->origin_st;
+    if (fd < 0) {
+        // 目标本来就完整：它就是前缀的来源
+        if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+            perror("open for upload ack");
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        origin = ORIGIN_FILE;
+    }
+    uint64_t covered;
+    uint32_t crc = tree_prefix_crc(filename, origin, &st, start, &covered), rest;
+    int rc = file_crc32c(fd, covered, start, s->fd >= 0 ? dio : NULL, &rest);
+    if (fd != s->fd) close(fd);
+    if (rc != 0) return -1;
+    crc = crc32c_multmodp(crc32c_xpow(8 * (start - covered)), crc) ^ rest;
+    crc = crc32c_multmodp(crc32c_xpow(8 * (filesize - start)), crc) ^ body;
+    uint64_t size_net = htonll(filesize);
+    uint32_t crc_net = htonl(crc);
+    char ack[12];
+    memcpy(ack, &size_net, 8);
+    memcpy(ack + 8, &crc_net, 4);
+    return send_all(sock, ack, sizeof(ack)) == sizeof(ack) ? 0 : -1;
+}
+
+/* 5b) 修补（CAP_REPAIR）：尾部数据之后客户端发来若干 uint64_t start, uint64_t len 与 len 字节数据，len 为 0 结束。
+   都是续传校验发现的坏区间，只能落在续传前的前缀 [0, agreed) 之内；写进暂存文件，随后与尾部一起发布，
+   目标本来就完整（没有暂存）时先把它整个复制成暂存，发布前对外可见的文件始终不变 */
+int recv_repairs(int sock, const char *filename, struct staging *s, uint64_t agreed) {
+    while (1) {
+        uint64_t rec[2];
+        if (recv_all(sock, rec, sizeof(rec)) != sizeof(rec)) return -1;
+        uint64_t pos = ntohll(rec[0]), len = ntohll(rec[1]), start = pos;
+        if (len == 0) return 0;
+        if (pos > agreed || len > agreed - pos) {
+            fprintf(stderr, "repair: %s range %" PRIu64 "+%" PRIu64 " beyond %" PRIu64 "\n", filename, pos, len, agreed);
+            return -1;
+        }
+        if (s->fd < 0 && staging_open(filename, s->filesize, s, 1) != 0) return -1;
+        int flags = fcntl(s->fd, F_GETFL);
+        if (flags >= 0 && (flags & O_DIRECT) && fcntl(s->fd, F_SETFL, flags & ~O_DIRECT) != 0) {
+            perror("fcntl");  // 坏区间的末尾不一定对齐，改回页缓存写
+            return -1;
+        }
+        if (recv_to_file(sock, s->fd, &pos, start + len, NULL) != 0) return -1;
+        tree_refresh(filename, s->fd, start, start + len);
+    }
+}
+
+/* 处理上传：写入暂存文件，从已提交位置续传到 filesize 后发布；协商了压缩时数据是分帧的 */
+int handle_upload(int sock, const char *filename, uint64_t filesize, const struct peer *peer) {
+    // 4) S->C: agreed_offset（暂存文件的已提交位置，见 staging_open）
+    struct staging s;
+    if (staging_open(filename, filesize, &s, 0) != 0) return 1;
+    int rc = -1, published = 0;
+    struct direct_io dio, *d = NULL;
+    uint64_t received = s.committed, start = s.committed;
+    uint32_t body = 0, *run = peer->caps & CAP_ACK ? &body : NULL;
+    uint64_t net_agreed = htonll(received);
+    if (send_all(sock, &net_agreed, sizeof(net_agreed)) != sizeof(net_agreed)) goto out;
+    if (s.fd >= 0 && direct_open(&dio, s.fd) == 0) {
+        d = &dio;
+        if (direct_write_start(d, received) != 0) goto out;
+    }
+
+    // 5) 接收 [agreed, filesize) 的数据，每 STAGING_COMMIT_INTERVAL 提交一次，断开时提交已收到的部分。
+    //    直接 I/O 时对齐缓冲里还没写出的部分不算提交
+    while (received < filesize) {
+        uint64_t stop = filesize - received > STAGING_COMMIT_INTERVAL ? received + STAGING_COMMIT_INTERVAL : filesize;
+        int r = peer_framed(peer) ? recv_frames_to_file(sock, s.fd, &received, stop, (peer->caps & CAP_CHECKSUM) != 0, d, run)
+              : d                 ? recv_direct(sock, d, &received, stop, run)
+                                  : recv_to_file(sock, s.fd, &received, stop, run);
+        if (r != 0) goto out;
+        if (received < filesize && staging_commit(&s, d ? d->base : received) != 0) goto out;
+    }
+    if (d && direct_write_tail(d) != 0) goto out;
+    if ((peer->caps & CAP_REPAIR) && recv_repairs(sock, filename, &s, start) != 0) goto out;
+    if (s.fd >= 0 && staging_publish(filename, &s) != 0) goto out;
+    published = 1;
+    rc = peer->caps & CAP_ACK ? send_upload_ack(sock, filename, &s, filesize, start, body, d) : 0;
+
+out:
+    tree_drop();
+    if (!published && s.fd >= 0) {
+        if (d && direct_write_tail(d) != 0) received = d->base;
+        staging_commit(&s, received);
+    }
+    staging_close(&s);
+    return rc;
+}
+
+/* ---------------- 增量上传 ----------------
+ * 服务端把旧文件按块发签名 {rsync 式滚动弱校验, CRC32C}，客户端只发字面数据和块引用；
+ * 重建写到 <filename>.delta.<线程号>.<序号>，整个新文件的 CRC32C 校验通过后 fsync 并改名覆盖，失败时旧文件不动。 */
+#define DELTA_END     0   /* uint32_t crc */
+#define DELTA_COPY    1   /* uint32_t count, uint64_t index */
+#define DELTA_LITERAL 2   /* uint32_t len, len 字节 */
+#define DELTA_LITERAL_MAX FRAME_BLOCK
+#define DELTA_SIG_BATCH 4096   /* 签名每攒这么多条发一次 */
+
+/* 弱校验：a 为字节和，b 为按位置加权和，各取低 16 位，与客户端的滚动计算一致 */
+uint32_t delta_weak(const unsigned char *p, size_t len) {
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++) {
+        s1 += p[i];
+        s2 += s1;
+    }
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+/* 块大小取约 sqrt(旧文件大小) 的 2 的幂，限制在 [2KB, 64KB]：签名总量与匹配粒度折中 */
+uint32_t delta_block_size(uint64_t old_size) {
+    uint32_t block = 2048;
+    while (block < 65536 && (uint64_t)block * block < old_size) block <<= 1;
+    return block;
+}
+
+/* 发送旧文件的块签名：old_size, block, nblocks 与 nblocks 个 {weak, crc}；strong 同时留给重建时算整体 CRC */
+int send_delta_sigs(int sock, int fd, uint64_t old_size, uint32_t block, uint32_t **strong) {
+    uint64_t n64 = old_size / block;
+    uint32_t nblocks = n64 > UINT32_MAX ? UINT32_MAX : (uint32_t)n64;
+    uint64_t size_net = htonll(old_size);
+    uint32_t shape[2] = { htonl(block), htonl(nblocks) };
+    char hdr[16];
+    memcpy(hdr, &size_net, 8);
+    memcpy(hdr + 8, shape, 8);
+    if (send_all(sock, hdr, sizeof(hdr)) != sizeof(hdr)) return -1;
+
+    unsigned char *buf = malloc(block);
+    uint32_t *batch = malloc(2 * DELTA_SIG_BATCH * sizeof(uint32_t));
+    *strong = malloc((size_t)nblocks * sizeof(uint32_t) + 1);
+    int rc = -1;
+    if (!buf || !batch || !*strong) goto out;
+    size_t n = 0;
+    for (uint32_t i = 0; i < nblocks; i++) {
+        for (size_t got = 0; got < block; ) {
+            ssize_t r = pread(fd, buf + got, block - got, (off_t)((uint64_t)i * block + got));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                fprintf(stderr, "delta: read failed or file shrank\n");
+                goto out;
+            }
+            got += (size_t)r;
+        }
+        (*strong)[i] = g_crc32c(0, buf, block);
+        batch[2 * n] = htonl(delta_weak(buf, block));
+        batch[2 * n + 1] = htonl((*strong)[i]);
+        if (++n == DELTA_SIG_BATCH || i + 1 == nblocks) {
+            if (send_all(sock, batch, n * 2 * sizeof(uint32_t)) != (ssize_t)(n * 2 * sizeof(uint32_t))) goto out;
+            n = 0;
+        }
+    }
+    rc = 0;
+
+out:
+    free(buf);
+    free(batch);
+    return rc;
+}
+
+/* 增量上传：发签名后按指令流重建到临时文件，结束时比对大小和整体 CRC32C，
+   通过则 fsync + rename 并回复新大小，否则删掉临时文件回 REPLY_ERROR（连接仍可用） */
+int handle_upload_delta(int sock, const char *filename, uint64_t filesize) {
+    static unsigned seq;
+    char tmp[1024];
+    // 临时文件名带线程号和序号并以 O_EXCL 创建：并发的增量上传互不覆盖，也不会截断用户自己的 x.delta
+    if (snprintf(tmp, sizeof(tmp), "%s.delta.%ld.%u", filename, (long)syscall(SYS_gettid),
+                 __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED)) >= (int)sizeof(tmp)) return 1;
+    uint64_t old_size = 0;
+    int old_fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (old_fd < 0 && errno != ENOENT) {
+        perror("open");
+        return 1;
+    }
+    if (old_fd >= 0) {
+        if (fstat(old_fd, &st) != 0) {
+            perror("fstat");
+            close(old_fd);
+            return 1;
+        }
+        old_size = (uint64_t)st.st_size;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        perror("open delta");
+        if (old_fd >= 0) close(old_fd);
+        return 1;
+    }
+
+    int rc = -1;
+    uint32_t *strong = NULL;
+    char *buf = malloc(DELTA_LITERAL_MAX);
+    uint32_t block = delta_block_size(old_size);
+    if (!buf || send_delta_sigs(sock, old_fd, old_size, block, &strong) != 0) goto out;
+    uint32_t nblocks = (uint32_t)(old_size / block > UINT32_MAX ? UINT32_MAX : old_size / block);
+    uint32_t block_shift = crc32c_xpow(8ull * block);  // 整体 CRC 后接一块：crc * x^(8 * block) ^ 块 CRC
+
+    uint64_t pos = 0;
+    uint32_t crc = 0;
+    while (1) {
+        uint32_t op[2];
+        if (recv_all(sock, op, sizeof(op)) != sizeof(op)) goto out;
+        uint32_t type = ntohl(op[0]), arg = ntohl(op[1]);
+        if (type == DELTA_END) {
+            uint64_t reply = htonll(filesize);
+            if (pos != filesize || crc != arg) {
+                fprintf(stderr, "delta: %s rebuilt %" PRIu64 " bytes, crc %08x, expected %" PRIu64 " bytes, crc %08x\n",
+                        filename, pos, crc, filesize, arg);
+                reply = REPLY_ERROR;
+            } else if (durable_rename(fd, tmp, filename) != 0) {
+                fprintf(stderr, "delta publish: %s failed\n", filename);
+                reply = REPLY_ERROR;
+            }
+            if (reply == REPLY_ERROR) unlink(tmp);  // 临时名只属于本次上传，已改名时这里什么也不删
+            tmp[0] = '\0';
+            cache_invalidate(filename);  // 改名后目录 fsync 失败时文件也已换掉
+            rc = send_all(sock, &reply, sizeof(reply)) == sizeof(reply) ? 0 : -1;
+            break;
+        }
+        if (type == DELTA_COPY) {
+            uint64_t idx_net;
+            if (recv_all(sock, &idx_net, sizeof(idx_net)) != sizeof(idx_net)) goto out;
+            uint64_t idx = ntohll(idx_net);
+            if (arg == 0 || idx > nblocks || arg > nblocks - idx || pos + (uint64_t)arg * block > filesize) goto out;
+            if (copy_range(old_fd, idx * block, fd, pos, (uint64_t)arg * block, buf, DELTA_LITERAL_MAX) != 0) goto out;
+            for (uint32_t i = 0; i < arg; i++) crc = crc32c_multmodp(block_shift, crc) ^ strong[idx + i];
+            pos += (uint64_t)arg * block;
+        } else if (type == DELTA_LITERAL) {
+            if (arg == 0 || arg > DELTA_LITERAL_MAX || pos + arg > filesize) goto out;
+            if (recv_all(sock, buf, arg) != (ssize_t)arg) goto out;
+            if (pwrite_all(fd, buf, arg, pos) != 0) goto out;
+            crc = g_crc32c(crc, buf, arg);
+            pos += arg;
+        } else {
+            goto out;
+        }
+    }
+
+out:
+    if (rc != 0 && tmp[0]) unlink(tmp);
+    free(buf);
+    free(strong);
+    close(fd);
+    if (old_fd >= 0) close(old_fd);
+    return rc;
+}
+
+/* 批量上传的文件名：拒绝绝对路径和 ".." 分量，拼在目标目录 dir 下 */
+int bulk_path(const char *dir, const char *name, char *path, size_t path_len) {
+    if (name[0] == '/' || strcmp(name, "..") == 0 || strncmp(name, "../", 3) == 0 ||
+        strstr(name, "/../") != NULL || (strlen(name) >= 3 && strcmp(name + strlen(name) - 3, "/..") == 0)) {
+        fprintf(stderr, "bulk: rejected name %s\n", name);
+        return -1;
+    }
+    int n = snprintf(path, path_len, "%s/%s", dir, name);
+    return n > 0 && (size_t)n < path_len ? 0 : -1;
+}
+
+/* 批量上传的落盘：每个文件先写进同目录下的临时文件 <path>.<序号>.bulk，写完的先留着描述符，
+ * 攒满 BULK_BATCH 个一起交给 durable_sync_many（同属一组提交），落盘后逐个改名发布，下载方看不到写了一半的文件。
+ * 涉及的目录（文件所在目录、新建目录的父目录）记下来，请求结束时再一起落盘，改名随之持久（相当于把一批
+ * durable_rename 的目录 fsync 合并成每个目录一次）。只同步本次写入的文件和目录，不牵连其它连接的脏数据 */
+#define BULK_BATCH 64
+
+struct bulk_file {
+    int fd;
+    char *tmp, *path;  /* 各自 malloc */
+};
+
+struct bulk_batch {
+    int n;
+    struct bulk_file files[BULK_BATCH];  /* 写完待落盘、改名的文件 */
+    struct bulk_file cur;  /* 正在接收的文件（tmp 为 NULL 表示没有），描述符归调用方 */
+    int ndirs, dcap;
+    char **dirs;  /* 去重后的目录路径，各自 malloc */
+    int *dslots;  /* 开放寻址的去重表，2 * dcap 个槽，存 dirs 下标 + 1，0 表示空 */
+};
+
+/* dir 在去重表中的槽：已记过时是它所在的槽，否则是可以放它的空槽（要求 dcap > 0） */
+int *bulk_dir_slot(struct bulk_batch *b, const char *dir) {
+    uint32_t mask = (uint32_t)b->dcap * 2 - 1, h = name_hash(dir) & mask;
+    while (b->dslots[h] && strcmp(b->dirs[b->dslots[h] - 1], dir) != 0) h = (h + 1) & mask;
+    return &b->dslots[h];
+}
+
+/* 记下一个要落盘的目录（已记过的跳过）。文件按遍历顺序到达，大多与上一个同目录，先比上一个再查表 */
+int bulk_add_dir(struct bulk_batch *b, const char *path) {
+    char dir[1024];
+    path_dir(path, dir, sizeof(dir));
+    if (b->ndirs && strcmp(b->dirs[b->ndirs - 1], dir) == 0) return 0;
+    if (b->dcap && *bulk_dir_slot(b, dir)) return 0;
+    if (b->ndirs == b->dcap) {
+        int cap = b->dcap ? b->dcap * 2 : 16;
+        char **dirs = realloc(b->dirs, (size_t)cap * sizeof(*dirs));
+        if (!dirs) return -1;
+        b->dirs = dirs;
+        int *slots = calloc((size_t)cap * 2, sizeof(*slots));
+        if (!slots) return -1;
+        free(b->dslots);
+        b->dslots = slots;
+        b->dcap = cap;
+        for (int i = 0; i < b->ndirs; i++) *bulk_dir_slot(b, b->dirs[i]) = i + 1;
+    }
+    if (!(b->dirs[b->ndirs] = strdup(dir))) return -1;
+    *bulk_dir_slot(b, dir) = ++b->ndirs;
+    return 0;
+}
+
+/* 打开要整个重写的文件：按需逐级创建父目录（新建的目录记进批次 b，可为 NULL），截断已有内容（批量模式不做续传） */
+int open_bulk_file(char *path, struct bulk_batch *b) {
+    for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int r = mkdir(path, 0777);
+        if (r == 0 && b && bulk_add_dir(b, path) != 0) r = -1;
+        *p = '/';
+        if (r != 0 && errno != EEXIST) {
+            perror("mkdir");
+            return -1;
+        }
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) perror("open");
+    return fd;
+}
+
+void bulk_file_free(struct bulk_file *f, int unlink_tmp) {
+    if (unlink_tmp && f->tmp) unlink(f->tmp);
+    free(f->tmp);
+    free(f->path);
+    f->tmp = f->path = NULL;
+}
+
+/* 让攒下的文件落盘，改名发布并关闭；失败时这一批的临时文件都删掉 */
+int bulk_flush_files(struct bulk_batch *b) {
+    int fds[BULK_BATCH];
+    for (int i = 0; i < b->n; i++) fds[i] = b->files[i].fd;
+    int rc = durable_sync_many(fds, b->n);
+    for (int i = 0; i < b->n; i++) {
+        struct bulk_file *f = &b->files[i];
+        close(f->fd);
+        if (rc == 0 && rename(f->tmp, f->path) != 0) {
+            perror("rename");
+            rc = -1;
+        }
+        if (rc == 0) cache_invalidate(f->path);
+        bulk_file_free(f, rc != 0);
+    }
+    b->n = 0;
+    return rc;
+}
+
+/* 开始接收 path：按需建父目录，打开临时文件，返回描述符（失败 -1） */
+int bulk_begin_file(struct bulk_batch *b, const char *path) {
+    static uint64_t seq;
+    char tmp[1100];
+    int n = snprintf(tmp, sizeof(tmp), "%s.%" PRIu64 ".bulk", path, __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+    if (n < 0 || (size_t)n >= sizeof(tmp)) return -1;
+    int fd = open_bulk_file(tmp, b);
+    if (fd < 0) return -1;
+    b->cur.tmp = strdup(tmp);
+    b->cur.path = strdup(path);
+    if (!b->cur.tmp || !b->cur.path) {
+        close(fd);
+        unlink(tmp);
+        bulk_file_free(&b->cur, 0);
+        return -1;
+    }
+    return fd;
+}
+
+/* 当前文件写完：交给批次，攒满时落盘、发布一批 */
+int bulk_add_file(struct bulk_batch *b, int fd) {
+    struct bulk_file *f = &b->files[b->n++];
+    *f = b->cur;
+    f->fd = fd;
+    b->cur.tmp = b->cur.path = NULL;
+    if (bulk_add_dir(b, f->path) != 0) return -1;
+    return b->n == BULK_BATCH ? bulk_flush_files(b) : 0;
+}
+
+/* 请求结束：剩下的文件落盘、发布，再让记下的目录落盘（目录项指向的数据此时都已落盘） */
+int bulk_sync(struct bulk_batch *b) {
+    int rc = bulk_flush_files(b);
+    if (rc != 0 || g_cfg.durability == DURABLE_NONE) return rc;
+    int *fds = calloc((size_t)b->ndirs + 1, sizeof(int)), n = 0;
+    if (!fds) return -1;
+    for (int i = 0; i < b->ndirs; i++) {
+        fds[n] = open(b->dirs[i], O_RDONLY | O_DIRECTORY);
+        if (fds[n] < 0) {
+            perror("open dir");
+            rc = -1;
+            continue;
+        }
+        n++;
+    }
+    if (durable_sync_many(fds, n) != 0) rc = -1;
+    for (int i = 0; i < n; i++) close(fds[i]);
+    free(fds);
+    return rc;
+}
+
+/* 释放批次：关闭未发布的文件并删掉它们的临时文件，丢掉目录表 */
+void bulk_discard(struct bulk_batch *b) {
+    for (int i = 0; i < b->n; i++) {
+        close(b->files[i].fd);
+        bulk_file_free(&b->files[i], 1);
+    }
+    bulk_file_free(&b->cur, 1);
+    for (int i = 0; i < b->ndirs; i++) free(b->dirs[i]);
+    free(b->dirs);
+    free(b->dslots);
+    memset(b, 0, sizeof(*b));
+}
+
+/* 批量上传：一个请求里连续接收 (uint32_t name_len, name, uint64_t size, data) 记录，
+   name_len 为 0 表示结束；边收边写临时文件，写完的文件按批落盘后改名发布，最后让剩下的文件和目录落盘并回复写入的文件数。
+   目标目录由请求的 filename 字段给出 */
+int handle_upload_bulk(int sock, const char *dir) {
+    char name[512], path[1024];
+    uint64_t count = 0;
+    struct bulk_batch batch = { 0 };
+    int rc = -1;
+    if (bulk_path(".", dir, path, sizeof(path)) != 0) return -1;  // 后面的记录无法跳过，只能断开
+    while (1) {
+        uint32_t name_len_net;
+        if (recv_all(sock, &name_len_net, sizeof(name_len_net)) != sizeof(name_len_net)) goto out;
+        uint32_t name_len = ntohl(name_len_net);
+        if (name_len == 0) break;
+        if (name_len >= sizeof(name)) goto out;
+        if (recv_all(sock, name, name_len) != (ssize_t)name_len) goto out;
+        name[name_len] = '\0';
+        uint64_t size_net;
+        if (recv_all(sock, &size_net, sizeof(size_net)) != sizeof(size_net)) goto out;
+
+        if (bulk_path(dir, name, path, sizeof(path)) != 0) goto out;
+        int fd = bulk_begin_file(&batch, path);
+        if (fd < 0) goto out;
+        uint64_t pos = 0;
+        if (recv_to_file(sock, fd, &pos, ntohll(size_net), NULL) != 0) {
+            close(fd);
+            goto out;
+        }
+        if (bulk_add_file(&batch, fd) != 0) goto out;
+        count++;
+    }
+    if (bulk_sync(&batch) != 0) goto out;
+    uint64_t net_count = htonll(count);
+    rc = send_all(sock, &net_count, sizeof(net_count)) == sizeof(net_count) ? 0 : -1;
+
+out:
+    bulk_discard(&batch);
+    return rc;
+}
+
+/* ---------------- 去重存储 ----------------
+ * 服务端以 -D <dir> 启动时声明 CAP_DEDUP。客户端用 FastCDC 按内容切块，先发块列表 {SHA-256, 长度}，
+ * 服务端只要回自己没有的块；块存为 <dir>/chunks/<前两位>/<sha256>，文件变成
+ * <dir>/files/<filename> 下的清单（块引用列表）。下载时普通文件不存在就按清单拼出数据。
+ * 块从不删除，清单被覆盖后不再引用的块需要离线清理。 */
+#define MANIFEST_MAGIC 0x46544d31u   /* "FTM1" */
+#define DEDUP_MIN_CHUNK (16 * 1024)   /* 与客户端 FastCDC 的最小块一致：除最后一块外每块不小于此值 */
+#define DEDUP_MAX_CHUNKS (1u << 20)   /* 一个文件最多的块数（块列表连同排序约 48MB），更多时客户端改走普通上传 */
+#define DEDUP_MAX_CHUNK (256 * 1024)  /* 与客户端 FastCDC 的最大块一致 */
+#define DEDUP_REF_LEN (SHA256_LEN + 4) /* 线上与清单中的一条块引用：SHA-256 + uint32_t 长度 */
+#define DEDUP_SYNC_BATCH 64           /* 新块攒够这么多就一起 fsync 后改名 */
+
+static uint64_t g_dedup_stored, g_dedup_stored_bytes;   /* 新写入的块 */
+static uint64_t g_dedup_reused, g_dedup_reused_bytes;   /* 已有而免传的块 */
+
+uint32_t ref_len(const unsigned char *ref) {
+    uint32_t len;
+    memcpy(&len, ref + SHA256_LEN, sizeof(len));
+    return ntohl(len);
+}
+
+int chunk_path(const unsigned char *hash, char *path, size_t path_len) {
+    char hex[2 * SHA256_LEN + 1];
+    for (int i = 0; i < SHA256_LEN; i++) snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+    int n = snprintf(path, path_len, "%s/chunks/%.2s/%s", g_cfg.store, hex, hex);
+    return n > 0 && (size_t)n < path_len ? 0 : -1;
+}
+
+/* 建好存储目录：chunks/00 ~ chunks/ff 与 files */
+int store_init(const char *dir) {
+    char path[1024];
+    const char *subdirs[] = { "", "/chunks", "/files" };
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s%s", dir, subdirs[i]);
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            perror(path);
+            return -1;
+        }
+    }
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), "%s/chunks/%02x", dir, i);
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            perror(path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* 库里已有完整的这一块：按长度核对，旧版本崩溃后留下的残块长度对不上，当作没有重新收 */
+int chunk_present(const unsigned char *ref) {
+    char path[1024];
+    struct stat st;
+    return chunk_path(ref, path, sizeof(path)) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+           (uint64_t)st.st_size == ref_len(ref);
+}
+
+/* 新块先写到 <块路径>.<线程号>，攒一批一起 fsync 后再改名：块一出现在库里就是完整的，
+ * 后续上传按它去重才安全。改名涉及的 chunks/xx 子目录记在 dirs 位图里，写清单前统一落盘 */
+struct chunk_batch {
+    int n;
+    int fds[DEDUP_SYNC_BATCH];
+    unsigned char hash[DEDUP_SYNC_BATCH][SHA256_LEN];
+    unsigned char dirs[256 / 8];
+};
+
+int chunk_tmp_path(const unsigned char *hash, char *tmp, size_t tmp_len) {
+    char path[1024];
+    if (chunk_path(hash, path, sizeof(path)) != 0) return -1;
+    int n = snprintf(tmp, tmp_len, "%s.%ld", path, (long)syscall(SYS_gettid));
+    return n > 0 && (size_t)n < tmp_len ? 0 : -1;
+}
+
+/* 落盘并改名批里的块；失败时删掉批里全部临时文件 */
+int store_flush_chunks(struct chunk_batch *b) {
+    int rc = durable_sync_many(b->fds, b->n);
+    for (int i = 0; i < b->n; i++) {
+        char path[1024], tmp[1100];
+        close(b->fds[i]);
+        chunk_path(b->hash[i], path, sizeof(path));
+        chunk_tmp_path(b->hash[i], tmp, sizeof(tmp));
+        if (rc == 0 && rename(tmp, path) != 0) {
+            perror("rename chunk");
+            rc = -1;
+        }
+        if (rc != 0) unlink(tmp);
+        else b->dirs[b->hash[i][0] / 8] |= (unsigned char)(1u << (b->hash[i][0] % 8));
+    }
+    b->n = 0;
+    return rc;
+}
+
+int store_put_chunk(struct chunk_batch *b, const unsigned char *hash, const char *data, size_t len) {
+    char tmp[1100];
+    if (chunk_tmp_path(hash, tmp, sizeof(tmp)) != 0) return -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("open chunk");
+        return -1;
+    }
+    if (pwrite_all(fd, data, len, 0) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    b->fds[b->n] = fd;
+    memcpy(b->hash[b->n], hash, SHA256_LEN);
+    b->n++;
+    return b->n == DEDUP_SYNC_BATCH ? store_flush_chunks(b) : 0;
+}
+
+/* 出错时丢掉批里还没改名的块 */
+void store_discard_chunks(struct chunk_batch *b) {
+    for (int i = 0; i < b->n; i++) {
+        char tmp[1100];
+        close(b->fds[i]);
+        if (chunk_tmp_path(b->hash[i], tmp, sizeof(tmp)) == 0) unlink(tmp);
+    }
+    b->n = 0;
+}
+
+/* 改名过块的子目录一起落盘，之后写的清单引用的块在崩溃后一定还在 */
+int store_sync_dirs(struct chunk_batch *b) {
+    int fds[256], n = 0, rc = 0;
+    for (int i = 0; i < 256; i++) {
+        if (!(b->dirs[i / 8] & (1u << (i % 8)))) continue;
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s/chunks/%02x", g_cfg.store, i);
+        fds[n] = open(dir, O_RDONLY | O_DIRECTORY);
+        if (fds[n] < 0) {
+            perror("open chunk dir");
+            rc = -1;
+            continue;
+        }
+        n++;
+    }
+    if (durable_sync_many(fds, n) != 0) rc = -1;
+    for (int i = 0; i < n; i++) close(fds[i]);
+    return rc;
+}
+
+int ref_cmp(const void *a, const void *b, void *refs) {
+    return memcmp((const unsigned char *)refs + *(const uint64_t *)a * DEDUP_REF_LEN,
+                  (const unsigned char *)refs + *(const uint64_t *)b * DEDUP_REF_LEN, SHA256_LEN);
+}
+
+int u32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* 写清单：临时文件 fsync 后改名，清单出现时它引用的块都已落盘。
+ * 临时名带线程号，同名文件的并发去重上传不会写进同一个临时文件 */
+int write_manifest(const char *path, uint64_t filesize, const unsigned char *refs, uint64_t n) {
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)syscall(SYS_gettid));
+    int fd = open_bulk_file(tmp, NULL);
+    if (fd < 0) return -1;
+    unsigned char hdr[24];
+    uint32_t magic = htonl(MANIFEST_MAGIC), pad = 0;
+    uint64_t size_net = htonll(filesize), n_net = htonll(n);
+    memcpy(hdr, &magic, 4);
+    memcpy(hdr + 4, &pad, 4);
+    memcpy(hdr + 8, &size_net, 8);
+    memcpy(hdr + 16, &n_net, 8);
+    int rc = pwrite_all(fd, hdr, sizeof(hdr), 0) == 0 && pwrite_all(fd, refs, n * DEDUP_REF_LEN, sizeof(hdr)) == 0 &&
+             durable_rename(fd, tmp, path) == 0 ? 0 : -1;
+    close(fd);
+    if (rc != 0) {
+        fprintf(stderr, "write manifest: %s failed\n", path);
+        unlink(tmp);
+    }
+    return rc;
+}
+
+/* 去重上传：收块列表，回复缺少的块序号，收这些块（校验 SHA-256 后入库），最后写清单。
+   同名普通文件会被删除，以清单为准。成功回 filesize，块校验失败或写入失败回 REPLY_ERROR */
+int handle_upload_dedup(int sock, const char *filename, uint64_t filesize, uint64_t nchunks) {
+    // 块数先受绝对上限约束（也保证块序号放得进 uint32_t），再受声明的大小约束，收到块列表之前不按声明分配
+    if (!g_cfg.store || nchunks > DEDUP_MAX_CHUNKS || nchunks > filesize / DEDUP_MIN_CHUNK + 1) return -1;
+    int rc = -1;
+    struct chunk_batch batch;
+    memset(&batch, 0, sizeof(batch));
+    unsigned char *refs = malloc(nchunks * DEDUP_REF_LEN + 1);
+    uint64_t *order = malloc(nchunks * sizeof(*order) + 1);
+    uint32_t *need = malloc(nchunks * sizeof(*need) + 1);
+    char *buf = malloc(DEDUP_MAX_CHUNK);
+    if (!refs || !order || !need || !buf) goto out;
+    if (recv_all(sock, refs, nchunks * DEDUP_REF_LEN) != (ssize_t)(nchunks * DEDUP_REF_LEN)) goto out;
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < nchunks; i++) {
+        uint32_t len = ref_len(refs + i * DEDUP_REF_LEN);
+        if (len == 0 || len > DEDUP_MAX_CHUNK || (len < DEDUP_MIN_CHUNK && i + 1 < nchunks)) goto out;
+        total += len;
+    }
+    if (total != filesize) goto out;
+
+    char files_dir[1024], manifest[2048];
+    snprintf(files_dir, sizeof(files_dir), "%s/files", g_cfg.store);
+    if (bulk_path(files_dir, filename, manifest, sizeof(manifest)) != 0) {
+        rc = 1;
+        goto out;
+    }
+
+    // 同一文件内重复的块只要一次：按哈希排序后相邻比较；库里已有的块不要
+    for (uint64_t i = 0; i < nchunks; i++) order[i] = i;
+    qsort_r(order, nchunks, sizeof(*order), ref_cmp, refs);
+    uint64_t nneed = 0;
+    for (uint64_t k = 0; k < nchunks; k++) {
+        const unsigned char *ref = refs + order[k] * DEDUP_REF_LEN;
+        int dup = k > 0 && memcmp(ref, refs + order[k - 1] * DEDUP_REF_LEN, SHA256_LEN) == 0;
+        if (dup || chunk_present(ref)) {
+            __atomic_fetch_add(&g_dedup_reused, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&g_dedup_reused_bytes, ref_len(ref), __ATOMIC_RELAXED);
+            continue;
+        }
+        need[nneed++] = (uint32_t)order[k];
+    }
+    qsort(need, nneed, sizeof(*need), u32_cmp);  // 缺少的块按文件中的顺序要，客户端顺序读文件
+    uint64_t nneed_net = htonll(nneed);
+    if (send_all(sock, &nneed_net, sizeof(nneed_net)) != sizeof(nneed_net)) goto out;
+    for (uint64_t i = 0; i < nneed; i++) need[i] = htonl(need[i]);
+    if (send_all(sock, need, nneed * sizeof(*need)) != (ssize_t)(nneed * sizeof(*need))) goto out;
+
+    int ok = 1;
+    for (uint64_t i = 0; i < nneed; i++) {
+        const unsigned char *ref = refs + (uint64_t)ntohl(need[i]) * DEDUP_REF_LEN;
+        uint32_t len = ref_len(ref);
+        unsigned char hash[SHA256_LEN];
+        if (recv_all(sock, buf, len) != (ssize_t)len) goto out;
+        if (!ok) continue;  // 已经失败，只把剩下的数据读完，连接还能继续用
+        sha256(buf, len, hash);
+        if (memcmp(hash, ref, SHA256_LEN) != 0) {
+            fprintf(stderr, "dedup: %s chunk %u hash mismatch\n", filename, ntohl(need[i]));
+            ok = 0;
+        } else if (store_put_chunk(&batch, hash, buf, len) != 0) {
+            ok = 0;
+        } else {
+            __atomic_fetch_add(&g_dedup_stored, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&g_dedup_stored_bytes, len, __ATOMIC_RELAXED);
+        }
+    }
+    if (ok && (store_flush_chunks(&batch) != 0 || store_sync_dirs(&batch) != 0 ||
+               write_manifest(manifest, filesize, refs, nchunks) != 0)) ok = 0;
+    if (ok && unlink(filename) != 0 && errno != ENOENT) perror("unlink plain file");
+    if (ok) cache_invalidate(filename);
+    uint64_t reply = ok ? htonll(filesize) : REPLY_ERROR;
+    rc = send_all(sock, &reply, sizeof(reply)) == sizeof(reply) ? 0 : -1;
+
+out:
+    store_discard_chunks(&batch);
+    free(refs);
+    free(order);
+    free(need);
+    free(buf);
+    return rc;
+}
+
+void dedup_stats_dump(void) {
+    if (!g_cfg.store) return;
+    fprintf(stderr, "dedup: %" PRIu64 " chunks stored (%" PRIu64 " bytes), %" PRIu64 " chunks reused (%" PRIu64 " bytes)\n",
+            __atomic_load_n(&g_dedup_stored, __ATOMIC_RELAXED), __atomic_load_n(&g_dedup_stored_bytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_dedup_reused, __ATOMIC_RELAXED), __atomic_load_n(&g_dedup_reused_bytes, __ATOMIC_RELAXED));
+}
+
+/* 读清单；不存在返回 1（errno 为 ENOENT），格式错误返回 -1 */
+int load_manifest(const char *filename, uint64_t *filesize, unsigned char **refs, uint64_t *n) {
+    char files_dir[1024], path[2048];
+    snprintf(files_dir, sizeof(files_dir), "%s/files", g_cfg.store);
+    if (bulk_path(files_dir, filename, path, sizeof(path)) != 0) return 1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    unsigned char hdr[24];
+    int rc = -1;
+    *refs = NULL;
+    if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) goto out;
+    uint32_t magic;
+    uint64_t size_net, n_net;
+    memcpy(&magic, hdr, 4);
+    memcpy(&size_net, hdr + 8, 8);
+    memcpy(&n_net, hdr + 16, 8);
+    *filesize = ntohll(size_net);
+    *n = ntohll(n_net);
+    if (ntohl(magic) != MANIFEST_MAGIC || *n > DEDUP_MAX_CHUNKS || *n > *filesize / DEDUP_MIN_CHUNK + 1) goto out;
+    *refs = malloc(*n * DEDUP_REF_LEN + 1);
+    if (!*refs || pread(fd, *refs, *n * DEDUP_REF_LEN, sizeof(hdr)) != (ssize_t)(*n * DEDUP_REF_LEN)) goto out;
+    rc = 0;
+
+out:
+    if (rc != 0) {
+        fprintf(stderr, "bad manifest %s\n", path);
+        free(*refs);
+        *refs = NULL;
+    }
+    close(fd);
+    return rc;
+}
+
+/* 按清单下载：回复与普通下载相同，数据从各块文件依次发出（块内照常走 sendfile / 分帧） */
+int handle_download_manifest(int sock, const char *filename, uint64_t client_offset, const struct peer *peer) {
+    uint64_t filesize, n;
+    unsigned char *refs;
+    int rc = load_manifest(filename, &filesize, &refs, &n);
+    if (rc != 0) return rc > 0 ? 1 : -1;
+    uint64_t server_offset = client_offset > filesize ? filesize : client_offset;
+    uint64_t reply[2] = { htonll(filesize), htonll(server_offset) };
+    rc = send_all(sock, reply, sizeof(reply)) == sizeof(reply) ? 0 : -1;
+
+    uint64_t off = 0;
+    char path[1024];
+    for (uint64_t i = 0; rc == 0 && i < n; i++) {
+        const unsigned char *ref = refs + i * DEDUP_REF_LEN;
+        uint64_t len = ref_len(ref);
+        if (off + len > server_offset) {
+            int fd = chunk_path(ref, path, sizeof(path)) == 0 ? open(path, O_RDONLY) : -1;
+            if (fd < 0) {
+                perror(path);
+                rc = -1;
+                break;
+            }
+            uint64_t pos = server_offset > off ? server_offset - off : 0;
+            rc = send_download(sock, fd, &pos, len, peer, NULL, NULL);
+            close(fd);
+        }
+        off += len;
+    }
+    free(refs);
+    return rc;
+}
+
+/* 分段上传的写入目标：staged 时为 <filename>.range.part，各段都写完后由提交改名发布；
+   旧客户端不会提交，只能照旧写目标文件本身 */
+int range_path(const char *filename, int staged, char *path) {
+    if (!staged) return snprintf(path, STAGING_PATH_MAX, "%s", filename) < STAGING_PATH_MAX ? 0 : -1;
+    return staging_path(filename, ".range.part", path);
+}
+
+/* 打开分段上传的写入目标并设为 filesize 大小（各段连接都做，幂等），预先分配本段 [start, end)。失败返回 -1 */
+int range_open(const char *path, uint64_t filesize, uint64_t start, uint64_t end) {
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((uint64_t)st.st_size != filesize && ftruncate(fd, (off_t)filesize) != 0)) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    if (preallocate(fd, start, end - start, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* 分段上传的提交：客户端确认各段都已落盘后发来 start == end == filesize 的 upload_range，
+   暂存文件落盘、改名覆盖目标、目录落盘。暂存文件已不在而目标已是 filesize 大小时说明上次提交的确认丢了，
+   同样算成功。返回 0 成功，-1 失败 */
+int range_commit(const char *filename, uint64_t filesize) {
+    char part[STAGING_PATH_MAX];
+    struct stat st;
+    if (range_path(filename, 1, part) != 0) return -1;
+    int fd = open(part, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT && stat(filename, &st) == 0 && (uint64_t)st.st_size == filesize) return 0;
+        perror("open range staging");
+        return -1;
+    }
+    int rc = -1;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != filesize) {
+        fprintf(stderr, "range commit: %s staged %" PRIu64 " bytes, expected %" PRIu64 "\n", filename,
+                (uint64_t)st.st_size, filesize);
+    } else {
+        rc = durable_rename(fd, part, filename);
+        cache_invalidate(filename);
+    }
+    close(fd);
+    return rc;
+}
+
+/* 分段上传：多条连接各自负责 [start, end)，用定位写落到各自的偏移。
+   staged 时写进暂存文件，目标在提交前不变；start == end == filesize 是提交（见 range_commit）。
+   每写满 RANGE_ACK_INTERVAL 先 fdatasync 再回一次已写入位置，客户端据此记录可续传的进度；
+   最后一个确认在 fsync 之后发出，值等于 end */
+int handle_upload_range(int sock, const char *filename, uint64_t filesize, uint64_t start, uint64_t end, int staged) {
+    uint64_t net;
+    if (staged && start == filesize && end == filesize) {
+        if (range_commit(filename, filesize) != 0) return 1;
+        uint64_t reply[2] = { htonll(filesize), htonll(filesize) };
+        return send_all(sock, reply, sizeof(reply)) == sizeof(reply) ? 0 : -1;
+    }
+    char path[STAGING_PATH_MAX];
+    int fd = range_path(filename, staged, path) == 0 ? range_open(path, filesize, start, end) : -1;
+    if (fd < 0) return 1;
+
+    int rc = -1;
+    net = htonll(start);
+    if (send_all(sock, &net, sizeof(net)) != sizeof(net)) goto out;
+
+    uint64_t pos = start;
+    while (pos < end) {
+        uint64_t stop = end - pos > RANGE_ACK_INTERVAL ? pos + RANGE_ACK_INTERVAL : end;
+        if (recv_to_file(sock, fd, &pos, stop, NULL) != 0) goto out;
+        if (pos < end) {
+            // 确认过的位置客户端不会再发，必须先落盘
+            if (fdatasync(fd) != 0) {
+                perror("fdatasync");
+                goto out;
+            }
+            net = htonll(pos);
+            if (send_all(sock, &net, sizeof(net)) != sizeof(net)) goto out;
+        }
+    }
+    if (durable_sync(fd) != 0) goto out;
+    net = htonll(end);
+    if (send_all(sock, &net, sizeof(net)) != sizeof(net)) goto out;
+    rc = 0;
+
+out:
+    if (!staged) cache_invalidate(filename);  // 原地写入，装入后又被改过的内容不能再发
+    close(fd);
+    return rc;
+}
+
+/* 从缓存条目发送 [*pos, end)（peer 为 NULL 表示不分帧） */
+int send_hot_data(int sock, const struct hot_entry *e, uint64_t *pos, uint64_t end, const struct peer *peer) {
+    uint64_t start = *pos;
+    int rc = 0;
+    if (peer && peer_framed(peer)) {
+        rc = send_frames_from_file(sock, -1, pos, end, peer, NULL, NULL, e->data);
+    } else if (*pos < end) {
+        if (send_all(sock, e->data + *pos, end - *pos) == (ssize_t)(end - *pos)) *pos = end;
+        else rc = -1;
+    }
+    __atomic_fetch_add(&g_hot.bytes_served, *pos - start, __ATOMIC_RELAXED);
+    return rc;
+}
+
+/* 从缓存条目回复 download（格式同 handle_download），并释放条目的引用 */
+int send_hot_download(int sock, struct hot_entry *e, uint64_t client_offset, const struct peer *peer) {
+    uint64_t pos = client_offset > e->size ? e->size : client_offset;
+    uint64_t reply[2] = { htonll(e->size), htonll(pos) };
+    int rc = send_all(sock, reply, sizeof(reply)) == sizeof(reply) ? send_hot_data(sock, e, &pos, e->size, peer) : -1;
+    hot_put(e);
+    return rc;
+}
+
+/* 处理下载：按照 client_offset 协商 server_offset 并从该处开始发送 */
+int handle_download(int sock, const char *filename, uint64_t client_offset, const struct peer *peer) {
+    struct hot_entry *hot = hot_get(filename);
+    if (hot) return send_hot_download(sock, hot, client_offset, peer);
+    // -O 要把描述符切成 O_DIRECT，不能与别的连接共用缓存里的描述符
+    struct open_file f;
+    if (file_open(filename, &f, !g_cfg.direct) != 0) {
+        if (errno == ENOENT && g_cfg.store) return handle_download_manifest(sock, filename, client_offset, peer);
+        perror("open");
+        return 1;
+    }
+
+    hot_admit(filename, &f.st);
+
+    uint64_t filesize = (uint64_t)f.st.st_size;
+    uint64_t server_offset = client_offset > filesize ? filesize : client_offset;
+
+    // filesize 与 server_offset 一次发出，避免两个小包被 Nagle 拆开等待
+    uint64_t reply[2] = { htonll(filesize), htonll(server_offset) };
+    if (send_all(sock, reply, sizeof(reply)) != sizeof(reply)) {
+        perror("send filesize");
+        file_close(&f);
+        return -1;
+    }
+
+    if (server_offset >= filesize) {
+        file_close(&f);
+        return 0; // 对端已完整，无需发送
+    }
+
+    uint64_t pos = server_offset;
+    struct readahead ra = { -1, 0, 0, 0 };
+    struct direct_io dio;
+    int direct = !f.cached && direct_open(&dio, f.fd) == 0;
+    if (!direct) ra_start(&ra, f.fd, pos, filesize, f.cached != NULL);
+    int rc = send_download(sock, f.fd, &pos, filesize, peer, &ra, direct ? &dio : NULL);
+    file_close(&f);
+    return rc;
+}
+
+/* 分段下载：回复 filesize 后发送 [start, min(end, filesize))；start == end 可用来只查询大小 */
+int handle_download_range(int sock, const char *filename, uint64_t start, uint64_t end) {
+    struct hot_entry *hot = hot_get(filename);
+    if (hot) {
+        uint64_t net_filesize = htonll(hot->size), pos = start;
+        if (end > hot->size) end = hot->size;
+        int rc = send_all(sock, &net_filesize, sizeof(net_filesize)) == sizeof(net_filesize)
+                     ? send_hot_data(sock, hot, &pos, end, NULL) : -1;
+        hot_put(hot);
+        return rc;
+    }
+    struct open_file f;
+    if (file_open(filename, &f, 1) != 0) {
+        perror("open");
+        return 1;
+    }
+    uint64_t filesize = (uint64_t)f.st.st_size;
+    if (end > filesize) end = filesize;
+
+    int rc = -1;
+    uint64_t net_filesize = htonll(filesize);
+    if (send_all(sock, &net_filesize, sizeof(net_filesize)) == sizeof(net_filesize)) {
+        uint64_t pos = start;
+        struct readahead ra;
+        ra_start(&ra, f.fd, pos, filesize, f.cached != NULL);
+        rc = send_download(sock, f.fd, &pos, end, NULL, &ra, NULL);
+    }
+    file_close(&f);
+    return rc;
+}
+
+/* 续传校验：对 [0, min(length, filesize)) 建哈希树并回复 filesize 与根，然后逐轮回答客户端
+   要展开的节点的子节点哈希，直到客户端发来 count 0。文件不存在按大小 0 回复，上传前的校验由此得知无需比较。
+   有同样 length 的暂存上传时客户端是在续传它，比对的是暂存文件已提交的 [0, committed)，按大小 committed 回复。
+   建好的树留给紧接着的 upload 拼前缀 CRC（见 tree_prefix_crc） */
+int handle_hash_tree(int sock, const char *filename, uint64_t length) {
+    uint64_t filesize = 0, committed;
+    struct open_file f = { -1, { 0 }, NULL };
+    enum origin origin = ORIGIN_NONE;
+    char part[STAGING_PATH_MAX];
+    if (staging_read(filename, length, &committed, NULL) == 0 && staging_path(filename, ".part", part) == 0 &&
+        (f.fd = open(part, O_RDONLY)) >= 0 && fstat(f.fd, &f.st) == 0) {
+        origin = ORIGIN_PART;
+        filesize = committed;
+    } else {
+        if (f.fd >= 0) close(f.fd);
+        f.fd = -1;
+        if (file_open(filename, &f, 1) == 0) {
+            origin = ORIGIN_FILE;
+            filesize = (uint64_t)f.st.st_size;
+        } else if (errno != ENOENT) {
+            perror("open");
+            return 1;
+        }
+    }
+    struct merkle t;
+    uint64_t len = length < filesize ? length : filesize;
+    int built = merkle_build(f.fd, len, &t);
+    if (f.fd >= 0) file_close(&f);
+    if (built != 0) return 1;
+    struct stat st = f.st;
+
+    int rc = -1;
+    uint64_t *idx = NULL;
+    uint32_t *out = NULL;
+    uint64_t reply[2] = { htonll(filesize), htonll(merkle_root(&t)) };
+    if (send_all(sock, reply, sizeof(reply)) != sizeof(reply)) goto out;
+    if (t.nlevels == 0) {
+        tree_drop();
+        rc = 0;
+        goto out;
+    }
+
+    while (1) {
+        // C->S: uint32_t level, uint32_t count, count 个 uint64_t 节点序号；S->C: 各节点的子节点哈希
+        uint32_t q[2];
+        if (recv_all(sock, q, sizeof(q)) != sizeof(q)) goto out;
+        uint32_t lvl = ntohl(q[0]), count = ntohl(q[1]);
+        if (count == 0) break;
+        if (lvl == 0 || lvl >= (uint32_t)t.nlevels || count > t.count[lvl]) goto out;
+        idx = malloc((size_t)count * sizeof(*idx));
+        out = malloc((size_t)count * MERKLE_FANOUT * sizeof(*out));
+        if (!idx || !out) goto out;
+        if (recv_all(sock, idx, (size_t)count * sizeof(*idx)) != (ssize_t)(count * sizeof(*idx))) goto out;
+        size_t n = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t node = ntohll(idx[i]), first;
+            if (node >= t.count[lvl]) goto out;
+            uint64_t end = merkle_children(&t, (int)lvl, node, &first);
+            for (uint64_t k = first; k < end; k++) out[n++] = htonl(t.level[lvl - 1][k]);
+        }
+        if (send_all(sock, out, n * sizeof(*out)) != (ssize_t)(n * sizeof(*out))) goto out;
+        free(idx);
+        free(out);
+        idx = NULL;
+        out = NULL;
+    }
+    tree_keep(filename, origin, &st, len, &t);
+    rc = 0;
+
+out:
+    free(idx);
+    free(out);
+    merkle_free(&t);
+    return rc;
+}
+
+/* 本服务端可声明的能力：压缩取决于编译时链接的库；epoll 状态机不做分帧和多轮交互，
+   该引擎下不声明压缩与校验 */
+uint32_t server_caps(void) {
+    uint32_t caps = SERVER_CAPS;
+    if (g_cfg.engine != ENGINE_EPOLL) {
+        caps |= CAP_CHECKSUM | CAP_VERIFY | CAP_DELTA | CAP_ACK | CAP_REPAIR;
+        if (g_cfg.store) caps |= CAP_DEDUP;
+#ifdef HAVE_LZ4
+        caps |= CAP_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+        caps |= CAP_ZSTD;
+#endif
+    }
+    return caps;
+}
+
+/* 根据客户端握手的 version, caps 填好回复 {PROTO_MAGIC, version, caps}，返回双方共有的能力 */
+uint32_t hello_reply(uint32_t version, uint32_t client_caps, uint32_t reply[3]) {
+    uint32_t caps = client_caps & server_caps();
+    reply[0] = htonl(PROTO_MAGIC);
+    reply[1] = htonl(version < PROTO_VERSION ? version : PROTO_VERSION);
+    reply[2] = htonl(caps);
+    return caps;
+}
+
+/* 会话模式下请求无法执行时，按该请求回复的字数回 REPLY_ERROR，客户端据此跳过这个文件 */
+int reply_error(int sock, int words) {
+    uint64_t reply[2] = { REPLY_ERROR, REPLY_ERROR };
+    size_t len = (size_t)words * sizeof(reply[0]);
+    return send_all(sock, reply, len) == (ssize_t)len ? 0 : -1;
+}
+
+/* 处理一个请求（mode_len 已读出）：0 成功，-1 出错，连接状态未知需关闭。
+   各 handle_* 返回 1 表示文件无法打开且尚未回复：会话连接回 REPLY_ERROR 后继续，旧连接直接关闭 */
+int handle_request(int client_sock, uint32_t mode_len, const struct peer *peer) {
+    uint32_t filename_len_net;
+    char mode[32], filename[512];
+    int rc, words;
+
+    if (mode_len == 0 || mode_len >= sizeof(mode)) return -1;
+    if (recv_all(client_sock, mode, mode_len) != (ssize_t)mode_len) return -1;
+    mode[mode_len] = '\0';
+
+    if (recv_all(client_sock, &filename_len_net, sizeof(filename_len_net)) != sizeof(filename_len_net)) return -1;
+    uint32_t filename_len = ntohl(filename_len_net);
+    if (filename_len == 0 || filename_len >= sizeof(filename)) return -1;
+    if (recv_all(client_sock, filename, filename_len) != (ssize_t)filename_len) return -1;
+    filename[filename_len] = '\0';
+
+    if (strcmp(mode, "upload") == 0) {
+        // 3) C->S: filesize
+        uint64_t filesize_net;
+        if (recv_all(client_sock, &filesize_net, sizeof(filesize_net)) != sizeof(filesize_net)) return -1;
+
+        // 4) S->C: agreed_offset；5) 接收 [agreed, filesize) 的数据
+        words = 1;
+        rc = handle_upload(client_sock, filename, ntohll(filesize_net), peer);
+    }
+    else if (strcmp(mode, "upload_range") == 0) {
+        // 3) C->S: filesize, range_start, range_end
+        uint64_t hdr_net[3];
+        if (recv_all(client_sock, hdr_net, sizeof(hdr_net)) != sizeof(hdr_net)) return -1;
+        uint64_t filesize = ntohll(hdr_net[0]);
+        uint64_t start = ntohll(hdr_net[1]);
+        uint64_t end = ntohll(hdr_net[2]);
+        if (start > end || end > filesize) return -1;
+
+        // 4) S->C: start；5) 接收 [start, end)，期间与结束时回复已写入位置
+        words = 1;
+        rc = handle_upload_range(client_sock, filename, filesize, start, end, (peer->caps & CAP_RANGE_STAGE) != 0);
+    }
+    else if (strcmp(mode, "download_range") == 0) {
+        // 3) C->S: range_start, range_end
+        uint64_t hdr_net[2];
+        if (recv_all(client_sock, hdr_net, sizeof(hdr_net)) != sizeof(hdr_net)) return -1;
+        uint64_t start = ntohll(hdr_net[0]);
+        uint64_t end = ntohll(hdr_net[1]);
+        if (start > end) return -1;
+
+        // 4) S->C: filesize，然后发 [start, min(end, filesize)) 的数据
+        words = 1;
+        rc = handle_download_range(client_sock, filename, start, end);
+    }
+    else if (strcmp(mode, "download") == 0) {
+        // 3) C->S: client_offset
+        uint64_t offset_net;
+        if (recv_all(client_sock, &offset_net, sizeof(offset_net)) != sizeof(offset_net)) return -1;
+
+        // 4) S->C: filesize + server_offset, 然后发数据
+        words = 2;
+        rc = handle_download(client_sock, filename, ntohll(offset_net), peer);
+    }
+    else if (strcmp(mode, "upload_bulk") == 0) {
+        // 3) C->S: 文件记录流；4) S->C: 写入的文件数（filename 字段是目标目录）
+        words = 1;
+        rc = handle_upload_bulk(client_sock, filename);
+    }
+    else if (strcmp(mode, "upload_delta") == 0) {
+        // 3) C->S: filesize
+        uint64_t filesize_net;
+        if (recv_all(client_sock, &filesize_net, sizeof(filesize_net)) != sizeof(filesize_net)) return -1;
+
+        // 4) S->C: old_size, block, nblocks 与签名；5) 指令流；6) S->C: 新文件大小
+        words = 2;
+        rc = handle_upload_delta(client_sock, filename, ntohll(filesize_net));
+    }
+    else if (strcmp(mode, "upload_dedup") == 0) {
+        // 3) C->S: filesize, nchunks，随后 nchunks 条 {sha256, len}
+        uint64_t hdr_net[2];
+        if (recv_all(client_sock, hdr_net, sizeof(hdr_net)) != sizeof(hdr_net)) return -1;
+
+        // 4) S->C: 缺少的块序号；5) C->S: 这些块的数据；6) S->C: filesize
+        words = 1;
+        rc = handle_upload_dedup(client_sock, filename, ntohll(hdr_net[0]), ntohll(hdr_net[1]));
+    }
+    else if (strcmp(mode, "hash_tree") == 0) {
+        // 3) C->S: 客户端已有的长度
+        uint64_t length_net;
+        if (recv_all(client_sock, &length_net, sizeof(length_net)) != sizeof(length_net)) return -1;
+
+        // 4) S->C: filesize + 根哈希；5) 逐轮展开不一致的节点
+        words = 2;
+        rc = handle_hash_tree(client_sock, filename, ntohll(length_net));
+    }
+    else {
+        return -1;  // 未知 mode
+    }
+
+    if (rc == 1) rc = (peer->caps & CAP_PIPELINE) ? reply_error(client_sock, words) : -1;
+    return rc;
+}
+
+/* 会话连接出错时的关闭：先 shutdown 写端把已排队的回复送出去，再丢掉对端已流水线发来的请求，
+   否则带着未读数据 close 会直接发 RST，对端可能收不全之前已完成请求的回复 */
+void close_session(int sock) {
+    char buf[4096];
+    shutdown(sock, SHUT_WR);
+    while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+    close(sock);
+}
+
+/* 连接上的请求头和回复都很小且已合并成一次发送，关掉 Nagle 避免与延迟确认互相等待 */
+void set_nodelay(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* 客户端处理：与 client.c 协议匹配，并保证早退时关闭套接字 */
+void handle_client(int client_sock) {
+    uint32_t mode_len_net;
+    struct peer peer = { 0, 0 };  // 旧客户端不握手，没有任何扩展能力
+
+    // 统一用 goto cleanup，避免早退不 close
+    if (recv_all(client_sock, &mode_len_net, sizeof(mode_len_net)) != sizeof(mode_len_net)) goto cleanup;
+    if (ntohl(mode_len_net) == PROTO_MAGIC) {
+        // 0) 握手：C->S version, caps；S->C magic, version, caps；有压缩时 C->S level
+        uint32_t hello[2], reply[3];
+        if (recv_all(client_sock, hello, sizeof(hello)) != sizeof(hello)) goto cleanup;
+        peer.caps = hello_reply(ntohl(hello[0]), ntohl(hello[1]), reply);
+        if (send_all(client_sock, reply, sizeof(reply)) != sizeof(reply)) goto cleanup;
+        if (peer_codec(&peer) >= 0) {
+            uint32_t level_net;
+            if (recv_all(client_sock, &level_net, sizeof(level_net)) != sizeof(level_net)) goto cleanup;
+            peer.level = (int32_t)ntohl(level_net);
+        }
+        if (recv_all(client_sock, &mode_len_net, sizeof(mode_len_net)) != sizeof(mode_len_net)) goto cleanup;
+    }
+
+    // 会话模式：一个请求结束后在同一连接上继续读下一个，对端关闭即结束
+    while (handle_request(client_sock, ntohl(mode_len_net), &peer) == 0) {
+        if (!(peer.caps & CAP_PIPELINE)) goto cleanup;
+        if (recv_all(client_sock, &mode_len_net, sizeof(mode_len_net)) != sizeof(mode_len_net)) goto cleanup;
+    }
+    if (peer.caps & CAP_PIPELINE) {
+        close_session(client_sock);
+        return;
+    }
+
+cleanup:
+    close(client_sock);
+}
+
+/* 有界交接队列：acceptor 放入已 accept 的套接字，worker 取出处理。
+   队列满时 acceptor 阻塞在 push 上，新连接留在内核 backlog 里，形成背压 */
+struct conn_queue {
+    int *fds;
+    int cap;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+static struct conn_queue g_queue;
+
+int queue_init(struct conn_queue *q, int cap) {
+    q->fds = malloc(sizeof(int) * (size_t)cap);
+    if (!q->fds) return -1;
+    q->cap = cap;
+    q->head = 0;
+    q->count = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+void queue_push(struct conn_queue *q, int fd) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->fds[(q->head + q->count) % q->cap] = fd;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int queue_pop(struct conn_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    int fd = q->fds[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return fd;
+}
+
+/* 工作线程：不断从队列取连接并完整处理一个客户端 */
+void *worker_main(void *arg) {
+    struct conn_queue *q = arg;
+    while (1) {
+        int client_sock = queue_pop(q);
+        handle_client(client_sock);
+    }
+    return NULL;
+}
+
+/* ---------------- epoll 引擎 ----------------
+ * 与 handle_client() 相同的协议，但每一步都拆成非阻塞状态，
+ * 半包时保存进度返回 epoll，连接只占一个 struct conn。
+ * 会阻塞的文件操作（打开并截断/预分配、暂存的续传与种子复制、fsync 与发布、中途断开时的提交）
+ * 不在循环线程上做：连接移出 epoll、进入 CS_BLOCKED，交给辅助线程执行，完成后挂到所属循环的
+ * 完成队列并写 eventfd 唤醒循环，循环重新登记连接并从 op 设好的状态继续。 */
+
+enum conn_state {
+    CS_MODE_LEN,
+    CS_HELLO,            /* 握手：等待 version, caps */
+    CS_MODE,
+    CS_NAME_LEN,
+    CS_NAME,
+    CS_UPLOAD_SIZE,      /* 上传：等待 filesize */
+    CS_DOWNLOAD_OFFSET,  /* 下载：等待 client_offset */
+    CS_SEND_REPLY,       /* 发送 agreed_offset 或 filesize+server_offset */
+    CS_UPLOAD_RANGE_HDR,    /* 分段上传：等待 filesize, start, end */
+    CS_DOWNLOAD_RANGE_HDR,  /* 分段下载：等待 start, end */
+    CS_BULK_NAME_LEN,       /* 批量上传：等待下一个记录的 name_len，0 表示结束 */
+    CS_BULK_NAME,
+    CS_BULK_SIZE,
+    CS_UPLOAD_DATA,
+    CS_DOWNLOAD_DATA,
+    CS_DONE,                /* 请求结束：会话模式下接着读下一个请求，否则关闭连接 */
+    CS_BLOCKED,             /* 阻塞文件操作在辅助线程上执行，连接不在 epoll 中 */
+};
+
+struct event_loop;
+
+struct conn {
+    int fd;
+    int file_fd;
+    enum conn_state state;
+    enum conn_state after_reply;  /* 回复发完后进入的状态 */
+    uint32_t events;              /* 当前在 epoll 中登记的事件 */
+    uint32_t need;                /* 当前变长字段的长度 */
+    uint32_t got;                 /* 当前字段已收到的字节 */
+    uint32_t reply_len;
+    uint32_t reply_sent;
+    int no_sendfile;              /* 文件不支持 sendfile 时改用 pread + send */
+    int no_splice;                /* socket 不支持 splice 时改用 recv + pwrite */
+    int range_acks;               /* 分段上传：数据阶段需要回确认 */
+    int hello_done;               /* 已完成握手，不再接受第二次 */
+    uint32_t caps;                /* 握手协商出的能力，旧客户端为 0 */
+    char *bulk_name;              /* 批量上传：当前记录的文件名，按需分配 */
+    uint64_t bulk_count;          /* 批量上传：已写完的文件数 */
+    struct bulk_batch bulk;       /* 批量上传：写完待落盘的文件与目录 */
+    unsigned char field[24];      /* 定长字段（u32/u64 及分段头）的暂存 */
+    unsigned char reply[16];
+    char mode[32];
+    char *filename;
+    uint64_t filesize;
+    uint64_t pos;                 /* 上传：下一个写入偏移；下载：下一个发送偏移 */
+    uint64_t end;                 /* 数据阶段的结束偏移 */
+    uint64_t next_ack;            /* 分段上传：到达该偏移时回一次确认 */
+    uint64_t next_commit;         /* upload：到达该偏移时提交一次暂存（STAGING_COMMIT_INTERVAL） */
+    struct staging stage;         /* upload：暂存文件，stage.fd 与 file_fd 是同一个描述符 */
+    struct readahead ra;          /* download：页缓存提示 */
+    struct fd_entry *cached;      /* download：file_fd 借自描述符缓存，用完由 conn_close_file 归还 */
+    int (*op)(struct conn *c);    /* CS_BLOCKED：辅助线程执行的操作，设好下一状态返回 0，返回 -1 关闭连接 */
+    int op_rc;
+    struct conn *op_next;         /* 辅助线程队列 / 循环完成队列 */
+    struct event_loop *loop;      /* 完成后回到的循环 */
+    struct sync_req sync;         /* CS_BLOCKED：交给落盘线程的请求 */
+    char part[STAGING_PATH_MAX];  /* sync 改名的源路径 */
+};
+
+struct event_loop {
+    int epfd;
+    int listen_fd;
+    int efd;    /* eventfd：辅助线程完成操作后写它唤醒循环 */
+    char *buf;  /* LOOP_BUF_SIZE，本循环内所有连接共用 */
+    pthread_mutex_t lock;
+    struct conn *done;  /* 已完成阻塞操作、等循环接手的连接 */
+};
+
+/* 所有循环共用的辅助线程队列 */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct conn *head, *tail;
+} g_helpers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL };
+
+/* 读满 len 字节到 dst（从 c->got 继续）：1 完成，0 需等待，-1 出错或对端关闭 */
+int conn_read(struct conn *c, void *dst, uint32_t len) {
+    while (c->got < len) {
+        ssize_t n = recv(c->fd, (char *)dst + c->got, len - c->got, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return -1;
+        c->got += (uint32_t)n;
+    }
+    c->got = 0;
+    return 1;
+}
+
+/* 丢下未完成的 upload：提交已写入的部分，留给下次续传 */
+void conn_drop_stage(struct conn *c) {
+    if (c->stage.fd < 0) return;
+    staging_commit(&c->stage, c->pos);
+    staging_close(&c->stage);
+    c->file_fd = -1;
+}
+
+/* 关闭（或归还给描述符缓存）当前请求的文件 */
+void conn_close_file(struct conn *c) {
+    if (c->file_fd < 0) return;
+    struct open_file f = { .fd = c->file_fd, .cached = c->cached };
+    file_close(&f);
+    c->file_fd = -1;
+    c->cached = NULL;
+}
+
+void conn_close(struct conn *c) {
+    if (c->caps & CAP_PIPELINE) close_session(c->fd);
+    else close(c->fd);
+    conn_drop_stage(c);
+    conn_close_file(c);
+    bulk_discard(&c->bulk);
+    free(c->filename);
+    free(c->bulk_name);
+    free(c);
+}
+
+/* 会话模式：清掉上一个请求的状态，准备读下一个请求（握手与协商结果保留） */
+void conn_next_request(struct conn *c) {
+    conn_drop_stage(c);
+    conn_close_file(c);
+    free(c->filename);
+    c->filename = NULL;
+    free(c->bulk_name);
+    c->bulk_name = NULL;
+    c->bulk_count = 0;
+    bulk_discard(&c->bulk);
+    c->no_sendfile = 0;
+    c->range_acks = 0;
+    c->filesize = c->pos = c->end = c->next_ack = c->next_commit = 0;
+    c->got = 0;
+    c->state = CS_MODE_LEN;
+}
+
+/* 把连接移出 epoll 交给别的线程：此后直到 loop_post 把它交回，循环都不碰它 */
+int conn_park(struct event_loop *loop, struct conn *c) {
+    // 刚从辅助线程回来、还没重新登记的连接（events 为 0）本就不在 epoll 中
+    if (c->events && epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL) != 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    c->events = 0;
+    c->loop = loop;
+    c->state = CS_BLOCKED;
+    return 0;
+}
+
+/* 别的线程做完连接的操作后交回循环：rc 非 0 时由循环关闭连接，暂存的提交趁还在别的线程上做掉 */
+void loop_post(struct conn *c, int rc) {
+    struct event_loop *loop = c->loop;
+    c->op_rc = rc;
+    if (rc != 0) conn_drop_stage(c);
+    pthread_mutex_lock(&loop->lock);
+    c->op_next = loop->done;
+    loop->done = c;
+    pthread_mutex_unlock(&loop->lock);
+    uint64_t one = 1;
+    if (write(loop->efd, &one, sizeof(one)) != sizeof(one)) perror("eventfd write");
+}
+
+/* 准备一个 uint64_t 回复，发完后进入 after */
+void conn_set_reply(struct conn *c, uint64_t v, enum conn_state after) {
+    uint64_t net = htonll(v);
+    memcpy(c->reply, &net, sizeof(net));
+    c->reply_len = sizeof(net);
+    c->reply_sent = 0;
+    c->after_reply = after;
+    c->state = CS_SEND_REPLY;
+}
+
+/* 会话模式下文件无法打开：回 words 个 REPLY_ERROR 后继续下一个请求；旧连接直接关闭 */
+int conn_reply_error(struct conn *c, int words) {
+    if (!(c->caps & CAP_PIPELINE)) return -1;
+    memset(c->reply, 0xff, (size_t)words * sizeof(uint64_t));
+    c->reply_len = (uint32_t)words * sizeof(uint64_t);
+    c->reply_sent = 0;
+    c->after_reply = CS_DONE;
+    c->state = CS_SEND_REPLY;
+    return 0;
+}
+
+/* 分段上传途中的确认（辅助线程）：确认过的位置客户端不会再发，先 fdatasync，确认发完再接着收数据 */
+int conn_range_ack(struct conn *c) {
+    if (fdatasync(c->file_fd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    c->next_ack = c->pos + RANGE_ACK_INTERVAL;
+    conn_set_reply(c, c->pos, CS_UPLOAD_DATA);
+    return 0;
+}
+
+/* upload 途中的提交（辅助线程）：与 handle_upload 一样每 STAGING_COMMIT_INTERVAL 提交一次，崩溃后从这里续传 */
+int conn_stage_commit(struct conn *c) {
+    if (staging_commit(&c->stage, c->pos) != 0) return -1;
+    c->next_commit = c->pos + STAGING_COMMIT_INTERVAL;
+    c->state = CS_UPLOAD_DATA;
+    return 0;
+}
+
+/* 上传收尾的落盘完成（落盘线程）：upload 发布暂存文件，分段上传回最终确认，再把连接交回循环 */
+void conn_upload_synced(struct sync_req *req) {
+    struct conn *c = req->arg;
+    int rc = 0;
+    if (c->stage.fd >= 0) {
+        // 发布失败时暂存留给续传
+        rc = staging_published(c->filename, &c->stage, req->rc);
+        if (rc == 0) {
+            staging_close(&c->stage);
+            c->file_fd = -1;
+            c->state = CS_DONE;
+        }
+    } else if (req->rc != 0 && c->range_acks) {
+        rc = -1;
+    } else {
+        close(c->file_fd);
+        c->file_fd = -1;
+        if (c->range_acks) conn_set_reply(c, c->end, CS_DONE);
+        else c->state = CS_DONE;
+    }
+    loop_post(c, rc);
+}
+
+/* 上传收尾：发布（fsync、改名、目录 fsync）或落盘作为一个请求交给落盘线程，循环不等待 */
+int conn_finish_upload(struct event_loop *loop, struct conn *c) {
+    if (c->stage.fd >= 0) {
+        if (staging_publish_req(c->filename, &c->stage, &c->sync, c->part) != 0) return -1;
+    } else {
+        memset(&c->sync, 0, sizeof(c->sync));
+        c->sync.fd = c->file_fd;
+    }
+    c->sync.complete = conn_upload_synced;
+    c->sync.arg = c;
+    if (conn_park(loop, c) != 0) return -1;
+    durable_submit(&c->sync);
+    return 1;
+}
+
+/* 批量上传的一个文件写完：交给批次，接着收下一个记录。批次因此攒满时要落盘一批，须在辅助线程上调用 */
+int conn_add_bulk_file(struct conn *c) {
+    int fd = c->file_fd;
+    c->file_fd = -1;  // 描述符归批次了
+    if (bulk_add_file(&c->bulk, fd) != 0) return -1;
+    c->bulk_count++;
+    c->state = CS_BULK_NAME_LEN;
+    return 0;
+}
+
+/* 以下 conn_start_upload* 与批量上传的打开、收尾都在辅助线程上执行 */
+
+/* 头部解析完成后打开暂存文件（可能要复制旧文件的前缀）并准备回复 */
+int conn_start_upload(struct conn *c) {
+    if (staging_open(c->filename, c->filesize, &c->stage, 0) != 0) return conn_reply_error(c, 1);
+    c->file_fd = c->stage.fd;
+    c->pos = c->stage.committed;
+    c->end = c->filesize;
+    c->next_commit = c->pos + STAGING_COMMIT_INTERVAL;
+    conn_set_reply(c, c->pos, c->file_fd >= 0 ? CS_UPLOAD_DATA : CS_DONE);
+    return 0;
+}
+
+/* 分段上传：c->pos / c->end 已是本段的 [start, end)；协商了 CAP_RANGE_STAGE 时写暂存文件，
+   start == end == filesize 是提交，在这里改名发布并回两个字 */
+int conn_start_upload_range(struct conn *c) {
+    uint64_t start = c->pos, end = c->end;
+    int staged = (c->caps & CAP_RANGE_STAGE) != 0;
+    if (staged && start == c->filesize && end == c->filesize) {
+        if (range_commit(c->filename, c->filesize) != 0) return conn_reply_error(c, 1);
+        uint64_t reply[2] = { htonll(c->filesize), htonll(c->filesize) };
+        memcpy(c->reply, reply, sizeof(reply));
+        c->reply_len = sizeof(reply);
+        c->reply_sent = 0;
+        c->after_reply = CS_DONE;
+        c->state = CS_SEND_REPLY;
+        return 0;
+    }
+    char path[STAGING_PATH_MAX];
+    c->file_fd = range_path(c->filename, staged, path) == 0 ? range_open(path, c->filesize, start, end) : -1;
+    if (c->file_fd < 0) return conn_reply_error(c, 1);
+    c->range_acks = 1;
+    c->next_ack = start + RANGE_ACK_INTERVAL;
+    conn_set_reply(c, start, CS_UPLOAD_DATA);
+    return 0;
+}
+
+/* 批量上传的下一个文件：c->bulk_name 已收到，c->end 是它的大小 */
+int conn_open_bulk_file(struct conn *c) {
+    char path[1024];
+    if (bulk_path(c->filename, c->bulk_name, path, sizeof(path)) != 0) return -1;
+    c->file_fd = bulk_begin_file(&c->bulk, path);
+    if (c->file_fd < 0) return -1;
+    c->state = CS_UPLOAD_DATA;
+    return 0;
+}
+
+/* 批量上传结束：让剩下的文件与目录落盘后回复文件数 */
+int conn_finish_bulk(struct conn *c) {
+    if (bulk_sync(&c->bulk) != 0) return -1;
+    conn_set_reply(c, c->bulk_count, CS_DONE);
+    return 0;
+}
+
+/* 连接中途断开：提交已写入的暂存，之后由循环关闭连接 */
+int conn_abort_upload(struct conn *c) {
+    conn_drop_stage(c);
+    return -1;
+}
+
+/* 下载的打开留在循环线程上：只是一次路径查找加 open，-F 命中时连这也省了。
+ * 与 handle_download 一样经描述符缓存打开，-F 对 epoll 引擎同样生效 */
+int conn_open_download(struct conn *c) {
+    struct open_file f;
+    if (file_open(c->filename, &f, 1) != 0) {
+        perror("open");
+        return -1;
+    }
+    c->file_fd = f.fd;
+    c->cached = f.cached;
+    c->filesize = (uint64_t)f.st.st_size;
+    return 0;
+}
+
+int conn_start_download_range(struct conn *c, uint64_t start, uint64_t end) {
+    if (conn_open_download(c) != 0) return conn_reply_error(c, 1);
+    c->pos = start;
+    c->end = end > c->filesize ? c->filesize : end;
+    ra_start(&c->ra, c->file_fd, c->pos, c->filesize, c->cached != NULL);
+    conn_set_reply(c, c->filesize, c->pos < c->end ? CS_DOWNLOAD_DATA : CS_DONE);
+    return 0;
+}
+
+int conn_start_download(struct conn *c, uint64_t client_offset) {
+    if (conn_open_download(c) != 0) return conn_reply_error(c, 2);
+    c->pos = client_offset > c->filesize ? c->filesize : client_offset;
+    c->end = c->filesize;
+    ra_start(&c->ra, c->file_fd, c->pos, c->filesize, c->cached != NULL);
+    uint64_t net_filesize = htonll(c->filesize);
+    uint64_t net_server_offset = htonll(c->pos);
+    memcpy(c->reply, &net_filesize, sizeof(net_filesize));
+    memcpy(c->reply + 8, &net_server_offset, sizeof(net_server_offset));
+    c->reply_len = sizeof(net_filesize) + sizeof(net_server_offset);
+    c->reply_sent = 0;
+    c->after_reply = CS_DOWNLOAD_DATA;
+    c->state = CS_SEND_REPLY;
+    return 0;
+}
+
+/* 把阻塞的文件操作 op 交给辅助线程，op 可以放心修改连接的任何字段。返回 1 表示已交出，调用方不得再访问 c */
+int conn_block(struct event_loop *loop, struct conn *c, int (*op)(struct conn *)) {
+    if (conn_park(loop, c) != 0) return -1;
+    c->op = op;
+    c->op_next = NULL;
+    pthread_mutex_lock(&g_helpers.lock);
+    if (g_helpers.tail) g_helpers.tail->op_next = c;
+    else g_helpers.head = c;
+    g_helpers.tail = c;
+    pthread_cond_signal(&g_helpers.work);
+    pthread_mutex_unlock(&g_helpers.lock);
+    return 1;
+}
+
+void *helper_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&g_helpers.lock);
+        while (!g_helpers.head) pthread_cond_wait(&g_helpers.work, &g_helpers.lock);
+        struct conn *c = g_helpers.head;
+        g_helpers.head = c->op_next;
+        if (!g_helpers.head) g_helpers.tail = NULL;
+        pthread_mutex_unlock(&g_helpers.lock);
+
+        loop_post(c, c->op(c));
+    }
+    return NULL;
+}
+
+/* 推进状态机：0 等待下一次事件，1 已交给辅助线程（不得再访问 c），-1 关闭连接（出错或传输结束） */
+int conn_advance(struct event_loop *loop, struct conn *c) {
+    size_t budget = LOOP_IO_BUDGET;
+    int r;
+    while (1) {
+        switch (c->state) {
+        case CS_MODE_LEN:
+            if ((r = conn_read(c, c->field, 4)) <= 0) return r;
+            uint32_t mode_len;
+            memcpy(&mode_len, c->field, 4);
+            c->need = ntohl(mode_len);
+            if (c->need == PROTO_MAGIC && !c->hello_done) {
+                c->state = CS_HELLO;
+                break;
+            }
+            if (c->need == 0 || c->need >= sizeof(c->mode)) return -1;
+            c->state = CS_MODE;
+            break;
+
+        case CS_HELLO: {
+            // 本引擎不声明压缩能力，握手后没有压缩级别要读
+            if ((r = conn_read(c, c->field, 8)) <= 0) return r;
+            uint32_t hello[2], reply[3];
+            memcpy(hello, c->field, sizeof(hello));
+            c->caps = hello_reply(ntohl(hello[0]), ntohl(hello[1]), reply);
+            c->hello_done = 1;
+            memcpy(c->reply, reply, sizeof(reply));
+            c->reply_len = sizeof(reply);
+            c->reply_sent = 0;
+            c->after_reply = CS_MODE_LEN;
+            c->state = CS_SEND_REPLY;
+            break;
+        }
+
+        case CS_MODE:
+            if ((r = conn_read(c, c->mode, c->need)) <= 0) return r;
+            c->mode[c->need] = '\0';
+            c->state = CS_NAME_LEN;
+            break;
+
+        case CS_NAME_LEN:
+            if ((r = conn_read(c, c->field, 4)) <= 0) return r;
+            uint32_t name_len;
+            memcpy(&name_len, c->field, 4);
+            c->need = ntohl(name_len);
+            if (c->need == 0 || c->need >= 512) return -1;
+            c->filename = malloc(c->need + 1);
+            if (!c->filename) return -1;
+            c->state = CS_NAME;
+            break;
+
+        case CS_NAME:
+            if ((r = conn_read(c, c->filename, c->need)) <= 0) return r;
+            c->filename[c->need] = '\0';
+            if (strcmp(c->mode, "upload") == 0) c->state = CS_UPLOAD_SIZE;
+            else if (strcmp(c->mode, "download") == 0) c->state = CS_DOWNLOAD_OFFSET;
+            else if (strcmp(c->mode, "upload_range") == 0) c->state = CS_UPLOAD_RANGE_HDR;
+            else if (strcmp(c->mode, "download_range") == 0) c->state = CS_DOWNLOAD_RANGE_HDR;
+            else if (strcmp(c->mode, "upload_bulk") == 0) {
+                char path[1024];
+                if (bulk_path(".", c->filename, path, sizeof(path)) != 0) return -1;
+                c->bulk_name = malloc(512);
+                if (!c->bulk_name) return -1;
+                c->state = CS_BULK_NAME_LEN;
+            }
+            else return -1;
+            break;
+
+        case CS_BULK_NAME_LEN:
+            if ((r = conn_read(c, c->field, 4)) <= 0) return r;
+            uint32_t bulk_len;
+            memcpy(&bulk_len, c->field, 4);
+            c->need = ntohl(bulk_len);
+            if (c->need == 0) return conn_block(loop, c, conn_finish_bulk);
+            if (c->need >= 512) return -1;
+            c->state = CS_BULK_NAME;
+            break;
+
+        case CS_BULK_NAME:
+            if ((r = conn_read(c, c->bulk_name, c->need)) <= 0) return r;
+            c->bulk_name[c->need] = '\0';
+            c->state = CS_BULK_SIZE;
+            break;
+
+        case CS_BULK_SIZE: {
+            if ((r = conn_read(c, c->field, 8)) <= 0) return r;
+            uint64_t size_net;
+            memcpy(&size_net, c->field, 8);
+            c->pos = 0;
+            c->end = ntohll(size_net);
+            return conn_block(loop, c, conn_open_bulk_file);
+        }
+
+        case CS_UPLOAD_RANGE_HDR: {
+            if ((r = conn_read(c, c->field, 24)) <= 0) return r;
+            uint64_t v[3];
+            memcpy(v, c->field, sizeof(v));
+            c->filesize = ntohll(v[0]);
+            c->pos = ntohll(v[1]);
+            c->end = ntohll(v[2]);
+            if (c->pos > c->end || c->end > c->filesize) return -1;
+            return conn_block(loop, c, conn_start_upload_range);
+        }
+
+        case CS_DOWNLOAD_RANGE_HDR: {
+            if ((r = conn_read(c, c->field, 16)) <= 0) return r;
+            uint64_t v[2];
+            memcpy(v, c->field, sizeof(v));
+            uint64_t start = ntohll(v[0]), end = ntohll(v[1]);
+            if (start > end) return -1;
+            if (conn_start_download_range(c, start, end) != 0) return -1;
+            break;
+        }
+
+        case CS_UPLOAD_SIZE:
+            if ((r = conn_read(c, c->field, 8)) <= 0) return r;
+            uint64_t filesize_net;
+            memcpy(&filesize_net, c->field, 8);
+            c->filesize = ntohll(filesize_net);
+            return conn_block(loop, c, conn_start_upload);
+
+        case CS_DOWNLOAD_OFFSET:
+            if ((r = conn_read(c, c->field, 8)) <= 0) return r;
+            uint64_t offset_net;
+            memcpy(&offset_net, c->field, 8);
+            if (conn_start_download(c, ntohll(offset_net)) != 0) return -1;
+            break;
+
+        case CS_SEND_REPLY:
+            while (c->reply_sent < c->reply_len) {
+                ssize_t n = send(c->fd, c->reply + c->reply_sent, c->reply_len - c->reply_sent, 0);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                    return -1;
+                }
+                c->reply_sent += (uint32_t)n;
+            }
+            c->state = c->after_reply;
+            break;
+
+        case CS_UPLOAD_DATA:
+            while (c->pos < c->end) {
+                if (budget == 0) return 0;  // 让出给其它连接，数据还在内核里，LT 模式会再次唤醒
+                if (c->range_acks && c->pos >= c->next_ack) return conn_block(loop, c, conn_range_ack);
+                if (c->stage.fd >= 0 && c->pos >= c->next_commit) return conn_block(loop, c, conn_stage_commit);
+                uint64_t left = c->end - c->pos;
+                if (!c->no_splice && thread_pipe() >= 0) {
+                    size_t want = left > t_pipe_size ? t_pipe_size : (size_t)left;
+                    ssize_t n = splice(c->fd, NULL, t_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                        if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                            c->no_splice = 1;  // 改走下面的 recv + pwrite
+                            continue;
+                        }
+                        perror("splice from socket");
+                        return -1;
+                    }
+                    if (n == 0) {
+                        fprintf(stderr, "client closed during upload\n");
+                        return -1;
+                    }
+                    // 管道必须当场排空，它由本循环的所有连接共用
+                    if (pipe_to_file(c->file_fd, c->pos, (size_t)n, loop->buf, LOOP_BUF_SIZE) != 0) {
+                        thread_pipe_reset();
+                        return -1;
+                    }
+                    c->pos += (uint64_t)n;
+                    budget = (size_t)n > budget ? 0 : budget - (size_t)n;
+                    continue;
+                }
+                size_t want = left > LOOP_BUF_SIZE ? LOOP_BUF_SIZE : (size_t)left;
+                ssize_t n = recv(c->fd, loop->buf, want, 0);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                    perror("recv");
+                    return -1;
+                }
+                if (n == 0) {
+                    fprintf(stderr, "client closed during upload\n");
+                    return -1;
+                }
+                if (pwrite_all(c->file_fd, loop->buf, (size_t)n, c->pos) != 0) return -1;
+                c->pos += (uint64_t)n;
+                budget = (size_t)n > budget ? 0 : budget - (size_t)n;
+            }
+            if (!c->bulk_name) return conn_finish_upload(loop, c);
+            if (c->bulk.n + 1 == BULK_BATCH) return conn_block(loop, c, conn_add_bulk_file);
+            if (conn_add_bulk_file(c) != 0) return -1;
+            break;
+
+        case CS_DOWNLOAD_DATA:
+            while (c->pos < c->end) {
+                if (budget == 0) return 0;
+                ra_advance(&c->ra, c->pos);
+                uint64_t left = c->end - c->pos;
+                if (!c->no_sendfile) {
+                    off_t off = (off_t)c->pos;
+                    ssize_t sent = sendfile(c->fd, c->file_fd, &off, left > budget ? budget : (size_t)left);
+                    if (sent < 0) {
+                        if (errno == EINTR) continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                        if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                            c->no_sendfile = 1;  // 改走下面的 pread + send
+                            continue;
+                        }
+                        perror("sendfile");
+                        return -1;
+                    }
+                    if (sent == 0) return -1;  // 文件在传输中被截断
+                    c->pos += (uint64_t)sent;
+                    budget = (size_t)sent > budget ? 0 : budget - (size_t)sent;
+                    continue;
+                }
+                size_t want = left > LOOP_BUF_SIZE ? LOOP_BUF_SIZE : (size_t)left;
+                ssize_t n = pread(c->file_fd, loop->buf, want, (off_t)c->pos);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    perror("pread");
+                    return -1;
+                }
+                if (n == 0) return -1;  // 文件在传输中被截断
+                // 只推进实际发出的字节，剩余部分下次从文件重新读，连接无需自带缓冲
+                ssize_t sent = send(c->fd, loop->buf, (size_t)n, 0);
+                if (sent < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                    return -1;
+                }
+                c->pos += (uint64_t)sent;
+                budget = (size_t)sent > budget ? 0 : budget - (size_t)sent;
+            }
+            c->state = CS_DONE;
+            break;
+
+        case CS_DONE:
+            if (!(c->caps & CAP_PIPELINE)) return -1;
+            conn_next_request(c);
+            break;
+
+        case CS_BLOCKED:
+            return 1;
+        }
+    }
+}
+
+/* 按当前状态登记读或写事件；从辅助线程回来的连接（events 为 0）重新加入 epoll */
+int conn_update_events(struct event_loop *loop, struct conn *c) {
+    uint32_t want = (c->state == CS_SEND_REPLY || c->state == CS_DOWNLOAD_DATA) ? EPOLLOUT : EPOLLIN;
+    if (want == c->events) return 0;
+    struct epoll_event ev;
+    ev.events = want;
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev) != 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    c->events = want;
+    return 0;
+}
+
+void loop_accept(struct event_loop *loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int fd = accept4(loop->listen_fd, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+
+        printf("Client connected: %s:%d\n",
+               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+        set_nodelay(fd);
+        struct conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->file_fd = -1;
+        c->stage.fd = c->stage.ofs_fd = -1;
+        c->state = CS_MODE_LEN;
+        c->events = EPOLLIN;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("epoll_ctl");
+            conn_close(c);
+        }
+    }
+}
+
+/* 推进一个连接，按结果登记事件或关闭；上传中途关闭时暂存的提交（fdatasync）也交给辅助线程 */
+void loop_run(struct event_loop *loop, struct conn *c) {
+    int r = conn_advance(loop, c);
+    if (r > 0) return;
+    if (r == 0 && conn_update_events(loop, c) == 0) return;
+    if (c->stage.fd >= 0 && c->state != CS_BLOCKED && conn_block(loop, c, conn_abort_upload) > 0) return;
+    conn_close(c);
+}
+
+/* 接回辅助线程完成的连接 */
+void loop_complete(struct event_loop *loop) {
+    uint64_t n;
+    if (read(loop->efd, &n, sizeof(n)) < 0 && errno != EAGAIN) perror("eventfd read");
+    pthread_mutex_lock(&loop->lock);
+    struct conn *c = loop->done;
+    loop->done = NULL;
+    pthread_mutex_unlock(&loop->lock);
+    while (c) {
+        struct conn *next = c->op_next;
+        if (c->op_rc != 0) conn_close(c);
+        else loop_run(loop, c);
+        c = next;
+    }
+}
+
+/* 事件循环线程：所有循环共享监听套接字，EPOLLEXCLUSIVE 避免惊群 */
+void *event_loop_main(void *arg) {
+    struct event_loop *loop = arg;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) loop_accept(loop);
+            else if (events[i].data.ptr == loop) loop_complete(loop);
+            else loop_run(loop, events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+int start_event_loops(int listen_fd, int nloops) {
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        perror("fcntl");
+        return -1;
+    }
+    for (int i = 0; i < LOOP_HELPERS; i++) {
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, helper_main, NULL);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    for (int i = 0; i < nloops; i++) {
+        struct event_loop *loop = calloc(1, sizeof(*loop));
+        if (!loop) return -1;
+        loop->listen_fd = listen_fd;
+        loop->buf = malloc(LOOP_BUF_SIZE);
+        loop->epfd = epoll_create1(0);
+        loop->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&loop->lock, NULL);
+        if (!loop->buf || loop->epfd < 0 || loop->efd < 0) {
+            perror("epoll_create1");
+            return -1;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;  // NULL 表示监听套接字
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+            perror("epoll_ctl listen");
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = loop;  // 循环自己表示完成通知
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->efd, &ev) != 0) {
+            perror("epoll_ctl eventfd");
+            return -1;
+        }
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, event_loop_main, loop);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));  // 错误码由返回值给出，不在 errno 里
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+/* 统计线程：收到 SIGUSR1 时打印各编码的分帧计数与去重计数（其它线程都屏蔽了该信号） */
+void *stats_main(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) == 0) {
+        frame_stats_dump();
+        dedup_stats_dump();
+        session_stats_dump();
+        sync_stats_dump();
+        hot_stats_dump();
+        fd_stats_dump();
+    }
+    return NULL;
+}
+
+/* 解析字节数，支持 K/M/G 后缀 */
+int parse_size(const char *s, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || end == s) return -1;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0') return -1;
+    *out = (uint64_t)v;
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p port] [-w workers] [-q queue_len] [-e threads|epoll|uring] [-D store_dir] [-L session_log]\n"
+                    "       [-a readahead] [-A drop_behind_min] [-O] [-S none|batch[:usec]|file] [-C hot_cache_bytes] [-F fd_cache_entries]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);  // 忽略 SIGPIPE，send 出错时只返回 -1，不会杀进程
+    crc32c_init();
+    sha256_init();
+
+    int ch;
+    unsigned long window;
+    char *end;
+    while ((ch = getopt(argc, argv, "p:w:q:e:D:L:a:A:OS:C:F:h")) != -1) {
+        switch (ch) {
+        case 'p': g_cfg.port = atoi(optarg); break;
+        case 'w': g_cfg.workers = atoi(optarg); break;
+        case 'q': g_cfg.queue_len = atoi(optarg); break;
+        case 'D': g_cfg.store = optarg; break;
+        case 'L': g_cfg.session_log = optarg; break;
+        case 'F': g_cfg.fd_cache = atoi(optarg); break;
+        case 'O': g_cfg.direct = 1; break;
+        case 'S':
+            if (strcmp(optarg, "none") == 0) g_cfg.durability = DURABLE_NONE;
+            else if (strcmp(optarg, "batch") == 0) g_cfg.durability = DURABLE_BATCH;
+            else if (strcmp(optarg, "file") == 0) g_cfg.durability = DURABLE_FILE;
+            else if (strncmp(optarg, "batch:", 6) == 0 && optarg[6] >= '0' && optarg[6] <= '9' &&
+                     (window = strtoul(optarg + 6, &end, 10)) <= 1000000 && *end == '\0') {
+                g_cfg.durability = DURABLE_BATCH;  // 窗口最长 1 秒
+                g_cfg.sync_window = (unsigned)window;
+            } else {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'a':
+        case 'A':
+        case 'C':
+            if (parse_size(optarg, ch == 'a' ? &g_cfg.readahead : ch == 'A' ? &g_cfg.drop_behind : &g_cfg.hot_bytes) != 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "threads") == 0) g_cfg.engine = ENGINE_THREADS;
+            else if (strcmp(optarg, "epoll") == 0) g_cfg.engine = ENGINE_EPOLL;
+            else if (strcmp(optarg, "uring") == 0) g_cfg.engine = ENGINE_URING;
+            else {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    if (g_cfg.port <= 0 || g_cfg.port > 65535 || g_cfg.workers < 0 || g_cfg.queue_len < 0 || g_cfg.fd_cache < 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (g_cfg.workers == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        g_cfg.workers = ncpu > 0 ? (int)ncpu : 1;
+    }
+    if (g_cfg.queue_len == 0) {
+        g_cfg.queue_len = g_cfg.workers * QUEUE_PER_WORKER;
+    }
+    if (g_cfg.store && store_init(g_cfg.store) != 0) exit(1);
+
+    // 先屏蔽 SIGUSR1 再建线程，之后创建的线程都继承该屏蔽字，只由统计线程 sigwait
+    static sigset_t stats_set;
+    sigemptyset(&stats_set);
+    sigaddset(&stats_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stats_set, NULL);
+    pthread_t stats_tid;
+    if (pthread_create(&stats_tid, NULL, stats_main, &stats_set) == 0) pthread_detach(stats_tid);
+    if (g_cfg.fd_cache > 0 && fd_cache_init() != 0) {
+        fprintf(stderr, "fd cache disabled\n");
+        g_cfg.fd_cache = 0;
+    }
+    if (sync_start() != 0) return 1;
+    if (g_cfg.session_log && session_init(g_cfg.session_log) != 0) exit(1);  // 启动时的压缩要用落盘线程
+
+    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    int opt = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)g_cfg.port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(server_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+
+    if (listen(server_sock, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    if (g_cfg.engine == ENGINE_EPOLL) {
+        if (start_event_loops(server_sock, g_cfg.workers) != 0) exit(1);
+        printf("Server listening on port %d (%d epoll loops)...\n", g_cfg.port, g_cfg.workers);
+        while (1) pause();
+    }
+
+    if (queue_init(&g_queue, g_cfg.queue_len) != 0) {
+        perror("queue_init");
+        exit(1);
+    }
+    for (int i = 0; i < g_cfg.workers; i++) {
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, worker_main, &g_queue);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+
+    printf("Server listening on port %d (%d %s workers, queue %d)...\n",
+           g_cfg.port, g_cfg.workers, g_cfg.engine == ENGINE_URING ? "io_uring" : "thread", g_cfg.queue_len);
+
+    while (1) {
+        struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
         int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
         if (client_sock < 0) {
@@ -280,7 +5294,8 @@ int main() {
         printf("Client connected: %s:%d\n",
                inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
-        handle_client(client_sock);
+        set_nodelay(client_sock);
+        queue_push(&g_queue, client_sock);  // 交给工作线程，acceptor 立即回去 accept
     }
 
     close(server_sock);
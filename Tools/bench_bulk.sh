@@ -0,0 +1,39 @@
+#!/bin/sh
+# 小文件上传对比：逐个文件单独运行客户端 / 会话模式 / bulk 模式
+# 用法: Tools/bench_bulk.sh [文件数] [单文件最大字节] [服务端参数...]
+# 需要先在仓库根目录编译出 ./server 和 ./client（见 README）
+set -e
+N=${1:-10000}
+MAX=${2:-16384}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+PORT=9100
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $SPID 2>/dev/null; rm -rf "$WORK"' EXIT
+
+mkdir -p "$WORK/src/files" "$WORK/srv"
+cd "$WORK/src"
+i=0
+while [ $i -lt $N ]; do
+    head -c $(( $(od -An -N2 -tu2 /dev/urandom) % MAX )) /dev/urandom > files/f$i
+    i=$((i + 1))
+done
+echo "$N files, $(du -sh files | cut -f1)"
+
+(cd "$WORK/srv" && exec "$ROOT/server" -p $PORT "$@") > "$WORK/srv.log" 2>&1 &
+SPID=$!
+sleep 0.5
+
+run() {
+    rm -rf "$WORK/srv/files" && mkdir "$WORK/srv/files"
+    t0=$(date +%s.%N)
+    "$@" > "$WORK/client.log" 2>&1
+    t1=$(date +%s.%N)
+    diff -r files "$WORK/srv/files" > /dev/null || { echo "mismatch"; exit 1; }
+    echo "$t0 $t1" | awk '{ printf "%.2f s\n", $2 - $1 }'
+}
+
+printf "single : "; run sh -c "for f in files/*; do \"$ROOT/client\" upload 127.0.0.1 $PORT \$f || exit 1; done"
+printf "session: "; run "$ROOT/client" upload 127.0.0.1 $PORT files/*
+printf "bulk   : "; run "$ROOT/client" bulk 127.0.0.1 $PORT files